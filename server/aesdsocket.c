@@ -3,17 +3,65 @@ Author: Visweshwaran Baskaran
 File name: aesdsocket.c
 File description:
 This C program implements a simple socket server that listens on port 9000, accepts incoming connections, and logs received data to a file. It can be run in daemon mode using the '-d' command-line argument.
+The '-m thread|epoll|pool|uring' argument selects between one thread per connection (default), edge-triggered
+epoll event loops, a pre-spawned worker pool and io_uring rings; '-t' sets the number of loop/worker/ring threads
+and '-q' the capacity of the pool's hand-off queue. '-c bytes' keeps up to that much of the log tail in memory for replays.
+'-b' sets the listen backlog and '-s N' (epoll/uring) opens N SO_REUSEPORT listening sockets, one per loop/ring,
+so connection storms are accepted in parallel instead of through one accept loop.
+'-D usec[:bytes]' enables durable mode: replays are only sent once the record is fdatasync()ed, with one sync
+shared by every record published within the commit window.
+'-H bytes' is the epoll outbound queue high-water mark: a client with more unsent replay data than that is not
+read from until it catches up, so a slow reader never holds up its event loop.
+A client sending 'AESDTAIL' switches its connection to tail mode: each reply then carries only the log bytes
+appended since the previous reply instead of the whole log.
+A client sending 'AESDBINARY' switches its connection to the binary protocol (frame.h): varint length-prefixed
+data, seek and stats frames, so records may contain newlines; pipelined data frames are answered with one
+batched ack instead of a replay each.
+Thread per connection mode keeps its connections in a preallocated slot registry (conn_registry.c), so
+registering and reaping a connection is O(1) without a heap allocation.
+The file backend's timestamp records are driven by a timerfd polled by the accept loop, next to the listener.
+'-U path' enables hot restart: a new process started with the same path takes the listening socket over from
+the running one, and in thread mode its live connections too, so a deploy refuses no connection
+(hot_restart.c). The signal handlers only set a flag and wake the accept loop, which does the cleanup.
+'-g bytes' stores the log as segment files PATH.<index> of that size plus PATH.manifest; unlike the single
+file it is kept across restarts. '-R bytes' and '-A seconds' bound it: the oldest segments are dropped once
+the rest holds that many bytes, or once they were sealed that long ago. '-z level' compresses sealed segments
+with zlib in the background and '-Z bytes' keeps that much of recently replayed segments decompressed.
+'-B file|chardev|memory|ring' selects the storage backend at runtime (backend.h) and '-P path' its file or device;
+'ring' keeps the aesdchar driver's last ten writes and its SEEKTO semantics in user space, without the module.
+'-p port' and '-M bytes' set the port and the replay copy buffer. '-f file' reads any option from KEY=value
+lines first, so one binary can be A/B benchmarked against several configurations; the command line overrides it.
+'-O option[,option...]' selects the socket profile: accept4 (non-blocking, close-on-exec accepts), nodelay
+(TCP_NODELAY), cork (TCP_CORK around each replay), defer[=seconds] (TCP_DEFER_ACCEPT), sndbuf=bytes and
+rcvbuf=bytes; 'latency' is shorthand for accept4,nodelay,cork,defer.
+Receive buffers, outbound queue segments and replay copy buffers come from a lock-free pool of 4/16/64 KiB
+buffers (buffer_pool.c); '-k bytes' sizes the slab of each class (0 disables the pool) and AESDSTATS reports
+its hit rate and peak bytes.
 References:
 [1] https://www.geeksforgeeks.org/signals-c-language/
 [2] https://beej.us/guide/bgnet/html/ 6.1 A Simple Stream Server
 [3] https://www.thegeekstuff.com/2012/02/c-daemon-process/
 [4] Linux System Programming Chapter 10: Signals Pg. 342 Examples
 [5] Linux manual pages https://linux.die.net/man
-[6] queue.h leveraged from: https://raw.githubusercontent.com/freebsd/freebsd/stable/10/sys/sys/queue.h
-[7] Unix timestamp: https://stackoverflow.com/questions/1551597/using-strftime-in-c-how-can-i-format-time-exactly-like-a-unix-timestamp
+[6] Unix timestamp: https://stackoverflow.com/questions/1551597/using-strftime-in-c-how-can-i-format-time-exactly-like-a-unix-timestamp
  */
 
-#include "includes/queue.h"
+#define _GNU_SOURCE // accept4()
+#include "includes/aesdsocket.h"
+#include "includes/backend.h"
+#include "includes/event_loop.h"
+#include "includes/thread_pool.h"
+#include "includes/uring_loop.h"
+#include "includes/listener.h"
+#include "includes/line_framer.h"
+#include "includes/storage.h"
+#include "includes/replay_cache.h"
+#include "includes/stats.h"
+#include "includes/outq.h"
+#include "includes/conn_registry.h"
+#include "includes/hot_restart.h"
+#include "includes/frame.h"
+#include "includes/buffer_pool.h"
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
@@ -23,58 +71,63 @@ References:
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
-#include <sys/time.h>
-#include "../aesd-char-driver/aesd_ioctl.h"
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <time.h>
 
-#define PORT "9000" // Change the port to 9000
-#define BACKLOG 10 // How many pending connections queue will hold
-#define MAX_PACKET_SIZE 30000 // Maximum packet size, set as a large value instead of 1024 for sockettest.sh test cases
-
-#define USE_AESD_CHAR_DEVICE 1
-
-#ifdef USE_AESD_CHAR_DEVICE
-#define PATH "/dev/aesdchar"
-#else
-#define PATH "/var/tmp/aesdsocketdata"
-#endif
-
-#define SYSCALL_ERROR - 1
-#define TIMESTAMP_FORMAT "%Y %b %d %H:%M:%S" // RFC 2822 compliant strftime format
+#define DEFAULT_EPOLL_THREADS 4 // event loop threads used by '-m epoll' when '-t' is not given
+#define DEFAULT_POOL_WORKERS 32 // workers used by '-m pool' when '-t' is not given
+#define DEFAULT_QUEUE_CAPACITY 128 // accepted sockets waiting for a pool worker
+#define SENDFILE_CHUNK (1024 * 1024) // bytes requested per sendfile() call
+#define CONFIG_LINE_MAX 512
+#define OPTSTRING "dm:t:q:c:b:s:D:H:g:R:A:z:Z:wU:p:P:B:M:f:O:k:"
+#define DEFAULT_DEFER_ACCEPT_S 1 // TCP_DEFER_ACCEPT timeout of '-O defer' without a value
 
 int sockfd; // declaring socket file descriptor as global for signal handlers
-int file_fd;
-struct slist_data_s * datap = NULL; // for iterating
-#ifndef USE_AESD_CHAR_DEVICE
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
-bool signal_received = false;
-
-struct thread_data {
-  pthread_t thread;
-  int client_sockfd;
-  struct sockaddr_storage client_addr;
-  bool thread_complete_success;
-};
-
-#ifndef USE_AESD_CHAR_DEVICE
-struct timer_data {
-  pthread_t thread;
-};
-#endif
-
-struct slist_data_s {
-  struct thread_data connection_data;
-  SLIST_ENTRY(slist_data_s) entries;
+atomic_bool signal_received = false;
+static int wake_fd = -1; // eventfd the signal handler writes so the accept loop's poll() returns at once
+static atomic_bool log_open = false; // see log_ready()
+static pthread_mutex_t log_open_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_opened = PTHREAD_COND_INITIALIZER; // broadcast when log_open is set, or on shutdown
+static bool daemon_mode = false;
+struct server_config config = {
+  #ifdef USE_AESD_CHAR_DEVICE
+  .backend = & chardev_backend,
+  #else
+  .backend = & file_backend,
+  #endif
+  .path = NULL,
+  .port = PORT,
+  .mode = MODE_THREAD,
+  .num_threads = 0,
+  .queue_capacity = DEFAULT_QUEUE_CAPACITY,
+  .cache_bytes = 0,
+  .backlog = BACKLOG,
+  .max_packet_size = MAX_PACKET_SIZE,
+  .pool_bytes = BUFFER_POOL_DEFAULT_BYTES,
+  .shards = 0,
+  .durable = false,
+  .sync_window_us = 0,
+  .sync_window_bytes = 0,
+  .outq_high_water = OUTQ_DEFAULT_HIGH_WATER,
+  .segment_bytes = 0,
+  .retain_bytes = 0,
+  .retain_seconds = 0,
+  .compress_level = 0,
+  .hot_cache_bytes = 0,
+  .writer_thread = false,
+  .restart_path = NULL,
 };
-SLIST_HEAD(slisthead, slist_data_s)
-head;
 
 /**
  * @brief Get the IP address from a sockaddr structure.
@@ -102,6 +155,7 @@ void * get_in_addr(struct sockaddr * sa) {
 void log_accepted_connection(struct sockaddr_storage their_addr) {
   char s[INET6_ADDRSTRLEN];
   inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr * ) & their_addr), s, sizeof s);
+  stats_add(STAT_CONNECTIONS_ACCEPTED, 1);
   syslog(LOG_INFO, "Accepted connection from %s", s);
   printf("Accepted connection from %s\n", s);
 }
@@ -116,257 +170,527 @@ void log_accepted_connection(struct sockaddr_storage their_addr) {
 void log_closed_connection(struct sockaddr_storage their_addr) {
   char s[INET6_ADDRSTRLEN];
   inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr * ) & their_addr), s, sizeof s);
+  stats_add(STAT_CONNECTIONS_CLOSED, 1);
   syslog(LOG_INFO, "Closed connection from %s", s);
-  printf("Accepted connection from %s\n", s);
+  printf("Closed connection from %s\n", s);
 }
 
 /**
- * @brief Generates and appends timestamps to a file.
+ * @brief Create the timer driving the timestamp records: the first expires at once, then every TIMESTAMP_PERIOD_S.
+ * @return The non-blocking timerfd, or SYSCALL_ERROR
+ */
+static int timestamp_timer_open(void) {
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd == SYSCALL_ERROR) {
+    syslog(LOG_ERR, "timerfd_create failed: %s", strerror(errno));
+    perror("timerfd_create");
+    return SYSCALL_ERROR;
+  }
+  struct itimerspec period = {
+    .it_interval = { .tv_sec = TIMESTAMP_PERIOD_S, .tv_nsec = 0 },
+    .it_value = { .tv_sec = 0, .tv_nsec = 1 },
+  };
+  if (timerfd_settime(timer_fd, 0, & period, NULL) == SYSCALL_ERROR) {
+    syslog(LOG_ERR, "timerfd_settime failed: %s", strerror(errno));
+    perror("timerfd_settime");
+    close(timer_fd);
+    return SYSCALL_ERROR;
+  }
+  return timer_fd;
+}
+
+/**
+ * @brief Consume the timer's expirations and append one timestamp record.
  *
- * @param thread_param A pointer to thread-specific data (struct thread_data) that may be used in the function.
- * @return NULL
+ * Expirations missed while the loop was busy are collapsed into one record. The formatted line is cached
+ * and only rebuilt with localtime_r()/strftime() when the wall clock second changed.
  */
-#ifndef USE_AESD_CHAR_DEVICE
-void * timestamp(void * thread_param) {
-  if (thread_param == NULL) {
-    // Handle invalid input gracefully
-    perror("NULL params\n");
-    return NULL;
+static void timestamp_tick(int timer_fd) {
+  static char line[64];
+  static size_t line_len = 0;
+  static time_t line_sec = -1;
+  uint64_t expirations;
+  if (read(timer_fd, & expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return; // EAGAIN: woken for another descriptor
   }
-  //struct thread_data * thread_func_args = (struct thread_data * ) thread_param;
-  int file_fd = open(PATH, O_RDWR | O_APPEND | O_CREAT, 0664);
-  if (file_fd == -1) {
-    syslog(LOG_ERR, "Open failed: %s", strerror(errno));
-    perror("open");
-    close(file_fd);
+  struct timespec now;
+  struct tm tm;
+  clock_gettime(CLOCK_REALTIME, & now);
+  if (now.tv_sec != line_sec && localtime_r( & now.tv_sec, & tm) != NULL) {
+    line_len = strftime(line, sizeof(line), "timestamp:" TIMESTAMP_FORMAT "\n", & tm);
+    line_sec = now.tv_sec;
+  }
+  if (line_len > 0) {
+    config.backend -> timestamp(line, line_len);
+  }
+}
+
+/**
+ * @brief Wait until a non-blocking socket can accept more data.
+ * @return 0 when writable, SYSCALL_ERROR on failure
+ */
+static int wait_writable(int client_sockfd) {
+  struct pollfd pfd = {
+    .fd = client_sockfd,
+    .events = POLLOUT
+  };
+  if (poll( & pfd, 1, -1) == SYSCALL_ERROR && errno != EINTR) {
+    perror("poll");
+    return SYSCALL_ERROR;
   }
+  return 0;
+}
 
-  char fmt[64];
-  struct timeval tv;
-  struct tm * tm;
+/**
+ * @brief Send a complete buffer to a client, retrying short sends.
+ *
+ * Non-blocking sockets are polled for POLLOUT instead of dropping the remainder of the buffer.
+ *
+ * @param client_sockfd The client socket.
+ * @param buf The data to send.
+ * @param len Number of bytes in buf.
+ * @return 0 on success, SYSCALL_ERROR if the connection failed
+ */
+int send_all(int client_sockfd, const char * buf, size_t len) {
+  while (len > 0) {
+    ssize_t bytes_sent = send(client_sockfd, buf, len, MSG_NOSIGNAL);
+    if (bytes_sent == SYSCALL_ERROR) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // Non-blocking sockets (epoll mode): wait until the socket drains instead of dropping data
+        if (wait_writable(client_sockfd) != 0) {
+          return SYSCALL_ERROR;
+        }
+        continue;
+      }
+      perror("send");
+      syslog(LOG_ERR, "send failed: %s", strerror(errno));
+      return SYSCALL_ERROR;
+    }
+    stats_add(STAT_BYTES_OUT, bytes_sent);
+    buf += bytes_sent;
+    len -= bytes_sent;
+  }
+  return 0;
+}
 
-  while (!signal_received) {
-    gettimeofday( & tv, NULL);
-    if ((tm = localtime( & tv.tv_sec)) != NULL) {
-      strftime(fmt, sizeof(fmt), "timestamp:%Y %b %d %H:%M:%S\n", tm);
+/**
+ * @brief Replay up to count bytes of file_fd to the client without copying through user space.
+ * @param client_sockfd The client socket.
+ * @param file_fd The file to send.
+ * @param offset Where to start; advanced past the bytes sent. NULL uses (and advances) the file position.
+ * @param count Maximum number of bytes to send, SIZE_MAX to send until end of file.
+ * @return 0 on success, SYSCALL_ERROR if the connection failed
+ */
+int replay_fd(int client_sockfd, int file_fd, off_t * offset, size_t count) {
+  ssize_t bytes_sent = 0;
+  // Copy straight from the page cache to the socket
+  while (count > 0) {
+    bytes_sent = sendfile(client_sockfd, file_fd, offset, count < SENDFILE_CHUNK ? count : SENDFILE_CHUNK);
+    if (bytes_sent == 0) {
+      return 0; // end of file
     }
+    if (bytes_sent == SYSCALL_ERROR) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (wait_writable(client_sockfd) != 0) {
+          return SYSCALL_ERROR;
+        }
+        continue;
+      }
+      if (errno == EINVAL || errno == ENOSYS) {
+        break; // no splice_read support (e.g. /dev/aesdchar): copy through user space below
+      }
+      perror("sendfile");
+      syslog(LOG_ERR, "sendfile failed: %s", strerror(errno));
+      return SYSCALL_ERROR;
+    }
+    count -= bytes_sent;
+    stats_add(STAT_REPLAY_ZERO_COPY_BYTES, bytes_sent);
+    stats_add(STAT_BYTES_OUT, bytes_sent);
+  }
+  if (count == 0) {
+    return 0;
+  }
 
-    if (pthread_mutex_lock( & mutex) != 0) {
-      perror("mutex_lock");
+  size_t buffer_cap;
+  char * send_buffer = (char * ) buffer_pool_get(config.max_packet_size, & buffer_cap);
+  if (send_buffer == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    perror("malloc failed");
+    return SYSCALL_ERROR;
+  }
+  int retval = 0;
+  ssize_t bytes_read;
+  // Read data from the file into the send_buffer
+  while (count > 0) {
+    size_t chunk = count < config.max_packet_size ? count : config.max_packet_size;
+    bytes_read = (offset != NULL) ? pread(file_fd, send_buffer, chunk, * offset) : read(file_fd, send_buffer, chunk);
+    if (bytes_read == 0) {
+      break;
+    }
+    if (bytes_read == SYSCALL_ERROR) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("read");
+      retval = SYSCALL_ERROR;
       break;
     }
-    ssize_t bytes_written = write(file_fd, fmt, strlen(fmt));
-    if (pthread_mutex_unlock( & mutex) != 0) {
-      perror("mutex_unlock");
+    if (send_all(client_sockfd, send_buffer, bytes_read) != 0) {
+      retval = SYSCALL_ERROR;
       break;
     }
+    if (offset != NULL) {
+      * offset += bytes_read;
+    }
+    count -= bytes_read;
+    stats_add(STAT_REPLAY_COPIED_BYTES, bytes_read);
+  }
+  buffer_pool_put(send_buffer, buffer_cap);
+  return retval;
+}
+
+/**
+ * @brief Answer the AESDSTATS command (or a FRAME_STATS frame) with the merged counters of every thread.
+ * @return true if the connection may continue, false if it should be closed
+ */
+static bool send_stats(int client_sockfd, struct client_session * session) {
+  char response[STATS_MAX_RESPONSE];
+  stats_add(STAT_STATS_COMMANDS, 1);
+  size_t len = stats_format(response, sizeof(response));
+  if (session -> framed) {
+    return frame_send(client_sockfd, session, FRAME_STATS_REPLY, response, len) == 0;
+  }
+  if (session -> out != NULL) {
+    return outq_push_copy(session -> out, response, len) == 0;
+  }
+  return send_all(client_sockfd, response, len) == 0;
+}
+
+/**
+ * @brief Send a FRAME_ACK for records data frames, the last of which ends at log offset end.
+ * @return true if the connection may continue, false if it should be closed
+ */
+static bool send_ack(int client_sockfd, struct client_session * session, uint64_t records, off_t end) {
+  uint8_t payload[2 * FRAME_VARINT_MAX];
+  size_t len = frame_put_varint(payload, records);
+  len += frame_put_varint(payload + len, (uint64_t) end);
+  return frame_send(client_sockfd, session, FRAME_ACK, (const char * ) payload, len) == 0;
+}
+
+/**
+ * @brief Hand a classified packet to the configured backend.
+ */
+static bool dispatch_packet(int client_sockfd, struct client_session * session, enum packet_kind kind, const char * buf, size_t len) {
+  bool retval;
+  if (session -> out != NULL) {
+    return config.backend -> handle(client_sockfd, session, kind, buf, len); // corked by the event loop's flush
+  }
+  // A replay is several sends (sendfile() chunks, cache copies): corked, they leave as full segments
+  listener_cork(client_sockfd, true);
+  retval = config.backend -> handle(client_sockfd, session, kind, buf, len);
+  listener_cork(client_sockfd, false);
+  return retval;
+}
 
-    if (bytes_written == -1) {
-      perror("write");
-      syslog(LOG_ERR, "write failed: %s", strerror(errno));
+/**
+ * @brief Classify one packet and hand it to the configured backend, which stores it (or applies an
+ * AESDCHAR_IOCSEEKTO command) and sends its log back to the client.
+ * @param client_sockfd The client socket the replay is sent to.
+ * @param session The connection's protocol state: where replies go, tail mode and the delivered offset.
+ * @param buf The packet, including its terminating newline.
+ * @param len Number of bytes in buf.
+ * @return true if the connection may continue, false if it should be closed
+ */
+bool handle_packet(int client_sockfd, struct client_session * session, const char * buf, size_t len) {
+  if (len == STATS_COMMAND_LEN && memcmp(buf, STATS_COMMAND, STATS_COMMAND_LEN) == 0) {
+    return send_stats(client_sockfd, session);
+  }
+  if (len == BINARY_COMMAND_LEN && memcmp(buf, BINARY_COMMAND, BINARY_COMMAND_LEN) == 0) {
+    // Everything after this line is framed; an empty ack confirms the switch
+    session -> framed = true;
+    stats_add(STAT_FRAMED_CONNECTIONS, 1);
+    return send_ack(client_sockfd, session, 0, 0);
+  }
+  enum packet_kind kind = PACKET_RECORD;
+  if (len == TAIL_COMMAND_LEN && memcmp(buf, TAIL_COMMAND, TAIL_COMMAND_LEN) == 0) {
+    kind = PACKET_TAIL;
+    stats_add(STAT_TAIL_COMMANDS, 1);
+    if (config.backend -> stable_offsets) {
+      session -> tail_mode = true;
+    } else {
+      syslog(LOG_WARNING, "AESDTAIL is not supported by the %s backend, keeping full replays", config.backend -> name);
     }
+  } else if (len >= SEEKTO_COMMAND_LEN && strncmp(buf, SEEKTO_COMMAND, SEEKTO_COMMAND_LEN) == 0) {
+    kind = PACKET_SEEKTO;
+    stats_add(STAT_SEEK_COMMANDS, 1);
+  } else {
+    stats_add(STAT_RECORDS, 1);
+  }
+  return dispatch_packet(client_sockfd, session, kind, buf, len);
+}
 
-    sleep(10);
+/**
+ * @brief Handle one frame other than FRAME_DATA.
+ * @return true if the connection may continue, false if it should be closed
+ */
+static bool handle_frame(int client_sockfd, struct client_session * session, uint8_t type, const char * payload, size_t len) {
+  if (type == FRAME_STATS) {
+    return send_stats(client_sockfd, session);
+  }
+  if (type != FRAME_SEEK) {
+    syslog(LOG_ERR, "Unknown frame type %u, closing connection", type);
+    return false;
   }
-  close(file_fd);
-  return NULL;
+  uint64_t write_cmd;
+  uint64_t write_cmd_offset;
+  int used = frame_get_varint((const uint8_t * ) payload, len, & write_cmd);
+  if (used <= 0 || frame_get_varint((const uint8_t * ) payload + used, len - used, & write_cmd_offset) <= 0) {
+    syslog(LOG_ERR, "Malformed seek frame, closing connection");
+    return false;
+  }
+  // The backends take the text command, whatever protocol it came in
+  char command[64];
+  int command_len = snprintf(command, sizeof(command), SEEKTO_COMMAND "%llu,%llu\n", (unsigned long long) write_cmd,
+    (unsigned long long) write_cmd_offset);
+  stats_add(STAT_SEEK_COMMANDS, 1);
+  return dispatch_packet(client_sockfd, session, PACKET_SEEKTO, command, command_len);
 }
-#endif
 
 /**
- * @brief Thread function to handle client connections and log data to a file.
+ * @brief Store the data frames buffered back to back and acknowledge them with one ack, or handle the next
+ * frame when it is not a data frame. The frame that ends a run stays buffered until the run is acknowledged.
+ * @return 1 if frames were handled, 0 if no complete frame is buffered, -1 if the connection should be closed
+ */
+static int handle_frames(int client_sockfd, struct client_session * session, struct line_framer * framer) {
+  uint8_t type;
+  const char * payload;
+  size_t len;
+  uint64_t records = 0;
+  off_t end = 0;
+  int result;
+  while ((result = line_framer_peek_frame(framer, & type)) > 0 && type == FRAME_DATA) {
+    line_framer_next_frame(framer, & type, & payload, & len);
+    stats_add(STAT_RECORDS, 1);
+    if (config.backend -> append(session, payload, len, & end) != 0) {
+      return -1;
+    }
+    records++;
+  }
+  if (result < 0) {
+    syslog(LOG_ERR, "Malformed frame, closing connection");
+    return -1;
+  }
+  if (records > 0) {
+    // In durable mode one group commit covers the whole run; an event loop parks the connection until it has
+    if (session -> out != NULL && config.backend -> durable != NULL && !config.backend -> durable(end)) {
+      session -> durable_wait = end;
+      session -> ack_records = records;
+      return 1;
+    }
+    if (config.backend -> wait_durable != NULL) {
+      config.backend -> wait_durable(end);
+    }
+    stats_add(STAT_FRAME_ACKS, 1);
+    return send_ack(client_sockfd, session, records, end) ? 1 : -1;
+  }
+  if (result == 0) {
+    return 0;
+  }
+  line_framer_next_frame(framer, & type, & payload, & len);
+  return handle_frame(client_sockfd, session, type, payload, len) ? 1 : -1;
+}
+
+int handle_next_request(int client_sockfd, struct client_session * session, struct line_framer * framer) {
+  const char * record;
+  size_t record_len;
+  if (session -> framed) {
+    return handle_frames(client_sockfd, session, framer);
+  }
+  if (!line_framer_next(framer, & record, & record_len)) {
+    return 0;
+  }
+  return handle_packet(client_sockfd, session, record, record_len) ? 1 : -1;
+}
+
+bool finish_request(int client_sockfd, struct client_session * session) {
+  off_t end = session -> durable_wait;
+  session -> durable_wait = 0;
+  if (session -> framed) {
+    uint64_t records = session -> ack_records;
+    session -> ack_records = 0;
+    stats_add(STAT_FRAME_ACKS, 1);
+    return send_ack(client_sockfd, session, records, end);
+  }
+  return dispatch_packet(client_sockfd, session, PACKET_REPLAY, NULL, 0);
+}
+
+void release_session(struct client_session * session) {
+  if (config.backend -> release != NULL) {
+    config.backend -> release(session);
+  }
+}
+
+bool log_ready(void) {
+  return atomic_load_explicit( & log_open, memory_order_acquire);
+}
+
+bool wait_for_log(void) {
+  if (log_ready()) {
+    return true;
+  }
+  pthread_mutex_lock( & log_open_lock);
+  while (!log_ready() && !signal_received) {
+    pthread_cond_wait( & log_opened, & log_open_lock);
+  }
+  pthread_mutex_unlock( & log_open_lock);
+  return log_ready();
+}
+
+/**
+ * @brief Wake the threads in wait_for_log(), after opening the log or to let them see the server stopping.
+ */
+static void wake_log_waiters(bool opened) {
+  pthread_mutex_lock( & log_open_lock);
+  if (opened) {
+    atomic_store_explicit( & log_open, true, memory_order_release);
+  }
+  pthread_cond_broadcast( & log_opened);
+  pthread_mutex_unlock( & log_open_lock);
+}
+
+/**
+ * @brief Serve one client connection on the calling thread until the client disconnects.
  * @reference updated for A9 based on Ashwin Ravindra's implementation.
- * @param thread_param A pointer to thread-specific data (struct thread_data) that may be used in the function.
- * @return EXIT_FAILURE on failure else NULL
- 
+ * @param client_sockfd The accepted client socket, closed before returning.
+ * @param client_addr The client address, used for logging.
+ * @param adopted Session state and partial record of a connection taken over by a hot restart, or NULL.
+ * @param owner The registry slot or pool worker the socket is detached from while it is handed over, or NULL.
  */
-void * threadfunc(void * thread_param) {
+void serve_connection(int client_sockfd, struct sockaddr_storage client_addr, const struct handoff_client * adopted,
+  const struct conn_owner * owner) {
 
-  ssize_t bytes_read;
   ssize_t bytes_recvd;
-  bool is_newline = false;
-  bool is_ioctl = false;
-  #ifndef USE_AESD_CHAR_DEVICE
-  bool is_locked = false;
-  #endif
-  if (NULL == thread_param) {
-    perror("NULL params\n");
-    return NULL;
+  struct line_framer framer;
+  int handled;
+  size_t avail;
+  bool handoff_refused = false;
+  struct client_session session = CLIENT_SESSION_INIT(NULL);
+  line_framer_init( & framer);
+  listener_tune_client(client_sockfd);
+  log_accepted_connection(client_addr);
+  if (adopted != NULL) {
+    session.tail_mode = adopted -> tail_mode;
+    session.delivered = adopted -> delivered;
+    session.framed = adopted -> framed;
+    for (size_t copied = 0; copied < adopted -> pending_len;) {
+      char * recv_space = line_framer_recv_space( & framer, & avail);
+      if (recv_space == NULL) {
+        goto exit_branch;
+      }
+      size_t chunk = adopted -> pending_len - copied < avail ? adopted -> pending_len - copied : avail;
+      memcpy(recv_space, adopted -> pending + copied, chunk);
+      line_framer_commit( & framer, chunk);
+      copied += chunk;
+    }
   }
-  struct thread_data * thread_func_args = (struct thread_data * ) thread_param;
-  log_accepted_connection(thread_func_args -> client_addr);
   while (1) {
-    char * recv_buffer = (char * ) malloc(MAX_PACKET_SIZE);
-    if (recv_buffer == NULL) {
-      syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
-      perror("malloc failed");
-      //free(recv_buffer);
+    char * recv_space = line_framer_recv_space( & framer, & avail);
+    if (recv_space == NULL) {
+      syslog(LOG_ERR, "Receive buffer unavailable or record exceeds %d bytes", FRAMER_MAX_RECORD);
+      perror("receive buffer");
       goto exit_branch;
     }
-    bytes_recvd = recv(thread_func_args -> client_sockfd, recv_buffer, MAX_PACKET_SIZE, 0);
+    bytes_recvd = recv(client_sockfd, recv_space, avail, 0);
     if (bytes_recvd == SYSCALL_ERROR) {
+      if (errno == EINTR) {
+        // A hot restart interrupts the blocked recv(): hand the client over between records
+        if (hot_restart_draining() && (owner == NULL || owner -> detach(owner -> owner))) {
+          if (hot_restart_send_client(client_sockfd, client_addr, & session,
+              framer.buf + framer.start, line_framer_pending( & framer)) == 0) {
+            goto handed_over;
+          }
+          if (owner != NULL && !owner -> attach(owner -> owner, client_sockfd)) {
+            goto exit_branch; // the drain ended meanwhile and nothing will shut this connection down
+          }
+          // Retried on every interrupt, so a long partial record is handed over once it completes; the end of
+          // the drain closes the connection like any other
+          if (!handoff_refused) {
+            syslog(LOG_WARNING, "Connection with a %zu byte partial record not handed over, serving it until the drain ends",
+              line_framer_pending( & framer));
+            handoff_refused = true;
+          }
+        }
+        continue;
+      }
       perror("recv");
       syslog(LOG_ERR, "recv failed: %s", strerror(errno));
-      free(recv_buffer);
-
+      goto exit_branch;
     }
-    #ifndef USE_AESD_CHAR_DEVICE
-    if (pthread_mutex_lock( & mutex) != 0) {
-      perror("mutex lock\n");
-      free(recv_buffer);
+    if (bytes_recvd == 0) {
+      break;
+    }
+    stats_add(STAT_BYTES_IN, bytes_recvd);
+    line_framer_commit( & framer, bytes_recvd);
+    if (!wait_for_log()) {
       goto exit_branch;
     }
-    else
-    is_locked = true;
-    #endif
-    if (memchr(recv_buffer, '\n', bytes_recvd) != NULL) {
-      is_newline = true;
-    }
-    if (is_newline == true) {
-      if (strncmp(recv_buffer, "AESDCHAR_IOCSEEKTO:", 19) == 0) {
-        is_ioctl = true;
-        struct aesd_seekto seekto;
-        sscanf(recv_buffer, "AESDCHAR_IOCSEEKTO:%d,%d", & seekto.write_cmd, & seekto.write_cmd_offset);
-        file_fd = open(PATH, O_RDWR, 0666);
-        if (file_fd == -1) {
-          syslog(LOG_ERR, "Open failed: %s", strerror(errno));
-          free(recv_buffer);
-          perror("open");
-          #ifndef USE_AESD_CHAR_DEVICE
-  	  if(is_locked == true)
-  	  {
-          if (pthread_mutex_unlock( & mutex) != 0) {
-          perror("mutex unlock\n");
-          free(recv_buffer);
-          goto exit_branch;
-      	   }
-      	   else
-      	   is_locked = false;
-  	   }
-  	  #endif
-          exit(EXIT_FAILURE);
-        }
-        if (ioctl(file_fd, AESDCHAR_IOCSEEKTO, & seekto) != 0) {
-          syslog(LOG_ERR, "ioctl failed: %s", strerror(errno));
-        }
-
-      } else {
-        file_fd = open(PATH, O_RDWR | O_APPEND | O_CREAT, 0666);
-        if (file_fd == -1) {
-          syslog(LOG_ERR, "Open failed: %s", strerror(errno));
-          free(recv_buffer);
-          perror("open");
-          #ifndef USE_AESD_CHAR_DEVICE
-  	  if(is_locked == true)
-  	  {
-          if (pthread_mutex_unlock( & mutex) != 0) {
-          perror("mutex unlock\n");
-          free(recv_buffer);
-          goto exit_branch;
-      	   }
-      	   else
-      	   is_locked = false;
-  	   }
-  	  #endif
-          exit(EXIT_FAILURE);
-
-        }
-        if (write(file_fd, recv_buffer, bytes_recvd) == SYSCALL_ERROR) {
-          perror("write");
-          syslog(LOG_ERR, "write failed: %s", strerror(errno));
-          free(recv_buffer);
-          goto exit_branch;
-        }
-        close(file_fd);
-      }
-
-      if (!is_ioctl) {
-        file_fd = open(PATH, O_RDONLY, 0666);
-      }
-      char * send_buffer = (char * ) malloc(MAX_PACKET_SIZE);
-      if (send_buffer == NULL) {
-        syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
-        perror("malloc failed");
-        free(send_buffer);
-        goto exit_branch;
-      }
-      // Read data from the file into the send_buffer
-      while ((bytes_read = read(file_fd, send_buffer, MAX_PACKET_SIZE)) > 0) {
-        if (bytes_read == SYSCALL_ERROR) {
-          perror("read");
-          free(send_buffer);
-          goto exit_branch;
-        }
-        send(thread_func_args -> client_sockfd, send_buffer, bytes_read, 0);
-      }
-
-      #ifndef USE_AESD_CHAR_DEVICE
-      if (pthread_mutex_unlock( & mutex) != 0) {
-        perror("mutex unlock\n");
-        free(recv_buffer);
-        goto exit_branch;
-      }
-      else
-      is_locked = false;
-      #endif
+    // Several records may arrive in one segment, and one record may span many
+    while ((handled = handle_next_request(client_sockfd, & session, & framer)) > 0) {
+    }
+    if (handled < 0) {
+      goto exit_branch;
     }
 
   }
-  // Log the closed connection
-  log_closed_connection(thread_func_args -> client_addr);
 
   exit_branch:
-  #ifndef USE_AESD_CHAR_DEVICE
-  if(is_locked == true)
-  {
-  if (pthread_mutex_unlock( & mutex) != 0) {
-        perror("mutex unlock\n");
-        free(recv_buffer);
-        goto exit_branch;
-      }
-      else
-      is_locked = false;
-  }
-  #endif
-    // close client socket file descriptor
-    close(thread_func_args -> client_sockfd);
-  thread_func_args -> thread_complete_success = true;
-  //close(file_fd);
-  /*if (send_buffer)*/
-  return NULL; /*for avoiding "error: control reaches end of non-void function"*/
+    // Log the closed connection
+    log_closed_connection(client_addr);
+  release_session( & session);
+  line_framer_free( & framer);
+  // close client socket file descriptor
+  close(client_sockfd);
+  return;
 
+  handed_over:
+    // The new process holds the socket now: close only this descriptor, never shutdown() the connection
+    stats_add(STAT_CONNECTIONS_CLOSED, 1);
+  syslog(LOG_INFO, "Handed connection over to the new process");
+  release_session( & session);
+  line_framer_free( & framer);
+  close(client_sockfd);
+}
+
+static bool detach_slot(void * slot) {
+  return conn_registry_detach((struct conn_slot * ) slot);
+}
+
+static bool attach_slot(void * slot, int client_sockfd) {
+  return conn_registry_attach((struct conn_slot * ) slot, client_sockfd);
 }
 
 /**
- * @brief Gracefully exits the program, cleaning up resources and closing connections.
- * @param
- * @return none
+ * @brief Thread function to handle client connections and log data to a file.
+ * @param thread_param The connection's registry id (conn_id_t), passed by value.
+ * @return NULL
  */
-void exit_gracefully() {
-
-  syslog(LOG_INFO, "Caught signal, exiting");
-  //closelog();
-  // Close the socket and delete the file
-  // Join the timer thread
-  //pthread_join(timer_data.thread, NULL);
-  close(sockfd);
-  #ifndef USE_AESD_CHAR_DEVICE
-  remove(PATH);
-  #endif
-  while (SLIST_FIRST( & head) != NULL) {
-    struct slist_data_s * datap;
-    SLIST_FOREACH(datap, & head, entries) {
-      close(datap -> connection_data.client_sockfd);
-      pthread_join(datap -> connection_data.thread, NULL);
-      SLIST_REMOVE( & head, datap, slist_data_s, entries);
-      free(datap);
-    }
+void * threadfunc(void * thread_param) {
+  struct conn_slot * slot = conn_registry_lookup((conn_id_t) thread_param);
+  if (NULL == slot) {
+    perror("NULL params\n");
+    return NULL;
   }
-  #ifndef USE_AESD_CHAR_DEVICE
-  pthread_mutex_destroy( & mutex);
-  #endif
-  closelog();
-  //exit(EXIT_SUCCESS);
+  struct conn_owner owner = { .detach = detach_slot, .attach = attach_slot, .owner = slot };
+  serve_connection(slot -> client_sockfd, slot -> client_addr, slot -> adopted, & owner);
+  free(slot -> adopted);
+  conn_registry_finished(slot);
+  return NULL; /*for avoiding "error: control reaches end of non-void function"*/
 }
 
 /**
@@ -416,34 +740,393 @@ void run_as_daemon() {
 /**
  * @brief Signal handler function.
  *
- * Handles SIGINT and SIGTERM signals by logging and performing cleanup before exiting.
+ * Handles SIGINT and SIGTERM signals. Only async-signal-safe work is done here: the flag stops every loop and
+ * the eventfd wakes the accept loop, which then closes the connections and the log.
  *
  * @param sig The signal number.
  */
 
 void signal_handler(int sig) {
   if (sig == SIGINT || sig == SIGTERM) {
+    int saved_errno = errno;
     signal_received = true;
-    exit_gracefully();
+    if (wake_fd != -1) {
+      uint64_t one = 1;
+      ssize_t ignored = write(wake_fd, & one, sizeof(one));
+      (void) ignored;
+    }
+    errno = saved_errno;
+  }
+}
+
+/**
+ * @brief SIGUSR1 handler: does nothing, it is only sent to make a blocked recv() fail with EINTR during a hot restart.
+ */
+static void interrupt_handler(int sig) {
+  (void) sig;
+}
+
+/**
+ * @brief Open the backend, then let the connections waiting for the log handle their requests.
+ * @param resume Continue the log a hot restart predecessor closed instead of recreating it.
+ * @return The timestamp timer, or -1 if the backend writes no timestamps. Exits on failure.
+ */
+static int open_log(bool resume) {
+  if (config.backend -> open(resume) != 0) {
+    closelog();
+    exit(EXIT_FAILURE);
+  }
+  syslog(LOG_INFO, "Using the %s backend at %s", config.backend -> name, config.path);
+  int timer_fd = -1;
+  if (config.backend -> timestamp != NULL && (timer_fd = timestamp_timer_open()) == SYSCALL_ERROR) {
+    closelog();
+    exit(EXIT_FAILURE);
+  }
+  wake_log_waiters(true);
+  if (event_loop_log_opened() != 0) {
+    closelog();
+    exit(EXIT_FAILURE);
+  }
+  return timer_fd;
+}
+
+/**
+ * @brief Serve a connection handed over by the hot restart predecessor with this process's model.
+ * @param client Freed once the connection is served.
+ */
+static void adopt_client(struct handoff_client * client) {
+  // The descriptor shares its file status flags with the predecessor's, whose model may differ
+  int flags = fcntl(client -> client_sockfd, F_GETFL, 0);
+  if (flags != -1) {
+    fcntl(client -> client_sockfd, F_SETFL, config.mode == MODE_EPOLL ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+  }
+  if (config.mode == MODE_EPOLL) {
+    event_loop_adopt_client(client);
+    return;
+  }
+  if (config.mode == MODE_POOL) {
+    thread_pool_adopt(client);
+    return;
+  }
+  struct conn_slot * slot = conn_registry_acquire(client -> client_sockfd, client -> client_addr);
+  if (slot == NULL) {
+    syslog(LOG_WARNING, "All %d connection slots in use, refusing connection", MAX_CONNECTIONS);
+    close(client -> client_sockfd);
+    free(client);
+    return;
+  }
+  slot -> adopted = client;
+  if (pthread_create( & slot -> thread, NULL, threadfunc, (void * ) slot -> id) != 0) {
+    perror("pthread_create");
+    close(client -> client_sockfd);
+    free(client);
+    conn_registry_release(slot);
+  }
+}
+
+/**
+ * @brief Hand the listener over to a new process connecting on restart_fd, then let this process drain.
+ *
+ * Accepting stops at once. When the new process wants the clients, connection threads and pool workers are
+ * interrupted until each has handed its client over or finished, and the event loops hand over every
+ * connection that is idle; otherwise the connections are left to close. Either way the drain is bounded by
+ * HOT_RESTART_DRAIN_MS, after which the accept loop shuts down as on SIGTERM.
+ * @return The channel to send the final message on once the log is closed, or -1 if no hand-over happened
+ */
+static int hand_over(int restart_fd) {
+  bool clients_wanted = false;
+  int channel_fd = hot_restart_hand_over(restart_fd, sockfd, & clients_wanted);
+  if (channel_fd == SYSCALL_ERROR) {
+    return -1;
+  }
+  // The new process accepts from the same listen queue now; shutdown() would stop it there too
+  close(sockfd);
+  sockfd = -1;
+  if (clients_wanted) {
+    hot_restart_begin_drain(channel_fd);
+    if (config.mode == MODE_EPOLL) {
+      event_loop_begin_drain();
+    }
+  }
+  uint64_t deadline_ns = stats_now_ns() + HOT_RESTART_DRAIN_MS * 1000000ULL;
+  while (!signal_received && stats_now_ns() < deadline_ns) {
+    size_t live;
+    if (config.mode == MODE_THREAD) {
+      conn_registry_reap();
+      // Signal 0 only checks the thread exists; a blocked thread misses a SIGUSR1 sent just before its recv(),
+      // so it is sent again every round
+      live = conn_registry_signal_all(clients_wanted ? SIGUSR1 : 0);
+    } else {
+      if (config.mode == MODE_POOL && clients_wanted) {
+        thread_pool_signal_all(SIGUSR1); // resent every round like above; queued clients are popped and then interrupted
+      }
+      uint64_t accepted = stats_total(STAT_CONNECTIONS_ACCEPTED);
+      uint64_t closed = stats_total(STAT_CONNECTIONS_CLOSED);
+      live = accepted > closed ? accepted - closed : 0;
+    }
+    if (live == 0) {
+      break;
+    }
+    poll(NULL, 0, 10);
+  }
+  signal_received = true;
+  return channel_fd;
+}
+
+static void usage(const char * program) {
+  fprintf(stderr, "Usage: %s [-d] [-f config_file] [-B file|chardev|memory|ring] [-P path] [-p port] [-M packet_buffer_bytes] [-k pool_bytes] [-O socket_options] [-m thread|epoll|pool|uring] [-t threads] [-q queue_capacity] [-c cache_bytes] [-b backlog] [-s shards] [-D window_us[:window_bytes]] [-H high_water_bytes] [-w] [-U restart_socket] [-g segment_bytes [-R retain_bytes] [-A retain_seconds] [-z level [-Z hot_cache_bytes]]]\n", program);
+}
+
+/**
+ * @brief Parse a '-O' socket profile: a comma separated list of accept4, nodelay, cork, defer[=seconds],
+ * sndbuf=bytes, rcvbuf=bytes and latency (accept4,nodelay,cork,defer).
+ * @return 0 on success, -1 on an unknown option
+ */
+static int parse_socket_profile(const char * spec, struct socket_profile * profile) {
+  char option[64];
+  while ( * spec != '\0') {
+    size_t len = strcspn(spec, ",");
+    if (len >= sizeof(option)) {
+      return -1;
+    }
+    memcpy(option, spec, len);
+    option[len] = '\0';
+    spec += len + (spec[len] == ',');
+    char * value = strchr(option, '=');
+    if (value != NULL) {
+      * value++ = '\0';
+    }
+    if (strcmp(option, "latency") == 0) {
+      profile -> accept4 = profile -> nodelay = profile -> cork = true;
+      profile -> defer_accept_s = DEFAULT_DEFER_ACCEPT_S;
+    } else if (strcmp(option, "accept4") == 0) {
+      profile -> accept4 = true;
+    } else if (strcmp(option, "nodelay") == 0) {
+      profile -> nodelay = true;
+    } else if (strcmp(option, "cork") == 0) {
+      profile -> cork = true;
+    } else if (strcmp(option, "defer") == 0) {
+      profile -> defer_accept_s = value != NULL ? atoi(value) : DEFAULT_DEFER_ACCEPT_S;
+    } else if (strcmp(option, "sndbuf") == 0 && value != NULL) {
+      profile -> sndbuf = atoi(value);
+    } else if (strcmp(option, "rcvbuf") == 0 && value != NULL) {
+      profile -> rcvbuf = atoi(value);
+    } else if (option[0] != '\0') {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Apply one option, given on the command line or as a configuration file line. Exits on an invalid value.
+ * @param opt The option letter.
+ * @param arg Its argument, which must outlive the configuration; ignored by flags.
+ * @return false if opt is not an option
+ */
+static bool apply_option(int opt, const char * arg) {
+  switch (opt) {
+  case 'd':
+    daemon_mode = true;
+    break;
+  case 'm':
+    if (strcmp(arg, "thread") == 0) {
+      config.mode = MODE_THREAD;
+    } else if (strcmp(arg, "epoll") == 0) {
+      config.mode = MODE_EPOLL;
+    } else if (strcmp(arg, "pool") == 0) {
+      config.mode = MODE_POOL;
+    } else if (strcmp(arg, "uring") == 0) {
+      config.mode = MODE_URING;
+    } else {
+      fprintf(stderr, "Unknown mode '%s', expected thread, epoll, pool or uring\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case 't':
+    config.num_threads = atoi(arg);
+    if (config.num_threads <= 0) {
+      fprintf(stderr, "Invalid thread count '%s'\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case 'q':
+    config.queue_capacity = atoi(arg);
+    if (config.queue_capacity <= 0) {
+      fprintf(stderr, "Invalid queue capacity '%s'\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case 'c':
+    config.cache_bytes = strtoull(arg, NULL, 0);
+    break;
+  case 'b':
+    config.backlog = atoi(arg);
+    if (config.backlog <= 0) {
+      fprintf(stderr, "Invalid backlog '%s'\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case 'D':
+    config.durable = true;
+    if (sscanf(arg, "%llu:%zu", & config.sync_window_us, & config.sync_window_bytes) < 1) {
+      fprintf(stderr, "Invalid commit window '%s', expected usec[:bytes]\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case 'H':
+    config.outq_high_water = strtoull(arg, NULL, 0);
+    if (config.outq_high_water == 0) {
+      fprintf(stderr, "Invalid high-water mark '%s'\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case 'g':
+    config.segment_bytes = strtoull(arg, NULL, 0);
+    if (config.segment_bytes == 0) {
+      fprintf(stderr, "Invalid segment size '%s'\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case 'R':
+    config.retain_bytes = strtoull(arg, NULL, 0);
+    break;
+  case 'A':
+    config.retain_seconds = strtoull(arg, NULL, 0);
+    break;
+  case 'z':
+    config.compress_level = atoi(arg);
+    if (config.compress_level < 1 || config.compress_level > 9) {
+      fprintf(stderr, "Invalid zlib level '%s', expected 1 to 9\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case 'Z':
+    config.hot_cache_bytes = strtoull(arg, NULL, 0);
+    break;
+  case 'w':
+    config.writer_thread = true;
+    break;
+  case 'U':
+    config.restart_path = arg;
+    break;
+  case 's':
+    config.shards = atoi(arg);
+    if (config.shards <= 0) {
+      fprintf(stderr, "Invalid shard count '%s'\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case 'p':
+    config.port = arg;
+    break;
+  case 'P':
+    config.path = arg;
+    break;
+  case 'B':
+    if (strcmp(arg, "file") == 0) {
+      config.backend = & file_backend;
+    } else if (strcmp(arg, "chardev") == 0) {
+      config.backend = & chardev_backend;
+    } else if (strcmp(arg, "memory") == 0) {
+      config.backend = & memory_backend;
+    } else if (strcmp(arg, "ring") == 0) {
+      config.backend = & ring_backend;
+    } else {
+      fprintf(stderr, "Unknown backend '%s', expected file, chardev, memory or ring\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case 'O':
+    if (parse_socket_profile(arg, & config.sockets) != 0) {
+      fprintf(stderr, "Invalid socket options '%s', expected accept4, nodelay, cork, defer[=s], sndbuf=n, rcvbuf=n or latency\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case 'M':
+    config.max_packet_size = strtoull(arg, NULL, 0);
+    if (config.max_packet_size == 0) {
+      fprintf(stderr, "Invalid packet buffer size '%s'\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case 'k':
+    config.pool_bytes = strtoull(arg, NULL, 0);
+    break;
+  default:
+    return false;
   }
+  return true;
+}
+
+/**
+ * Configuration file keys and the option each sets
+ */
+static const struct {
+  const char * key;
+  int opt;
+} config_keys[] = {
+  { "BACKEND", 'B' }, { "PATH", 'P' }, { "PORT", 'p' }, { "BACKLOG", 'b' }, { "MAX_PACKET_SIZE", 'M' },
+  { "POOL_BYTES", 'k' }, { "MODE", 'm' }, { "THREADS", 't' }, { "QUEUE_CAPACITY", 'q' }, { "SHARDS", 's' }, { "CACHE_BYTES", 'c' },
+  { "DURABLE", 'D' }, { "HIGH_WATER", 'H' }, { "WRITER_THREAD", 'w' }, { "SEGMENT_BYTES", 'g' },
+  { "RETAIN_BYTES", 'R' }, { "RETAIN_SECONDS", 'A' }, { "COMPRESS_LEVEL", 'z' }, { "HOT_CACHE_BYTES", 'Z' },
+  { "RESTART_SOCKET", 'U' }, { "SOCKET_OPTIONS", 'O' }, { "DAEMON", 'd' },
+};
+
+/**
+ * @brief Apply a configuration file of KEY=value lines; blank lines and lines starting with '#' are skipped.
+ *
+ * Flags (DAEMON, WRITER_THREAD) are set by any value but 0.
+ * @return 0 on success, -1 if the file cannot be read or has an unknown key
+ */
+static int load_config_file(const char * file_name) {
+  FILE * file = fopen(file_name, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Cannot open configuration file %s: %s\n", file_name, strerror(errno));
+    return -1;
+  }
+  char line[CONFIG_LINE_MAX];
+  int line_number = 0;
+  int retval = 0;
+  while (retval == 0 && fgets(line, sizeof(line), file) != NULL) {
+    line_number++;
+    char * key = line + strspn(line, " \t");
+    key[strcspn(key, "\r\n")] = '\0';
+    if (key[0] == '\0' || key[0] == '#') {
+      continue;
+    }
+    char * value = strchr(key, '=');
+    retval = -1;
+    if (value != NULL) {
+      * value++ = '\0';
+      key[strcspn(key, " \t")] = '\0';
+      value += strspn(value, " \t");
+      for (size_t i = 0; i < sizeof(config_keys) / sizeof(config_keys[0]); i++) {
+        if (strcmp(key, config_keys[i].key) == 0) {
+          bool flag = (config_keys[i].opt == 'd' || config_keys[i].opt == 'w');
+          char * arg = strdup(value); // the configuration keeps pointers to string values
+          if (arg != NULL && (!flag || strcmp(value, "0") != 0)) {
+            apply_option(config_keys[i].opt, arg);
+          }
+          retval = (arg != NULL) ? 0 : -1;
+          break;
+        }
+      }
+    }
+    if (retval != 0) {
+      fprintf(stderr, "%s:%d: expected KEY=value with a known key\n", file_name, line_number);
+    }
+  }
+  fclose(file);
+  return retval;
 }
 
 int main(int argc, char * argv[]) {
-  #ifndef USE_AESD_CHAR_DEVICE
-  pthread_mutex_init( & mutex, NULL);
-  #endif
-  struct addrinfo hints, * servinfo, * p;
   struct sockaddr_storage their_addr;
   socklen_t sin_size = sizeof(their_addr);
-  int yes = 1;
-  int rv;
 
-  bool daemon_mode = false;
   openlog("aesdsocket", LOG_PID, LOG_USER); // Open syslog
-  // Cleanup of PATH
-  #ifndef USE_AESD_CHAR_DEVICE
-  remove(PATH); // to erase contents and the file in case of SIGKILL (kill -s 9 <pid>)
-  #endif
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
   struct sigaction sa;
   sa.sa_handler = & signal_handler; // reap all dead processes
   sigemptyset( & sa.sa_mask);
@@ -451,146 +1134,247 @@ int main(int argc, char * argv[]) {
 
   if (sigaction(SIGINT, & sa, NULL) == -1) {
     closelog();
-    #ifndef USE_AESD_CHAR_DEVICE
-    pthread_mutex_destroy( & mutex);
-    #endif
     perror("sigaction");
     exit(EXIT_FAILURE);
   }
   if (sigaction(SIGTERM, & sa, NULL) == -1) {
     closelog();
-    #ifndef USE_AESD_CHAR_DEVICE
-    pthread_mutex_destroy( & mutex);
-    #endif
     perror("sigaction");
     exit(EXIT_FAILURE);
   }
-
-  // Checking if the -d argument is provided
-  if ((argc == 2) && (strcmp(argv[1], "-d") == 0))
-    daemon_mode = true;
-  if (daemon_mode == true)
-    run_as_daemon();
-
-  // Initialize the 'hints' structure to specify socket configuration options.
-  memset( & hints, 0, sizeof(hints));
-  // Set the address family to IPv4 (AF_INET) to ensure compatibility with IPv4 addresses.
-  hints.ai_family = AF_INET;
-  // Set the socket type to SOCK_STREAM, indicating a TCP socket.
-  hints.ai_socktype = SOCK_STREAM;
-  // Set the AI_PASSIVE flag, which indicates that the socket will be used for accepting incoming connections.
-  hints.ai_flags = AI_PASSIVE;
-
-  // Use getaddrinfo to retrieve a list of address structures that match the specified criteria.
-  if ((rv = getaddrinfo(NULL, PORT, & hints, & servinfo)) != 0) {
+  // sendfile() has no MSG_NOSIGNAL: a client resetting mid-replay must fail the call, not kill the server
+  signal(SIGPIPE, SIG_IGN);
+  // No SA_RESTART: the hot restart relies on SIGUSR1 interrupting a blocked recv()
+  sa.sa_handler = & interrupt_handler;
+  sa.sa_flags = 0;
+  if (sigaction(SIGUSR1, & sa, NULL) == -1) {
     closelog();
-    #ifndef USE_AESD_CHAR_DEVICE
-    pthread_mutex_destroy( & mutex);
-    #endif
-    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    perror("sigaction");
     exit(EXIT_FAILURE);
   }
 
-  // Iterate through the list of address structures to find a suitable one for binding.
-  for (p = servinfo; p != NULL; p = p -> ai_next) {
-    // Create a socket using the address family, socket type, and protocol specified in the address structure.
-    if ((sockfd = socket(p -> ai_family, p -> ai_socktype, p -> ai_protocol)) == -1) {
-      perror("server: socket");
-      continue; // If socket creation fails, try the next address.
+  // Options come from the configuration file given with -f first, then from the rest of the command line
+  int opt;
+  opterr = 0;
+  while ((opt = getopt(argc, argv, OPTSTRING)) != -1) {
+    if (opt == 'f' && load_config_file(optarg) != 0) {
+      exit(EXIT_FAILURE);
     }
-
-    // Allow reusing the address/port even if it's in TIME_WAIT state.
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, & yes, sizeof(int)) == -1) {
-      closelog();
-      #ifndef USE_AESD_CHAR_DEVICE
-      pthread_mutex_destroy( & mutex);
-      #endif
-      perror("setsockopt");
+  }
+  optind = 1;
+  opterr = 1;
+  while ((opt = getopt(argc, argv, OPTSTRING)) != -1) {
+    if (opt != 'f' && !apply_option(opt, optarg)) {
+      usage(argv[0]);
       exit(EXIT_FAILURE);
     }
+  }
+  if (config.path == NULL) {
+    config.path = config.backend -> default_path;
+  }
+  if (config.shards > 0 && config.mode != MODE_EPOLL && config.mode != MODE_URING) {
+    fprintf(stderr, "Accept sharding (-s) needs an event loop model: -m epoll or -m uring\n");
+    exit(EXIT_FAILURE);
+  }
+  if ((config.retain_bytes > 0 || config.retain_seconds > 0 || config.compress_level > 0) && config.segment_bytes == 0) {
+    fprintf(stderr, "Log retention (-R/-A) and compression (-z) work on whole segments and need a segmented log (-g)\n");
+    exit(EXIT_FAILURE);
+  }
+  if (config.restart_path != NULL && (config.shards > 0 || config.mode == MODE_URING)) {
+    fprintf(stderr, "Hot restart (-U) hands over the accept loop's single listener: not with -s or -m uring\n");
+    exit(EXIT_FAILURE);
+  }
+  if (daemon_mode == true)
+    run_as_daemon();
 
-    // Bind the socket to the address and port specified in the address structure.
-    if (bind(sockfd, p -> ai_addr, p -> ai_addrlen) == -1) {
-      close(sockfd);
-      perror("server: bind");
-      continue; // If binding fails, try the next address.
+  // With -U a running predecessor hands its listener over, and its clients as they become free: this process
+  // accepts at once, but continues the log only once the predecessor closed it
+  int predecessor_fd = -1;
+  if (config.restart_path != NULL) {
+    predecessor_fd = hot_restart_takeover(config.restart_path, true, & sockfd);
+  }
+  int * shard_fds = NULL;
+  if (predecessor_fd != -1) {
+    // The listener came from the predecessor
+  } else if (config.shards > 0) {
+    // Every loop/ring owns one SO_REUSEPORT socket; there is no shared listener for the main thread
+    shard_fds = (int * ) calloc(config.shards, sizeof(int));
+    if (shard_fds == NULL || listener_open_shards(config.port, config.backlog, config.shards, shard_fds) != 0) {
+      closelog();
+      exit(EXIT_FAILURE);
     }
-
-    // If binding is successful, break out of the loop.
-    break;
+    sockfd = -1;
+    config.num_threads = config.shards;
+  } else if ((sockfd = listener_open(config.port, config.backlog, false)) == -1) {
+    closelog();
+    exit(EXIT_FAILURE);
   }
 
-  // Free the memory allocated by getaddrinfo.
-  freeaddrinfo(servinfo);
-
-  if (p == NULL) {
+  if (!config.backend -> storage_log && (config.durable || config.writer_thread || config.segment_bytes > 0)) {
+    syslog(LOG_WARNING, "Durable mode (-D), the writer thread (-w) and log segments (-g) need the file backend, ignored by the %s backend",
+      config.backend -> name);
+  }
+  int timer_fd = -1;
+  if (predecessor_fd == -1) {
+    timer_fd = open_log(false);
+  }
+  if (config.pool_bytes > 0 && buffer_pool_init(config.pool_bytes) != 0) {
     closelog();
-    #ifndef USE_AESD_CHAR_DEVICE
-    pthread_mutex_destroy( & mutex);
-    #endif
-    fprintf(stderr, "server: failed to bind\n");
     exit(EXIT_FAILURE);
   }
-
-  if (listen(sockfd, BACKLOG) == -1) {
+  if (config.mode == MODE_THREAD && conn_registry_init(MAX_CONNECTIONS) != 0) {
     closelog();
-    #ifndef USE_AESD_CHAR_DEVICE
-    pthread_mutex_destroy( & mutex);
-    #endif
-    perror("listen");
     exit(EXIT_FAILURE);
   }
-
-  SLIST_INIT( & head);
-  #ifndef USE_AESD_CHAR_DEVICE
-  struct timer_data timer_data_t;
-  pthread_create( & (timer_data_t.thread), NULL, timestamp, & timer_data_t);
-  #endif
+  if (config.num_threads == 0) {
+    config.num_threads = (config.mode == MODE_POOL) ? DEFAULT_POOL_WORKERS : DEFAULT_EPOLL_THREADS;
+  }
+  if (config.mode == MODE_URING && uring_loop_start(config.num_threads, sockfd, shard_fds) != 0) {
+    // Kernels without io_uring (or backends other than the file log) still get a multiplexed server
+    syslog(LOG_WARNING, "io_uring unavailable, falling back to epoll");
+    config.mode = MODE_EPOLL;
+  }
+  if ((config.mode == MODE_EPOLL && event_loop_start(config.num_threads, shard_fds) != 0) ||
+    (config.mode == MODE_POOL && thread_pool_start(config.num_threads, config.queue_capacity) != 0)) {
+    closelog();
+    exit(EXIT_FAILURE);
+  }
+  free(shard_fds); // the loops own the shard sockets now
+  int restart_fd = -1;
+  int successor_fd = -1;
+  if (config.restart_path != NULL && predecessor_fd == -1 &&
+    (restart_fd = hot_restart_listen(config.restart_path)) == SYSCALL_ERROR) {
+    closelog();
+    exit(EXIT_FAILURE);
+  }
+  uint64_t predecessor_deadline_ns = stats_now_ns() + HOT_RESTART_WAIT_MS * 1000000ULL;
+  size_t adopted_count = 0;
+  // The rings accept on the listener themselves, and with shards there is none (sockfd is -1): poll() ignores
+  // a negative fd, so the main thread only accepts for the thread, pool and unsharded epoll models
+  struct pollfd main_fds[] = {
+    { .fd = config.mode == MODE_URING ? -1 : sockfd, .events = POLLIN },
+    { .fd = timer_fd, .events = POLLIN },
+    { .fd = wake_fd, .events = POLLIN },
+    { .fd = restart_fd, .events = POLLIN },
+    { .fd = predecessor_fd, .events = POLLIN },
+  };
   while (signal_received == false) {
-
-    int client_sockfd = accept(sockfd, (struct sockaddr * ) & their_addr, & sin_size);
+    // The timeout bounds the shutdown delay should the wake-up eventfd be unavailable
+    if (poll(main_fds, 5, 500) == SYSCALL_ERROR) {
+      if (errno != EINTR) {
+        perror("poll");
+      }
+      continue;
+    }
+    if (predecessor_fd != -1) {
+      bool predecessor_done = stats_now_ns() >= predecessor_deadline_ns;
+      if (predecessor_done) {
+        syslog(LOG_WARNING, "Hot restart: previous process did not finish within %d ms", HOT_RESTART_WAIT_MS);
+      } else if (main_fds[4].revents != 0) {
+        struct handoff_client * client;
+        int received = hot_restart_receive_client(predecessor_fd, & client);
+        if (received > 0) {
+          adopt_client(client);
+          adopted_count++;
+        }
+        predecessor_done = received < 0;
+      }
+      if (predecessor_done) {
+        syslog(LOG_INFO, "Hot restart: %zu client connections handed over", adopted_count);
+        close(predecessor_fd);
+        predecessor_fd = main_fds[4].fd = -1;
+        main_fds[1].fd = timer_fd = open_log(true);
+        // Only now can this process hand over in turn; without the socket it keeps serving as it is
+        if (config.restart_path != NULL) {
+          main_fds[3].fd = restart_fd = hot_restart_listen(config.restart_path);
+        }
+      }
+    }
+    if (main_fds[1].revents & POLLIN) {
+      timestamp_tick(timer_fd);
+    }
+    if (main_fds[3].revents & POLLIN) {
+      successor_fd = hand_over(restart_fd);
+      if (successor_fd != -1) {
+        close(restart_fd);
+        restart_fd = -1;
+        break;
+      }
+    }
+    if (config.mode == MODE_THREAD) {
+      conn_registry_reap();
+    }
+    if (!(main_fds[0].revents & POLLIN)) {
+      continue;
+    }
+    // Sockets for the event loops are accepted non-blocking, saving the two fcntl() calls per connection
+    int client_sockfd = config.sockets.accept4 ?
+      accept4(sockfd, (struct sockaddr * ) & their_addr, & sin_size, SOCK_CLOEXEC | (config.mode == MODE_EPOLL ? SOCK_NONBLOCK : 0)) :
+      accept(sockfd, (struct sockaddr * ) & their_addr, & sin_size);
     if (client_sockfd == -1) {
       perror("accept");
       continue;
     }
-    datap = (struct slist_data_s * ) malloc(sizeof(struct slist_data_s));
-
-    datap -> connection_data.client_sockfd = client_sockfd;
-    datap -> connection_data.client_addr = their_addr;
-    datap -> connection_data.thread_complete_success = false;
-    SLIST_INSERT_HEAD( & head, datap, entries);
-    if (pthread_create( & (datap -> connection_data.thread), NULL, threadfunc, & datap -> connection_data) != 0) {
+    if (config.mode == MODE_EPOLL) {
+      event_loop_add_client(client_sockfd, their_addr);
+      continue;
+    }
+    if (config.mode == MODE_POOL) {
+      thread_pool_submit(client_sockfd, their_addr);
+      continue;
+    }
+    if (config.mode != MODE_THREAD) {
+      // Only the thread per connection model has a registry; no other model accepts here
+      syslog(LOG_ERR, "Connection accepted by the main thread in a model that accepts on its own, closing");
+      close(client_sockfd);
+      continue;
+    }
+    struct conn_slot * slot = conn_registry_acquire(client_sockfd, their_addr);
+    if (slot == NULL) {
+      syslog(LOG_WARNING, "All %d connection slots in use, refusing connection", MAX_CONNECTIONS);
+      close(client_sockfd);
+      continue;
+    }
+    if (pthread_create( & slot -> thread, NULL, threadfunc, (void * ) slot -> id) != 0) {
       perror("pthread_create");
+      conn_registry_release(slot);
+      close(client_sockfd);
       break;
     }
-    struct slist_data_s * temp;
-    SLIST_FOREACH_SAFE(datap, & head, entries, temp) {
-      if (datap -> connection_data.thread_complete_success) {
-        pthread_join(datap -> connection_data.thread, NULL);
-        SLIST_REMOVE( & head, datap, slist_data_s, entries);
-        free(datap);
-      }
-    }
-
   }
 
-  while (SLIST_FIRST( & head) != NULL) {
-    SLIST_FOREACH(datap, & head, entries) {
-      close(datap -> connection_data.client_sockfd);
-      pthread_join(datap -> connection_data.thread, NULL);
-      SLIST_REMOVE( & head, datap, slist_data_s, entries);
-      free(datap);
-    }
-
+  syslog(LOG_INFO, successor_fd != -1 ? "Handed over to the new process, exiting" : "Caught signal, exiting");
+  wake_log_waiters(false); // connections still waiting for the predecessor close instead
+  if (predecessor_fd != -1) {
+    close(predecessor_fd);
   }
-  #ifndef USE_AESD_CHAR_DEVICE
-  pthread_join((timer_data_t.thread), NULL);
-  pthread_mutex_destroy( & mutex);
-  remove(PATH);
-  #endif
-  shutdown(sockfd, SHUT_RDWR);
-  close(sockfd);
-  free(datap);
+  if (config.mode == MODE_THREAD) {
+    conn_registry_close_all();
+    conn_registry_free();
+  }
+  event_loop_stop();
+  thread_pool_stop();
+  uring_loop_stop();
+  if (timer_fd != -1) {
+    close(timer_fd);
+  }
+  if (log_ready()) {
+    config.backend -> close(successor_fd != -1); // a successor continues the log
+  }
+  buffer_pool_free(); // every connection is closed, so no buffer is out
+  if (successor_fd != -1) {
+    hot_restart_finish(successor_fd);
+  } else if (restart_fd != -1) {
+    close(restart_fd);
+    unlink(config.restart_path);
+  }
+  if (sockfd != -1) {
+    shutdown(sockfd, SHUT_RDWR);
+    close(sockfd);
+  }
+  syslog(LOG_INFO, "Replayed %llu bytes zero-copy, %llu bytes through user space, %llu bytes from the replay cache",
+    (unsigned long long) stats_total(STAT_REPLAY_ZERO_COPY_BYTES), (unsigned long long) stats_total(STAT_REPLAY_COPIED_BYTES),
+    (unsigned long long) stats_total(STAT_REPLAY_CACHE_BYTES));
   closelog();
   return 0;
 }
@@ -0,0 +1,471 @@
+/*
+Author: Visweshwaran Baskaran
+File name: aesdsocket_bench.c
+File description:
+Load generator and latency benchmark for aesdsocket. K client threads each open one connection to
+127.0.0.1 and send newline terminated records of a configurable size, optionally paced to a fixed rate and
+mixed with AESDCHAR_IOCSEEKTO:x,y commands. Every record written by a client is unique, so the client
+verifies the echoed replay by scanning the byte stream for that exact line; the latency of a record is the
+time from its (scheduled) send until the line has been received in full. A SEEKTO command is timed until its
+first response byte. With '-T' every connection first sends AESDTAIL so that the server replies with only the
+bytes appended since its previous reply instead of the whole log. Results are printed as text and, with '-o', appended as one CSV row per run.
+The benchmark deliberately only connects to the loopback address.
+References:
+[1] https://beej.us/guide/bgnet/html/ 6.2 A Simple Stream Client
+[2] Linux manual pages https://man7.org/linux/man-pages/man3/clock_gettime.3.html
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 9000
+#define DEFAULT_CONNECTIONS 4
+#define DEFAULT_RECORDS 1000 // records per connection
+#define DEFAULT_RECORD_SIZE 64 // bytes per record, including the newline
+#define DEFAULT_TIMEOUT_MS 5000 // give up on a record whose echo does not arrive in this time
+#define RECV_BUFFER_SIZE (64 * 1024)
+#define SEEKTO_COMMAND "AESDCHAR_IOCSEEKTO:"
+#define TAIL_COMMAND "AESDTAIL\n"
+
+struct bench_options {
+  int port;
+  int connections;
+  int records;
+  size_t min_size;
+  size_t max_size;
+  double rate; // records per second per connection, 0 sends the next record as soon as the previous echo arrived
+  int seek_percent; // share of requests that are SEEKTO commands instead of records
+  unsigned int seek_cmd;
+  unsigned int seek_offset;
+  bool tail; // send AESDTAIL after connecting
+  int timeout_ms;
+  const char * csv_path;
+  const char * label;
+};
+
+struct client {
+  pthread_t thread;
+  int id;
+  uint64_t * latencies_ns; // one entry per request, records and SEEKTO commands
+  int completed;
+  int seeks;
+  int failures; // records whose echo was missing or a connection error
+  unsigned long long bytes_sent;
+  unsigned long long bytes_received;
+};
+
+/**
+ * Streaming matcher for one expected line in the replayed byte stream
+ */
+struct line_scanner {
+  const char * expected;
+  size_t expected_len; // including the newline
+  size_t pos; // bytes of the current line matched so far
+  bool mismatch; // the current line already differs from expected
+};
+
+static struct bench_options opts = {
+  .port = DEFAULT_PORT,
+  .connections = DEFAULT_CONNECTIONS,
+  .records = DEFAULT_RECORDS,
+  .min_size = DEFAULT_RECORD_SIZE,
+  .max_size = DEFAULT_RECORD_SIZE,
+  .rate = 0,
+  .seek_percent = 0,
+  .seek_cmd = 0,
+  .seek_offset = 0,
+  .tail = false,
+  .timeout_ms = DEFAULT_TIMEOUT_MS,
+  .csv_path = NULL,
+  .label = "aesdsocket",
+};
+
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, & ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline) {
+  uint64_t now = now_ns();
+  if (deadline > now) {
+    struct timespec ts = {
+      .tv_sec = (deadline - now) / 1000000000ULL,
+      .tv_nsec = (deadline - now) % 1000000000ULL,
+    };
+    nanosleep( & ts, NULL);
+  }
+}
+
+/**
+ * @brief Feed received bytes to the scanner.
+ * @return Number of bytes consumed up to and including the newline of the expected line, or 0 if it was not
+ * completed within buf (everything was consumed)
+ */
+static size_t scanner_feed(struct line_scanner * scanner, const char * buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    char c = buf[i];
+    if (!scanner -> mismatch) {
+      if (scanner -> pos < scanner -> expected_len && scanner -> expected[scanner -> pos] == c) {
+        scanner -> pos++;
+      } else {
+        scanner -> mismatch = true;
+      }
+    }
+    if (c == '\n') {
+      bool found = !scanner -> mismatch && scanner -> pos == scanner -> expected_len;
+      scanner -> pos = 0;
+      scanner -> mismatch = false;
+      if (found) {
+        return i + 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static int send_all(int sockfd, const char * buf, size_t len) {
+  while (len > 0) {
+    ssize_t sent = send(sockfd, buf, len, MSG_NOSIGNAL);
+    if (sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+/**
+ * @brief Build a unique record: "b<client>-<seq>-" followed by lowercase filler and a newline.
+ *
+ * The filler never contains digits or '-', so no suffix of an older record can match a newer one even when a
+ * SEEKTO response starts in the middle of a line.
+ */
+static size_t make_record(char * buf, size_t size, int client_id, int seq, unsigned int * seed) {
+  int header_len = snprintf(buf, size, "b%d-%d-", client_id, seq);
+  size_t len = size > (size_t) header_len + 1 ? size : (size_t) header_len + 1;
+  for (size_t i = header_len; i < len - 1; i++) {
+    buf[i] = 'a' + rand_r(seed) % 26;
+  }
+  buf[len - 1] = '\n';
+  return len;
+}
+
+/**
+ * @brief Read from the connection until the scanner matches, keeping unconsumed bytes for the next request.
+ * @return 0 when the expected line arrived, -1 on timeout or connection failure
+ */
+static int wait_for_line(int sockfd, struct line_scanner * scanner, char * rbuf, size_t * rlen, struct client * self) {
+  while (1) {
+    if ( * rlen > 0) {
+      size_t used = scanner_feed(scanner, rbuf, * rlen);
+      if (used > 0) {
+        memmove(rbuf, rbuf + used, * rlen - used);
+        * rlen -= used;
+        return 0;
+      }
+      * rlen = 0;
+    }
+    ssize_t n = recv(sockfd, rbuf, RECV_BUFFER_SIZE, 0);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    self -> bytes_received += n;
+    * rlen = n;
+  }
+}
+
+/**
+ * @brief Wait for the first byte answering a SEEKTO command; the rest is skipped by the next line scan.
+ * @return 0 on success, -1 on timeout or connection failure
+ */
+static int wait_for_data(int sockfd, struct line_scanner * scanner, char * rbuf, size_t * rlen, struct client * self) {
+  // Bytes already buffered belong to the previous replay; they only advance the line state
+  scanner -> expected = "";
+  scanner -> expected_len = 0;
+  scanner_feed(scanner, rbuf, * rlen);
+  * rlen = 0;
+  while (1) {
+    ssize_t n = recv(sockfd, rbuf, RECV_BUFFER_SIZE, 0);
+    if (n > 0) {
+      self -> bytes_received += n;
+      * rlen = n;
+      return 0;
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    return -1;
+  }
+}
+
+static void * client_thread(void * arg) {
+  struct client * self = (struct client * ) arg;
+  unsigned int seed = 0x5eed ^ (self -> id * 2654435761U);
+  char * record = malloc(opts.max_size + 64);
+  char * rbuf = malloc(RECV_BUFFER_SIZE);
+  size_t rlen = 0;
+  struct line_scanner scanner = {0};
+  char seek_cmd[64];
+  int seek_len = snprintf(seek_cmd, sizeof(seek_cmd), "%s%u,%u\n", SEEKTO_COMMAND, opts.seek_cmd, opts.seek_offset);
+
+  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(opts.port),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  struct timeval tv = {
+    .tv_sec = opts.timeout_ms / 1000,
+    .tv_usec = (opts.timeout_ms % 1000) * 1000,
+  };
+  bool connected = record != NULL && rbuf != NULL && sockfd != -1 &&
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, & tv, sizeof(tv)) == 0 &&
+    connect(sockfd, (struct sockaddr * ) & addr, sizeof(addr)) == 0;
+  if (!connected) {
+    perror("connect");
+  }
+  if (connected && opts.tail) {
+    // The reply (the log so far, possibly empty) is not waited for: it precedes the first record's echo and
+    // is skipped by its line scan
+    connected = send_all(sockfd, TAIL_COMMAND, strlen(TAIL_COMMAND)) == 0;
+    self -> bytes_sent += strlen(TAIL_COMMAND);
+  }
+  pthread_barrier_wait( & start_barrier);
+
+  uint64_t start = now_ns();
+  for (int seq = 0; connected && seq < opts.records; seq++) {
+    uint64_t send_time = now_ns();
+    if (opts.rate > 0) {
+      // Latency is measured from the scheduled time, so a slow server is not hidden by the client waiting on it
+      send_time = start + (uint64_t)(seq * 1e9 / opts.rate);
+      sleep_until_ns(send_time);
+    }
+    bool seek = opts.seek_percent > 0 && seq > 0 && rand_r( & seed) % 100 < (unsigned int) opts.seek_percent;
+    int result;
+    if (seek) {
+      result = send_all(sockfd, seek_cmd, seek_len);
+      self -> bytes_sent += seek_len;
+      if (result == 0) {
+        result = wait_for_data(sockfd, & scanner, rbuf, & rlen, self);
+      }
+      self -> seeks++;
+    } else {
+      size_t size = opts.min_size;
+      if (opts.max_size > opts.min_size) {
+        size += rand_r( & seed) % (opts.max_size - opts.min_size + 1);
+      }
+      size_t len = make_record(record, size, self -> id, seq, & seed);
+      scanner.expected = record;
+      scanner.expected_len = len;
+      result = send_all(sockfd, record, len);
+      self -> bytes_sent += len;
+      if (result == 0) {
+        result = wait_for_line(sockfd, & scanner, rbuf, & rlen, self);
+      }
+    }
+    if (result != 0) {
+      // Without the echo the stream position is unknown, so the connection is abandoned
+      self -> failures += opts.records - seq;
+      fprintf(stderr, "client %d: %s %d failed: %s\n", self -> id, seek ? "seek" : "record", seq,
+        errno == EAGAIN ? "timed out" : strerror(errno));
+      break;
+    }
+    self -> latencies_ns[self -> completed++] = now_ns() - send_time;
+  }
+  if (!connected) {
+    self -> failures = opts.records;
+  }
+  if (sockfd != -1) {
+    close(sockfd);
+  }
+  free(record);
+  free(rbuf);
+  return NULL;
+}
+
+static int compare_u64(const void * a, const void * b) {
+  uint64_t x = * (const uint64_t * ) a;
+  uint64_t y = * (const uint64_t * ) b;
+  return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t * sorted, size_t count, double p) {
+  if (count == 0) {
+    return 0;
+  }
+  size_t index = (size_t)(p * (count - 1) + 0.5);
+  return sorted[index] / 1000.0;
+}
+
+static void usage(const char * prog) {
+  fprintf(stderr, "Usage: %s [-p port] [-c connections] [-n records] [-s size[:max_size]] [-r rate]\n"
+    "       [-k seek_percent] [-S cmd,offset] [-T] [-t timeout_ms] [-o csv_file] [-L label]\n"
+    "  -c  concurrent connections to 127.0.0.1 (default %d)\n"
+    "  -n  requests per connection (default %d)\n"
+    "  -s  record size in bytes including the newline, or a min:max range (default %d)\n"
+    "  -r  requests per second per connection, 0 for back to back (default 0)\n"
+    "  -k  percentage of requests sent as " SEEKTO_COMMAND "cmd,offset (default 0)\n"
+    "  -S  SEEKTO arguments (default 0,0)\n"
+    "  -T  send AESDTAIL first: replies carry only the log appended since the previous reply\n"
+    "  -o  append a CSV result row to csv_file ('-' for stdout)\n"
+    "  -L  label written in the CSV row, e.g. the server mode under test\n",
+    prog, DEFAULT_CONNECTIONS, DEFAULT_RECORDS, DEFAULT_RECORD_SIZE);
+}
+
+int main(int argc, char * argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "p:c:n:s:r:k:S:Tt:o:L:h")) != -1) {
+    switch (opt) {
+    case 'p':
+      opts.port = atoi(optarg);
+      break;
+    case 'c':
+      opts.connections = atoi(optarg);
+      break;
+    case 'n':
+      opts.records = atoi(optarg);
+      break;
+    case 's':
+      if (sscanf(optarg, "%zu:%zu", & opts.min_size, & opts.max_size) != 2) {
+        opts.max_size = opts.min_size;
+      }
+      break;
+    case 'r':
+      opts.rate = atof(optarg);
+      break;
+    case 'k':
+      opts.seek_percent = atoi(optarg);
+      break;
+    case 'S':
+      if (sscanf(optarg, "%u,%u", & opts.seek_cmd, & opts.seek_offset) != 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'T':
+      opts.tail = true;
+      break;
+    case 't':
+      opts.timeout_ms = atoi(optarg);
+      break;
+    case 'o':
+      opts.csv_path = optarg;
+      break;
+    case 'L':
+      opts.label = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (opts.port <= 0 || opts.connections <= 0 || opts.records <= 0 || opts.min_size == 0 ||
+    opts.max_size < opts.min_size || opts.rate < 0 || opts.seek_percent < 0 || opts.seek_percent > 100 ||
+    opts.timeout_ms <= 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  struct client * clients = calloc(opts.connections, sizeof(struct client));
+  if (clients == NULL) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+  pthread_barrier_init( & start_barrier, NULL, opts.connections + 1);
+  for (int i = 0; i < opts.connections; i++) {
+    clients[i].id = i;
+    clients[i].latencies_ns = malloc(opts.records * sizeof(uint64_t));
+    if (clients[i].latencies_ns == NULL || pthread_create( & clients[i].thread, NULL, client_thread, & clients[i]) != 0) {
+      perror("client start");
+      return EXIT_FAILURE;
+    }
+  }
+  pthread_barrier_wait( & start_barrier);
+  uint64_t start = now_ns();
+  for (int i = 0; i < opts.connections; i++) {
+    pthread_join(clients[i].thread, NULL);
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  size_t total = 0;
+  int seeks = 0;
+  int failures = 0;
+  unsigned long long bytes_sent = 0;
+  unsigned long long bytes_received = 0;
+  for (int i = 0; i < opts.connections; i++) {
+    total += clients[i].completed;
+    seeks += clients[i].seeks;
+    failures += clients[i].failures;
+    bytes_sent += clients[i].bytes_sent;
+    bytes_received += clients[i].bytes_received;
+  }
+  uint64_t * all = malloc((total ? total : 1) * sizeof(uint64_t));
+  if (all == NULL) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+  size_t n = 0;
+  for (int i = 0; i < opts.connections; i++) {
+    memcpy(all + n, clients[i].latencies_ns, clients[i].completed * sizeof(uint64_t));
+    n += clients[i].completed;
+    free(clients[i].latencies_ns);
+  }
+  qsort(all, total, sizeof(uint64_t), compare_u64);
+  double p50 = percentile_us(all, total, 0.50);
+  double p99 = percentile_us(all, total, 0.99);
+  double p999 = percentile_us(all, total, 0.999);
+  double max = total ? all[total - 1] / 1000.0 : 0;
+
+  printf("%s: %d connections x %d requests, record size %zu-%zu bytes, rate %s, %d%% SEEKTO%s\n",
+    opts.label, opts.connections, opts.records, opts.min_size, opts.max_size,
+    opts.rate > 0 ? "paced" : "unpaced", opts.seek_percent, opts.tail ? ", tail mode" : "");
+  printf("  completed   %zu requests (%d SEEKTO) in %.3f s, %d failed verification\n", total, seeks, elapsed, failures);
+  printf("  throughput  %.0f requests/s, %.2f MB/s sent, %.2f MB/s replayed\n", total / elapsed,
+    bytes_sent / elapsed / 1e6, bytes_received / elapsed / 1e6);
+  printf("  latency     p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n", p50, p99, p999, max);
+
+  if (opts.csv_path != NULL) {
+    bool to_stdout = strcmp(opts.csv_path, "-") == 0;
+    FILE * csv = to_stdout ? stdout : fopen(opts.csv_path, "a");
+    if (csv == NULL) {
+      perror("fopen");
+      return EXIT_FAILURE;
+    }
+    if (to_stdout || ftell(csv) == 0) {
+      fprintf(csv, "label,connections,requests,min_size,max_size,rate,seek_percent,completed,failed,seconds,"
+        "requests_per_s,sent_mb_per_s,replayed_mb_per_s,p50_us,p99_us,p999_us,max_us\n");
+    }
+    fprintf(csv, "%s,%d,%d,%zu,%zu,%.1f,%d,%zu,%d,%.3f,%.0f,%.3f,%.3f,%.1f,%.1f,%.1f,%.1f\n",
+      opts.label, opts.connections, opts.records, opts.min_size, opts.max_size, opts.rate, opts.seek_percent,
+      total, failures, elapsed, total / elapsed, bytes_sent / elapsed / 1e6, bytes_received / elapsed / 1e6,
+      p50, p99, p999, max);
+    if (!to_stdout) {
+      fclose(csv);
+    }
+  }
+  free(all);
+  free(clients);
+  pthread_barrier_destroy( & start_barrier);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,188 @@
+/*
+Author: Visweshwaran Baskaran
+File name: backend_chardev.c
+File description:
+Character device backend ('-B chardev'): every record is written to the aesdchar driver, which keeps the
+last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED writes, and the device is read back to the client. Each
+connection opens the device once, on its first request, and keeps the descriptor until it closes: a request
+rewinds it, and AESDCHAR_IOCSEEKTO is passed to the driver as an ioctl on it before the replay is read, so
+seeking never reopens the device.
+References:
+[1] ../aesd-char-driver/aesd_ioctl.h
+ */
+
+#include "includes/backend.h"
+#include "includes/stats.h"
+#include "includes/outq.h"
+#include "includes/frame.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include <syslog.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+static int open_device(int flags) {
+  int file_fd = open(config.path, flags, 0666);
+  if (file_fd == -1) {
+    syslog(LOG_ERR, "Open failed: %s", strerror(errno));
+    perror("open");
+  }
+  return file_fd;
+}
+
+/**
+ * @brief The connection's descriptor on the device, opened on its first request.
+ */
+static int session_device(struct client_session * session) {
+  if (session -> device_fd == -1) {
+    session -> device_fd = open_device(O_RDWR | O_APPEND | O_CREAT);
+  }
+  return session -> device_fd;
+}
+
+/**
+ * @brief Write the whole record. A hot restart sends SIGUSR1 without SA_RESTART, so EINTR is retried.
+ */
+static int write_device(int file_fd, const char * buf, size_t len) {
+  while (len > 0) {
+    ssize_t bytes_written = write(file_fd, buf, len);
+    if (bytes_written == SYSCALL_ERROR) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      syslog(LOG_ERR, "write failed: %s", strerror(errno));
+      return -1;
+    }
+    buf += bytes_written;
+    len -= bytes_written;
+  }
+  return 0;
+}
+
+/**
+ * @brief Send everything readable from file_fd as one FRAME_REPLAY frame. The driver cannot tell the length
+ * up front, so the contents are read into memory first.
+ */
+static bool replay_framed(int client_sockfd, struct client_session * session, int file_fd) {
+  size_t cap = config.max_packet_size;
+  size_t len = 0;
+  char * buf = (char * ) malloc(cap);
+  while (buf != NULL) {
+    if (len == cap) {
+      char * grown = (char * ) realloc(buf, cap * 2);
+      if (grown == NULL) {
+        break;
+      }
+      buf = grown;
+      cap *= 2;
+    }
+    ssize_t bytes_read = read(file_fd, buf + len, cap - len);
+    if (bytes_read == SYSCALL_ERROR && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      bool retval = bytes_read == 0 && frame_send(client_sockfd, session, FRAME_REPLAY, buf, len) == 0;
+      stats_add(STAT_REPLAY_COPIED_BYTES, len);
+      free(buf);
+      return retval;
+    }
+    len += bytes_read;
+  }
+  syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+  free(buf);
+  return false;
+}
+
+static int chardev_open(bool resume) {
+  (void) resume; // the driver owns the contents
+  return 0;
+}
+
+static void chardev_close(bool keep) {
+  (void) keep;
+}
+
+/**
+ * @reference updated for A9 based on Ashwin Ravindra's implementation.
+ */
+static bool chardev_handle(int client_sockfd, struct client_session * session, enum packet_kind kind, const char * buf, size_t len) {
+  bool retval = true;
+  int file_fd = session_device(session);
+  if (file_fd == -1) {
+    return false;
+  }
+  if (kind == PACKET_RECORD) {
+    uint64_t start_ns = stats_now_ns();
+    if (write_device(file_fd, buf, len) != 0) {
+      return false;
+    }
+    stats_record_latency(HIST_WRITE, stats_now_ns() - start_ns);
+  }
+  // Every replay starts where a freshly opened descriptor would, and the driver's seek is relative to it
+  if (lseek(file_fd, 0, SEEK_SET) == SYSCALL_ERROR) {
+    syslog(LOG_ERR, "lseek failed: %s", strerror(errno));
+    return false;
+  }
+  if (kind == PACKET_SEEKTO) {
+    struct aesd_seekto seekto;
+    if (parse_seekto(buf, len, & seekto.write_cmd, & seekto.write_cmd_offset) != 0) {
+      syslog(LOG_ERR, "Malformed seek command, replaying the whole device");
+    } else {
+      int result;
+      while ((result = ioctl(file_fd, AESDCHAR_IOCSEEKTO, & seekto)) != 0 && errno == EINTR) {
+      }
+      if (result != 0) {
+        syslog(LOG_ERR, "ioctl failed: %s", strerror(errno));
+      }
+    }
+  }
+
+  uint64_t replay_start_ns = stats_now_ns();
+  if (session -> framed) {
+    retval = replay_framed(client_sockfd, session, file_fd);
+  } else if (session -> out != NULL) {
+    retval = outq_push_contents(session -> out, file_fd) == 0; // the driver cannot be read later from a saved position
+  } else if (replay_fd(client_sockfd, file_fd, NULL, SIZE_MAX) != 0) {
+    retval = false;
+  }
+  stats_record_latency(HIST_REPLAY, stats_now_ns() - replay_start_ns);
+  return retval;
+}
+
+static int chardev_append(struct client_session * session, const char * buf, size_t len, off_t * end) {
+  uint64_t start_ns = stats_now_ns();
+  * end = 0; // the driver renumbers offsets as entries drop out
+  int file_fd = session_device(session);
+  int result = file_fd == -1 ? -1 : write_device(file_fd, buf, len);
+  stats_record_latency(HIST_WRITE, stats_now_ns() - start_ns);
+  return result;
+}
+
+static void chardev_release(struct client_session * session) {
+  if (session -> device_fd != -1) {
+    close(session -> device_fd);
+    session -> device_fd = -1;
+  }
+}
+
+const struct backend chardev_backend = {
+  .name = "chardev",
+  .default_path = "/dev/aesdchar",
+  // The driver keeps only the last writes and renumbers offsets as entries drop out, so there is no stable
+  // delivered offset to resume from
+  .stable_offsets = false,
+  .storage_log = false,
+  .open = chardev_open,
+  .close = chardev_close,
+  .handle = chardev_handle,
+  .append = chardev_append,
+  .wait_durable = NULL,
+  .durable = NULL,
+  .timestamp = NULL,
+  .release = chardev_release,
+};
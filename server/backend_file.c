@@ -0,0 +1,133 @@
+/*
+Author: Visweshwaran Baskaran
+File name: backend_file.c
+File description:
+File backend ('-B file'): records go to the log of storage.c, a single file or a segmented log, and replays
+are sent from it with sendfile(), the replay cache or the outbound queue. Durable mode, the writer thread,
+retention and compression are options of this backend.
+ */
+
+#include "includes/backend.h"
+#include "includes/storage.h"
+#include "includes/stats.h"
+#include "includes/outq.h"
+#include "includes/frame.h"
+#include <syslog.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+static int file_open(bool resume) {
+  if (!resume) {
+    remove(config.path); // to erase contents and the file in case of SIGKILL (kill -s 9 <pid>); a segmented log is resumed instead
+  }
+  if (storage_open(config.path, config.cache_bytes, config.segment_bytes) != 0) {
+    return -1;
+  }
+  if ((config.durable && storage_enable_durable(config.sync_window_us, config.sync_window_bytes) != 0) ||
+    (config.writer_thread && storage_enable_writer() != 0)) {
+    storage_close();
+    return -1;
+  }
+  storage_set_retention(config.retain_bytes, config.retain_seconds);
+  if (config.compress_level > 0 && storage_enable_compression(config.compress_level, config.hot_cache_bytes) != 0) {
+    storage_close();
+    return -1;
+  }
+  return 0;
+}
+
+static void file_close(bool keep) {
+  storage_close();
+  if (config.segment_bytes == 0 && !keep) {
+    remove(config.path);
+  }
+}
+
+static bool file_durable(off_t end) {
+  if (!storage_is_durable() || storage_durable() >= end) {
+    return true;
+  }
+  storage_request_sync();
+  return false;
+}
+
+static bool file_handle(int client_sockfd, struct client_session * session, enum packet_kind kind, const char * buf, size_t len) {
+  if (kind == PACKET_SEEKTO) {
+    // A regular file has no write command index to seek into: replay the whole log like the ioctl failure path
+    syslog(LOG_ERR, "ioctl failed: %s", strerror(ENOTTY));
+    session -> delivered = 0;
+  } else if (kind == PACKET_RECORD) {
+    off_t end;
+    uint64_t start_ns = stats_now_ns();
+    int result = storage_append(buf, len, & end);
+    stats_record_latency(HIST_WRITE, stats_now_ns() - start_ns);
+    if (result != 0) {
+      return false;
+    }
+    // The replay acknowledges the record, so in durable mode it waits for the group commit: an event loop
+    // parks the connection and comes back with PACKET_REPLAY instead of blocking every connection it serves
+    if (session -> out != NULL && !file_durable(end)) {
+      session -> durable_wait = end;
+      return true;
+    }
+    storage_wait_durable(end);
+  }
+  uint64_t replay_start_ns = stats_now_ns();
+  bool retval;
+  off_t from = session -> tail_mode ? session -> delivered : 0;
+  off_t to = storage_durable();
+  struct log_segment * hold = NULL;
+  if (session -> framed) {
+    // The frame announces its length up front, so retention must not drop any of the range until it is sent
+    hold = storage_hold( & from);
+  } else if (from < storage_first()) {
+    from = storage_first(); // older segments were dropped by retention
+  }
+  if (from > to) {
+    from = to;
+  }
+  if (session -> framed && frame_send_header(client_sockfd, session, FRAME_REPLAY, to - from) != 0) {
+    storage_release(hold);
+    return false;
+  }
+  if (session -> out != NULL) {
+    // The committed prefix never changes, so the range can be sent whenever the socket has room
+    retval = outq_push_log(session -> out, from, to, hold) == 0;
+  } else {
+    retval = storage_replay(client_sockfd, from, to) == 0;
+    storage_release(hold);
+  }
+  session -> delivered = to;
+  stats_record_latency(HIST_REPLAY, stats_now_ns() - replay_start_ns);
+  return retval;
+}
+
+static int file_append(struct client_session * session, const char * buf, size_t len, off_t * end) {
+  (void) session;
+  uint64_t start_ns = stats_now_ns();
+  int result = storage_append(buf, len, end);
+  stats_record_latency(HIST_WRITE, stats_now_ns() - start_ns);
+  return result;
+}
+
+static void file_timestamp(const char * line, size_t len) {
+  // Appended through the same lock-free path as client records
+  storage_append(line, len, NULL);
+  storage_trim(); // age based retention is checked at the timestamp period
+}
+
+const struct backend file_backend = {
+  .name = "file",
+  .default_path = "/var/tmp/aesdsocketdata",
+  .stable_offsets = true,
+  .storage_log = true,
+  .open = file_open,
+  .close = file_close,
+  .handle = file_handle,
+  .append = file_append,
+  .wait_durable = storage_wait_durable, // one group commit covers a whole batch of frames
+  .durable = file_durable,
+  .timestamp = file_timestamp,
+  .release = NULL,
+};
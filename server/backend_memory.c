@@ -0,0 +1,184 @@
+/*
+Author: Visweshwaran Baskaran
+File name: backend_memory.c
+File description:
+In-memory backend ('-B memory'): the log is kept in fixed-size heap chunks and never touches a file, so
+benchmarks against it measure the connection models and the protocol without the storage path. Appends are
+serialized by a mutex and published by a release store of the end offset; chunks are never moved or freed
+while the server runs, so replays read the published prefix without taking the append lock. Only the chunk
+table, which grows by doubling, is guarded by a read-write lock. The log is lost when the process exits.
+ */
+
+#include "includes/backend.h"
+#include "includes/stats.h"
+#include "includes/outq.h"
+#include "includes/frame.h"
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MEMORY_CHUNK_BYTES (1024 * 1024)
+#define MEMORY_INITIAL_CHUNKS 16
+
+static pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char ** chunks = NULL;
+static size_t num_chunks = 0;
+static size_t table_capacity = 0;
+static _Atomic off_t log_end = 0; // bytes published to readers
+
+static char * chunk_at(off_t offset) {
+  pthread_rwlock_rdlock( & table_lock);
+  char * chunk = chunks[offset / MEMORY_CHUNK_BYTES];
+  pthread_rwlock_unlock( & table_lock);
+  return chunk;
+}
+
+/**
+ * @brief Add one chunk at the end of the table. Called with append_lock held.
+ */
+static int add_chunk(void) {
+  char * chunk = (char * ) malloc(MEMORY_CHUNK_BYTES);
+  if (chunk == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    return -1;
+  }
+  pthread_rwlock_wrlock( & table_lock);
+  if (num_chunks == table_capacity) {
+    size_t capacity = table_capacity > 0 ? table_capacity * 2 : MEMORY_INITIAL_CHUNKS;
+    char ** table = (char ** ) realloc(chunks, capacity * sizeof(char * ));
+    if (table == NULL) {
+      pthread_rwlock_unlock( & table_lock);
+      syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+      free(chunk);
+      return -1;
+    }
+    chunks = table;
+    table_capacity = capacity;
+  }
+  chunks[num_chunks++] = chunk;
+  pthread_rwlock_unlock( & table_lock);
+  return 0;
+}
+
+/**
+ * @brief Append len bytes and publish them.
+ * @return The log end after the append, or -1 on failure
+ */
+static off_t memory_append(const char * buf, size_t len) {
+  pthread_mutex_lock( & append_lock);
+  off_t end = atomic_load_explicit( & log_end, memory_order_relaxed);
+  size_t copied = 0;
+  while (copied < len) {
+    off_t offset = end + copied;
+    if ((size_t)(offset / MEMORY_CHUNK_BYTES) >= num_chunks && add_chunk() != 0) {
+      pthread_mutex_unlock( & append_lock);
+      return -1;
+    }
+    size_t in_chunk = offset % MEMORY_CHUNK_BYTES;
+    size_t n = MEMORY_CHUNK_BYTES - in_chunk < len - copied ? MEMORY_CHUNK_BYTES - in_chunk : len - copied;
+    memcpy(chunk_at(offset) + in_chunk, buf + copied, n);
+    copied += n;
+  }
+  end += len;
+  atomic_store_explicit( & log_end, end, memory_order_release);
+  pthread_mutex_unlock( & append_lock);
+  return end;
+}
+
+/**
+ * @brief Send the log bytes [from, to) to the client, or queue them on out. Chunks are never freed while the
+ * server runs, so queued ranges point into them instead of being copied.
+ */
+static int memory_replay(int client_sockfd, struct outq * out, off_t from, off_t to) {
+  while (from < to) {
+    size_t in_chunk = from % MEMORY_CHUNK_BYTES;
+    size_t n = MEMORY_CHUNK_BYTES - in_chunk < (size_t)(to - from) ? MEMORY_CHUNK_BYTES - in_chunk : (size_t)(to - from);
+    const char * data = chunk_at(from) + in_chunk;
+    if ((out != NULL ? outq_push_borrowed(out, data, n) : send_all(client_sockfd, data, n)) != 0) {
+      return -1;
+    }
+    stats_add(STAT_REPLAY_COPIED_BYTES, n);
+    from += n;
+  }
+  return 0;
+}
+
+static int memory_open(bool resume) {
+  (void) resume; // nothing survives the previous process
+  atomic_store( & log_end, 0);
+  return 0;
+}
+
+static void memory_close(bool keep) {
+  (void) keep;
+  for (size_t i = 0; i < num_chunks; i++) {
+    free(chunks[i]);
+  }
+  free(chunks);
+  chunks = NULL;
+  num_chunks = 0;
+  table_capacity = 0;
+  atomic_store( & log_end, 0);
+}
+
+static bool memory_handle(int client_sockfd, struct client_session * session, enum packet_kind kind, const char * buf, size_t len) {
+  if (kind == PACKET_SEEKTO) {
+    // Like the file backend: no write command index, replay the whole log
+    syslog(LOG_ERR, "ioctl failed: %s", strerror(ENOTTY));
+    session -> delivered = 0;
+  } else if (kind == PACKET_RECORD) {
+    uint64_t start_ns = stats_now_ns();
+    off_t end = memory_append(buf, len);
+    stats_record_latency(HIST_WRITE, stats_now_ns() - start_ns);
+    if (end < 0) {
+      return false;
+    }
+  }
+  uint64_t replay_start_ns = stats_now_ns();
+  off_t to = atomic_load_explicit( & log_end, memory_order_acquire);
+  off_t from = session -> tail_mode ? session -> delivered : 0;
+  if (from > to) {
+    from = to; // delivered by a predecessor process whose log is gone
+  }
+  // Chunks are never freed while the server runs, so the announced range is always sent in full; a failure
+  // part way closes the connection
+  if (session -> framed && frame_send_header(client_sockfd, session, FRAME_REPLAY, to - from) != 0) {
+    return false;
+  }
+  bool retval = memory_replay(client_sockfd, session -> out, from, to) == 0;
+  session -> delivered = to;
+  stats_record_latency(HIST_REPLAY, stats_now_ns() - replay_start_ns);
+  return retval;
+}
+
+static int memory_store(struct client_session * session, const char * buf, size_t len, off_t * end) {
+  (void) session;
+  uint64_t start_ns = stats_now_ns();
+  * end = memory_append(buf, len);
+  stats_record_latency(HIST_WRITE, stats_now_ns() - start_ns);
+  return * end < 0 ? -1 : 0;
+}
+
+static void memory_timestamp(const char * line, size_t len) {
+  memory_append(line, len);
+}
+
+const struct backend memory_backend = {
+  .name = "memory",
+  .default_path = "(memory)",
+  .stable_offsets = true,
+  .storage_log = false,
+  .open = memory_open,
+  .close = memory_close,
+  .handle = memory_handle,
+  .append = memory_store,
+  .wait_durable = NULL,
+  .durable = NULL,
+  .timestamp = memory_timestamp,
+  .release = NULL,
+};
@@ -0,0 +1,267 @@
+/*
+Author: Visweshwaran Baskaran
+File name: backend_ring.c
+File description:
+Ring backend ('-B ring'): the aesdchar driver's circular buffer, linked into aesdsocket, so the device
+semantics are available on hosts where the module cannot be loaded. Like the driver it keeps the last
+AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED writes, holds writes without a newline until one arrives, and seeks
+with AESDCHAR_IOCSEEKTO:<write_cmd>,<write_cmd_offset>, counted from the oldest write kept. Replays are
+sent straight from the entries with one sendmsg(): the lock is only held to take a reference on each entry,
+so a slow client never holds up writers and an overwritten entry is freed once its last replay is sent.
+References:
+[1] ../aesd-char-driver/aesd-circular-buffer.c
+[2] ../aesd-char-driver/main.c aesd_write(), aesd_adjust_file_offset()
+ */
+
+#include "includes/backend.h"
+#include "includes/stats.h"
+#include "includes/outq.h"
+#include "includes/frame.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define RING_ENTRIES AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+/**
+ * One write kept by the ring; entry.buffptr points to data. The ring holds one reference and every replay
+ * in flight one more.
+ */
+struct ring_record {
+  _Atomic unsigned refs;
+  char data[];
+};
+
+/**
+ * The entries a replay sends, in order, with a reference held on each
+ */
+struct ring_snapshot {
+  struct aesd_buffer_entry entry[RING_ENTRIES];
+  int count;
+  size_t skip; // bytes of entry[0] before the seek position
+  size_t len; // bytes to send
+};
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct aesd_circular_buffer ring;
+static char * pending = NULL; // a write without a newline, completed by the next one like in the driver
+static size_t pending_len = 0;
+
+static struct ring_record * record_of(const char * buffptr) {
+  return (struct ring_record * )(buffptr - offsetof(struct ring_record, data));
+}
+
+static void record_put(const char * buffptr) {
+  if (buffptr != NULL && atomic_fetch_sub_explicit( & record_of(buffptr) -> refs, 1, memory_order_acq_rel) == 1) {
+    free(record_of(buffptr));
+  }
+}
+
+static int ring_add(const char * buf, size_t len) {
+  if (len == 0) {
+    return 0; // an empty data frame writes nothing
+  }
+  pthread_mutex_lock( & ring_lock);
+  if (memchr(buf, '\n', len) == NULL) {
+    char * grown = (char * ) realloc(pending, pending_len + len);
+    if (grown == NULL) {
+      pthread_mutex_unlock( & ring_lock);
+      syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+      return -1;
+    }
+    memcpy(grown + pending_len, buf, len);
+    pending = grown;
+    pending_len += len;
+    pthread_mutex_unlock( & ring_lock);
+    return 0;
+  }
+  struct ring_record * record = (struct ring_record * ) malloc(sizeof(struct ring_record) + pending_len + len);
+  if (record == NULL) {
+    pthread_mutex_unlock( & ring_lock);
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    return -1;
+  }
+  atomic_init( & record -> refs, 1);
+  if (pending_len > 0) {
+    memcpy(record -> data, pending, pending_len);
+  }
+  memcpy(record -> data + pending_len, buf, len);
+  struct aesd_buffer_entry entry = { .buffptr = record -> data, .size = pending_len + len };
+  free(pending);
+  pending = NULL;
+  pending_len = 0;
+  const char * overwritten = aesd_circular_buffer_add_entry( & ring, & entry);
+  pthread_mutex_unlock( & ring_lock);
+  record_put(overwritten); // freed now unless a replay still sends it
+  return 0;
+}
+
+/**
+ * @brief Take the entries from the seek position to the end of the ring.
+ * @param seekto NULL to take every entry.
+ * @return 0, or -1 if seekto is out of range, in which case every entry is taken like after a failed ioctl
+ */
+static int ring_snapshot(struct ring_snapshot * snap, const struct aesd_seekto * seekto) {
+  int retval = 0;
+  pthread_mutex_lock( & ring_lock);
+  int count = ring.full ? RING_ENTRIES : (ring.in_offs - ring.out_offs + RING_ENTRIES) % RING_ENTRIES;
+  int first = 0;
+  snap -> skip = 0;
+  if (seekto != NULL) {
+    const struct aesd_buffer_entry * target = & ring.entry[(ring.out_offs + seekto -> write_cmd) % RING_ENTRIES];
+    if (seekto -> write_cmd < (uint32_t) count && seekto -> write_cmd_offset < target -> size) {
+      first = seekto -> write_cmd;
+      snap -> skip = seekto -> write_cmd_offset;
+    } else {
+      retval = -1;
+    }
+  }
+  snap -> count = 0;
+  snap -> len = 0;
+  for (int i = first; i < count; i++) {
+    const struct aesd_buffer_entry * entry = & ring.entry[(ring.out_offs + i) % RING_ENTRIES];
+    atomic_fetch_add_explicit( & record_of(entry -> buffptr) -> refs, 1, memory_order_relaxed);
+    snap -> entry[snap -> count++] = * entry;
+    snap -> len += entry -> size;
+  }
+  snap -> len -= snap -> skip;
+  pthread_mutex_unlock( & ring_lock);
+  return retval;
+}
+
+static void ring_release(struct ring_snapshot * snap) {
+  for (int i = 0; i < snap -> count; i++) {
+    record_put(snap -> entry[i].buffptr);
+  }
+}
+
+/**
+ * @brief Send the snapshot, after the frame header in framed mode, with one sendmsg() when the socket has room.
+ */
+static int ring_send(int client_sockfd, struct client_session * session, const struct ring_snapshot * snap) {
+  uint8_t header[FRAME_HEADER_MAX];
+  size_t header_len = session -> framed ? frame_encode_header(header, FRAME_REPLAY, snap -> len) : 0;
+  struct iovec iov[RING_ENTRIES + 1];
+  int iovcnt = 0;
+  if (header_len > 0) {
+    iov[iovcnt++] = (struct iovec) { .iov_base = header, .iov_len = header_len };
+  }
+  for (int i = 0; i < snap -> count; i++) {
+    size_t skip = i == 0 ? snap -> skip : 0;
+    iov[iovcnt++] = (struct iovec) { .iov_base = (void * )(snap -> entry[i].buffptr + skip), .iov_len = snap -> entry[i].size - skip };
+  }
+  if (session -> out != NULL) {
+    // Queued data must outlive the snapshot's references, so it is copied
+    for (int i = 0; i < iovcnt; i++) {
+      if (outq_push_copy(session -> out, iov[i].iov_base, iov[i].iov_len) != 0) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+  if (iovcnt == 0) {
+    return 0;
+  }
+  struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+  ssize_t bytes_sent;
+  while ((bytes_sent = sendmsg(client_sockfd, & msg, MSG_NOSIGNAL)) == SYSCALL_ERROR && errno == EINTR) {
+  }
+  if (bytes_sent == SYSCALL_ERROR) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      syslog(LOG_ERR, "sendmsg failed: %s", strerror(errno));
+      return -1;
+    }
+    bytes_sent = 0;
+  }
+  stats_add(STAT_BYTES_OUT, bytes_sent);
+  // Short send: the rest goes out with send_all(), which also waits on a full non-blocking socket
+  size_t sent = bytes_sent;
+  for (int i = 0; i < iovcnt; i++) {
+    if (sent >= iov[i].iov_len) {
+      sent -= iov[i].iov_len;
+      continue;
+    }
+    if (send_all(client_sockfd, (const char * ) iov[i].iov_base + sent, iov[i].iov_len - sent) != 0) {
+      return -1;
+    }
+    sent = 0;
+  }
+  return 0;
+}
+
+static int ring_open(bool resume) {
+  (void) resume; // nothing survives the previous process
+  aesd_circular_buffer_init( & ring);
+  return 0;
+}
+
+static void ring_close(bool keep) {
+  (void) keep;
+  uint8_t index;
+  struct aesd_buffer_entry * entry;
+  AESD_CIRCULAR_BUFFER_FOREACH(entry, & ring, index) {
+    record_put(entry -> buffptr);
+  }
+  aesd_circular_buffer_init( & ring);
+  free(pending);
+  pending = NULL;
+  pending_len = 0;
+}
+
+static bool ring_handle(int client_sockfd, struct client_session * session, enum packet_kind kind, const char * buf, size_t len) {
+  struct aesd_seekto seekto;
+  if (kind == PACKET_SEEKTO) {
+    if (parse_seekto(buf, len, & seekto.write_cmd, & seekto.write_cmd_offset) != 0) {
+      seekto.write_cmd = UINT32_MAX; // out of range, like a malformed ioctl argument
+    }
+  } else if (kind == PACKET_RECORD) {
+    uint64_t start_ns = stats_now_ns();
+    if (ring_add(buf, len) != 0) {
+      return false;
+    }
+    stats_record_latency(HIST_WRITE, stats_now_ns() - start_ns);
+  }
+
+  uint64_t replay_start_ns = stats_now_ns();
+  struct ring_snapshot snap;
+  if (ring_snapshot( & snap, kind == PACKET_SEEKTO ? & seekto : NULL) != 0) {
+    syslog(LOG_ERR, "ioctl failed: %s", strerror(EINVAL));
+  }
+  bool retval = ring_send(client_sockfd, session, & snap) == 0;
+  stats_add(STAT_REPLAY_COPIED_BYTES, snap.len);
+  ring_release( & snap);
+  stats_record_latency(HIST_REPLAY, stats_now_ns() - replay_start_ns);
+  return retval;
+}
+
+static int ring_append(struct client_session * session, const char * buf, size_t len, off_t * end) {
+  (void) session;
+  uint64_t start_ns = stats_now_ns();
+  * end = 0; // offsets are renumbered as entries drop out, like the driver's
+  int result = ring_add(buf, len);
+  stats_record_latency(HIST_WRITE, stats_now_ns() - start_ns);
+  return result;
+}
+
+const struct backend ring_backend = {
+  .name = "ring",
+  .default_path = "(ring)",
+  .stable_offsets = false, // same as the driver
+  .storage_log = false,
+  .open = ring_open,
+  .close = ring_close,
+  .handle = ring_handle,
+  .append = ring_append,
+  .wait_durable = NULL,
+  .durable = NULL,
+  .timestamp = NULL,
+  .release = NULL,
+};
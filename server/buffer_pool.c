@@ -0,0 +1,153 @@
+/*
+Author: Visweshwaran Baskaran
+File name: buffer_pool.c
+File description:
+Lock-free buffer pool. Every size class is one calloc()ed slab cut into equal buffers, so the kernel only
+backs the buffers that were ever used. Free buffers form a Treiber stack threaded through a separate array
+of indexes; the stack head packs the top index with a tag bumped on every change, so a pop racing with a
+pop and push of the same buffer fails its compare-and-swap instead of corrupting the stack (ABA). Never
+used buffers are carved off the end of the slab with one fetch-add. The bytes handed out are tracked with
+their peak for AESDSTATS.
+References:
+[1] R. K. Treiber, Systems Programming: Coping with Parallelism, IBM RJ 5118, 1986
+[2] C11 atomics https://en.cppreference.com/w/c/atomic
+ */
+
+#include "includes/buffer_pool.h"
+#include "includes/stats.h"
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#define POOL_NONE UINT32_MAX // empty stack
+
+struct pool_class {
+  size_t size;
+  uint32_t count;
+  char * slab;
+  _Atomic uint32_t * next; // stack link of each free buffer
+  _Atomic uint64_t head; // tag << 32 | index of the top free buffer
+  _Atomic uint32_t carved; // buffers below this index were handed out at least once
+};
+
+static struct pool_class classes[BUFFER_POOL_CLASSES];
+static _Atomic uint64_t in_use = 0;
+static _Atomic uint64_t peak = 0;
+
+static void account(int64_t delta) {
+  uint64_t now = atomic_fetch_add_explicit( & in_use, delta, memory_order_relaxed) + delta;
+  uint64_t high = atomic_load_explicit( & peak, memory_order_relaxed);
+  while (now > high && !atomic_compare_exchange_weak_explicit( & peak, & high, now, memory_order_relaxed,
+      memory_order_relaxed)) {
+  }
+}
+
+int buffer_pool_init(size_t class_bytes) {
+  for (int c = 0; c < BUFFER_POOL_CLASSES; c++) {
+    struct pool_class * pool = & classes[c];
+    pool -> size = (size_t) 1 << (BUFFER_POOL_MIN_SHIFT + 2 * c);
+    pool -> count = class_bytes / pool -> size;
+    if (pool -> count == 0) {
+      // No slab: buffer_pool_get() skips the class and its sizes come from malloc()
+      syslog(LOG_WARNING, "Buffer pool slab of %zu bytes holds no %zu byte buffer, allocating those with malloc()",
+        class_bytes, pool -> size);
+      continue;
+    }
+    pool -> slab = (char * ) calloc(pool -> count, pool -> size);
+    pool -> next = (_Atomic uint32_t * ) calloc(pool -> count, sizeof(uint32_t));
+    if (pool -> slab == NULL || pool -> next == NULL) {
+      syslog(LOG_ERR, "Buffer pool allocation failed: %s", strerror(errno));
+      perror("calloc");
+      buffer_pool_free();
+      return -1;
+    }
+    atomic_store( & pool -> head, POOL_NONE);
+    atomic_store( & pool -> carved, 0);
+  }
+  return 0;
+}
+
+static void * pool_pop(struct pool_class * pool) {
+  uint64_t head = atomic_load_explicit( & pool -> head, memory_order_acquire);
+  while ((uint32_t) head != POOL_NONE) {
+    uint32_t index = (uint32_t) head;
+    // next[index] may be stale if another thread popped it meanwhile; the tag makes the swap fail then
+    uint64_t next = ((head >> 32) + 1) << 32 | atomic_load_explicit( & pool -> next[index], memory_order_relaxed);
+    if (atomic_compare_exchange_weak_explicit( & pool -> head, & head, next, memory_order_acquire, memory_order_acquire)) {
+      stats_add(STAT_POOL_HITS, 1);
+      return pool -> slab + (size_t) index * pool -> size;
+    }
+  }
+  if (atomic_load_explicit( & pool -> carved, memory_order_relaxed) < pool -> count) {
+    uint32_t index = atomic_fetch_add_explicit( & pool -> carved, 1, memory_order_relaxed);
+    if (index < pool -> count) {
+      stats_add(STAT_POOL_MISSES, 1);
+      return pool -> slab + (size_t) index * pool -> size;
+    }
+  }
+  return NULL;
+}
+
+void * buffer_pool_get(size_t size, size_t * cap) {
+  for (int c = 0; c < BUFFER_POOL_CLASSES; c++) {
+    struct pool_class * pool = & classes[c];
+    if (size <= pool -> size && pool -> slab != NULL) {
+      void * buf = pool_pop(pool);
+      if (buf != NULL) {
+        * cap = pool -> size;
+        account(pool -> size);
+        return buf;
+      }
+      break; // exhausted: a larger class would waste more than malloc()
+    }
+  }
+  stats_add(STAT_POOL_MISSES, 1);
+  void * buf = malloc(size);
+  if (buf != NULL) {
+    * cap = size;
+    account(size);
+  }
+  return buf;
+}
+
+void buffer_pool_put(void * buf, size_t cap) {
+  if (buf == NULL) {
+    return;
+  }
+  account(-(int64_t) cap);
+  for (int c = 0; c < BUFFER_POOL_CLASSES; c++) {
+    struct pool_class * pool = & classes[c];
+    char * p = (char * ) buf;
+    if (pool -> slab != NULL && p >= pool -> slab && p < pool -> slab + (size_t) pool -> count * pool -> size) {
+      uint32_t index = (p - pool -> slab) / pool -> size;
+      uint64_t head = atomic_load_explicit( & pool -> head, memory_order_relaxed);
+      uint64_t top;
+      do {
+        atomic_store_explicit( & pool -> next[index], (uint32_t) head, memory_order_relaxed);
+        top = ((head >> 32) + 1) << 32 | index;
+      } while (!atomic_compare_exchange_weak_explicit( & pool -> head, & head, top, memory_order_release,
+          memory_order_relaxed));
+      return;
+    }
+  }
+  free(buf);
+}
+
+uint64_t buffer_pool_in_use(void) {
+  return atomic_load_explicit( & in_use, memory_order_relaxed);
+}
+
+uint64_t buffer_pool_peak(void) {
+  return atomic_load_explicit( & peak, memory_order_relaxed);
+}
+
+void buffer_pool_free(void) {
+  for (int c = 0; c < BUFFER_POOL_CLASSES; c++) {
+    free(classes[c].slab);
+    free((void * ) classes[c].next);
+    memset( & classes[c], 0, sizeof(classes[c]));
+  }
+}
@@ -0,0 +1,181 @@
+/*
+Author: Visweshwaran Baskaran
+File name: conn_registry.c
+File description:
+Connection registry for thread per connection mode. Slots live in one calloc()ed slab, so a connection costs
+no allocation and the kernel only backs the pages of slots that were ever used. Free slots form a LIFO list
+threaded through their index, which keeps reuse on the same warm slots. Only the main thread acquires and
+releases slots; a connection thread that is done pushes its slot onto a lock-free finished stack, which the
+main thread takes whole with one exchange and joins, so reaping costs O(finished) instead of a scan of every
+connection. Every release bumps the slot's generation, so a stale id never resolves to a reused slot.
+A thread handing its connection to a new process detaches the socket from its slot first, under the one
+registry lock that conn_registry_close_all() also takes, so the shutdown never reaches a handed over socket.
+References:
+[1] Linux manual pages https://man7.org/linux/man-pages/man3/pthread_join.3.html
+[2] C11 atomics https://en.cppreference.com/w/c/atomic
+ */
+
+#include "includes/aesdsocket.h"
+#include "includes/conn_registry.h"
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <signal.h>
+
+#define REGISTRY_NONE UINT32_MAX // end of the free list and of the finished stack
+
+static struct conn_slot * slots = NULL;
+static uint32_t capacity = 0;
+static uint32_t free_head = REGISTRY_NONE;
+static uint32_t high_water = 0; // slots below this index have been used at least once
+static _Atomic uint32_t finished_head = REGISTRY_NONE;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER; // guards client_sockfd of live slots and closing
+static bool closing = false; // conn_registry_close_all() has shut the connections down
+
+static uint32_t id_index(conn_id_t id) {
+  return (uint32_t)(id & (REGISTRY_MAX_SLOTS - 1));
+}
+
+int conn_registry_init(size_t slot_count) {
+  if (slot_count == 0 || slot_count > REGISTRY_MAX_SLOTS) {
+    syslog(LOG_ERR, "Invalid connection registry size %zu, expected 1 to %u", slot_count, REGISTRY_MAX_SLOTS);
+    return -1;
+  }
+  slots = (struct conn_slot * ) calloc(slot_count, sizeof(struct conn_slot));
+  if (slots == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    perror("malloc");
+    return -1;
+  }
+  capacity = slot_count;
+  free_head = REGISTRY_NONE;
+  high_water = 0;
+  closing = false;
+  atomic_store( & finished_head, REGISTRY_NONE);
+  return 0;
+}
+
+struct conn_slot * conn_registry_acquire(int client_sockfd, struct sockaddr_storage client_addr) {
+  uint32_t index;
+  if (free_head != REGISTRY_NONE) {
+    index = free_head;
+    free_head = slots[index].next;
+  } else if (high_water < capacity) {
+    // Never used: generation 0, untouched zero page until now
+    index = high_water++;
+    slots[index].id = index;
+  } else {
+    return NULL;
+  }
+  struct conn_slot * slot = & slots[index];
+  slot -> client_sockfd = client_sockfd;
+  slot -> client_addr = client_addr;
+  slot -> adopted = NULL;
+  slot -> next = REGISTRY_NONE;
+  slot -> in_use = true;
+  return slot;
+}
+
+struct conn_slot * conn_registry_lookup(conn_id_t id) {
+  uint32_t index = id_index(id);
+  if (index >= high_water || !slots[index].in_use || slots[index].id != id) {
+    return NULL;
+  }
+  return & slots[index];
+}
+
+void conn_registry_release(struct conn_slot * slot) {
+  uint32_t index = id_index(slot -> id);
+  slot -> in_use = false;
+  slot -> id += REGISTRY_MAX_SLOTS; // next generation, same index
+  slot -> next = free_head;
+  free_head = index;
+}
+
+void conn_registry_finished(struct conn_slot * slot) {
+  uint32_t index = id_index(slot -> id);
+  uint32_t head = atomic_load_explicit( & finished_head, memory_order_relaxed);
+  do {
+    slot -> next = head;
+  } while (!atomic_compare_exchange_weak_explicit( & finished_head, & head, index, memory_order_release,
+      memory_order_relaxed));
+}
+
+void conn_registry_reap(void) {
+  // Only the main thread pops, and it takes the whole stack, so there is no ABA problem
+  uint32_t index = atomic_exchange_explicit( & finished_head, REGISTRY_NONE, memory_order_acquire);
+  while (index != REGISTRY_NONE) {
+    struct conn_slot * slot = & slots[index];
+    index = slot -> next;
+    if (!slot -> in_use) {
+      continue; // already joined by conn_registry_close_all()
+    }
+    pthread_join(slot -> thread, NULL);
+    conn_registry_release(slot);
+  }
+}
+
+bool conn_registry_detach(struct conn_slot * slot) {
+  pthread_mutex_lock( & registry_lock);
+  bool detached = !closing;
+  if (detached) {
+    slot -> client_sockfd = -1;
+  }
+  pthread_mutex_unlock( & registry_lock);
+  return detached;
+}
+
+bool conn_registry_attach(struct conn_slot * slot, int client_sockfd) {
+  pthread_mutex_lock( & registry_lock);
+  bool attached = !closing;
+  if (attached) {
+    slot -> client_sockfd = client_sockfd;
+  }
+  pthread_mutex_unlock( & registry_lock);
+  return attached;
+}
+
+size_t conn_registry_signal_all(int sig) {
+  size_t live = 0;
+  for (uint32_t index = 0; index < high_water; index++) {
+    if (slots[index].in_use) {
+      pthread_kill(slots[index].thread, sig);
+      live++;
+    }
+  }
+  return live;
+}
+
+void conn_registry_close_all(void) {
+  conn_registry_reap(); // their sockets are closed already and the numbers may have been reused
+  // Wake every thread first so they wind down in parallel. Each closes its own socket; shutdown() only
+  // makes its recv() return. A detached socket belongs to the new process, or is about to
+  pthread_mutex_lock( & registry_lock);
+  closing = true;
+  for (uint32_t index = 0; index < high_water; index++) {
+    if (slots[index].in_use && slots[index].client_sockfd != -1) {
+      shutdown(slots[index].client_sockfd, SHUT_RDWR);
+    }
+  }
+  pthread_mutex_unlock( & registry_lock);
+  for (uint32_t index = 0; index < high_water; index++) {
+    struct conn_slot * slot = & slots[index];
+    if (slot -> in_use) {
+      pthread_join(slot -> thread, NULL);
+      conn_registry_release(slot);
+    }
+  }
+  atomic_store( & finished_head, REGISTRY_NONE);
+}
+
+void conn_registry_free(void) {
+  free(slots);
+  slots = NULL;
+  capacity = 0;
+  high_water = 0;
+  free_head = REGISTRY_NONE;
+}
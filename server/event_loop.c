@@ -0,0 +1,561 @@
+/*
+Author: Visweshwaran Baskaran
+File name: event_loop.c
+File description:
+Edge-triggered epoll connection model for aesdsocket. Instead of one blocking thread per client, every
+accepted socket is made non-blocking and registered with one of a small fixed set of event loop threads.
+Each loop drains its ready sockets until EAGAIN and hands every newline terminated packet to handle_packet(),
+so the newline / AESDCHAR_IOCSEEKTO: protocol is identical to the thread per connection model. Replays are
+appended to the connection's outbound queue and flushed as the socket accepts them; the loop never blocks
+on a slow reader. In durable mode it does not block on the group commit either: a connection whose reply
+waits for it is parked, and the storage syncer's eventfd wakes the loop to send the reply. Connections of a
+process started by a hot restart are parked the same way until the log is open, and while the old process
+drains its loops hand every idle connection over to the new one.
+When accept sharding is enabled every loop also owns one SO_REUSEPORT listening socket registered in its
+epoll set, accepts from it directly and keeps the accepted connections, so no acceptor thread is shared.
+References:
+[1] Linux manual pages https://man7.org/linux/man-pages/man7/epoll.7.html
+[2] queue.h leveraged from: https://raw.githubusercontent.com/freebsd/freebsd/stable/10/sys/sys/queue.h
+ */
+
+#define _GNU_SOURCE // accept4()
+#include "includes/queue.h"
+#include "includes/aesdsocket.h"
+#include "includes/event_loop.h"
+#include "includes/listener.h"
+#include "includes/line_framer.h"
+#include "includes/stats.h"
+#include "includes/outq.h"
+#include "includes/storage.h"
+#include "includes/backend.h"
+#include "includes/hot_restart.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MAX_EVENTS 64 // events returned by one epoll_wait call
+#define EPOLL_TIMEOUT_MS 500 // upper bound on how long a loop takes to notice signal_received
+
+struct epoll_conn {
+  int client_sockfd;
+  struct sockaddr_storage client_addr;
+  struct line_framer framer;
+  struct outq out; // replays not yet accepted by the socket
+  struct client_session session;
+  bool peer_closed; // the client shut down its side; close once out is drained
+  bool parked; // the reply to the last request waits for the group commit (session.durable_wait), or the log is not open yet
+  uint64_t park_ns;
+  LIST_ENTRY(epoll_conn) entries;
+  TAILQ_ENTRY(epoll_conn) park_entries;
+};
+
+struct event_loop {
+  pthread_t thread;
+  int epfd;
+  int listen_sockfd; // shard listening socket owned by this loop, -1 when the main thread accepts
+  atomic_ullong accepts; // connections accepted from listen_sockfd
+  pthread_mutex_t lock; // protects conns, which is modified by the acceptor and the loop thread
+  LIST_HEAD(connlist, epoll_conn) conns;
+  TAILQ_HEAD(parklist, epoll_conn) parked; // loop thread only
+  int park_efd; // written by the storage syncer after every group commit, when the log opens and when a drain begins
+  bool sync_listening; // park_efd is registered with the storage syncer
+};
+
+static struct event_loop * loops = NULL;
+static int num_loops = 0;
+static unsigned int next_loop = 0;
+static atomic_bool loops_running = false; // written by the main thread, polled by every loop thread
+
+/**
+ * @brief Set O_NONBLOCK on a file descriptor.
+ * @return 0 on success, -1 on failure
+ */
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    syslog(LOG_ERR, "fcntl failed: %s", strerror(errno));
+    perror("fcntl");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Register an accepted client socket with loop.
+ * @param adopted Session state and partial record of a connection taken over by a hot restart, or NULL.
+ * @return 0 on success, -1 on failure (the socket is closed)
+ */
+static int add_conn(struct event_loop * loop, int client_sockfd, struct sockaddr_storage client_addr,
+  const struct handoff_client * adopted) {
+  struct epoll_conn * conn = (struct epoll_conn * ) malloc(sizeof(struct epoll_conn));
+  if (conn == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    perror("malloc failed");
+    close(client_sockfd);
+    return -1;
+  }
+  // With the socket profile's accept4 the socket was accepted non-blocking already
+  if (!config.sockets.accept4 && set_nonblocking(client_sockfd) != 0) {
+    free(conn);
+    close(client_sockfd);
+    return -1;
+  }
+  // Queued replays leave in whatever pieces the socket accepts; with Nagle a sub-MSS tail would wait for the
+  // peer's delayed ACK
+  int yes = 1;
+  setsockopt(client_sockfd, IPPROTO_TCP, TCP_NODELAY, & yes, sizeof(yes));
+  conn -> client_sockfd = client_sockfd;
+  conn -> client_addr = client_addr;
+  conn -> peer_closed = false;
+  conn -> parked = false;
+  line_framer_init( & conn -> framer);
+  outq_init( & conn -> out);
+  conn -> session = (struct client_session) CLIENT_SESSION_INIT( & conn -> out);
+  log_accepted_connection(client_addr);
+  if (adopted != NULL) {
+    conn -> session.tail_mode = adopted -> tail_mode;
+    conn -> session.delivered = adopted -> delivered;
+    conn -> session.framed = adopted -> framed;
+    size_t avail;
+    char * recv_space = line_framer_recv_space( & conn -> framer, & avail);
+    if (recv_space == NULL || avail < adopted -> pending_len) {
+      syslog(LOG_ERR, "Receive buffer unavailable for a %zu byte partial record, closing connection", adopted -> pending_len);
+      log_closed_connection(client_addr);
+      close(client_sockfd);
+      line_framer_free( & conn -> framer);
+      free(conn);
+      return -1;
+    }
+    memcpy(recv_space, adopted -> pending, adopted -> pending_len);
+    line_framer_commit( & conn -> framer, adopted -> pending_len);
+  }
+
+  pthread_mutex_lock( & loop -> lock);
+  LIST_INSERT_HEAD( & loop -> conns, conn, entries);
+  pthread_mutex_unlock( & loop -> lock);
+
+  struct epoll_event ev;
+  // Both directions stay armed: edge-triggered EPOLLOUT only fires when a full socket drains
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = conn;
+  if (epoll_ctl(loop -> epfd, EPOLL_CTL_ADD, client_sockfd, & ev) == SYSCALL_ERROR) {
+    syslog(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+    perror("epoll_ctl");
+    pthread_mutex_lock( & loop -> lock);
+    LIST_REMOVE(conn, entries);
+    pthread_mutex_unlock( & loop -> lock);
+    close(client_sockfd);
+    release_session( & conn -> session);
+    line_framer_free( & conn -> framer);
+    outq_free( & conn -> out);
+    free(conn);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Accept every pending connection on the loop's shard listening socket.
+ */
+static void accept_shard_clients(struct event_loop * loop) {
+  while (1) {
+    struct sockaddr_storage client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    int client_sockfd = accept4(loop -> listen_sockfd, (struct sockaddr * ) & client_addr, & addr_len,
+      SOCK_CLOEXEC | (config.sockets.accept4 ? SOCK_NONBLOCK : 0));
+    if (client_sockfd == SYSCALL_ERROR) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept");
+        syslog(LOG_ERR, "accept failed: %s", strerror(errno));
+      }
+      return;
+    }
+    atomic_fetch_add_explicit( & loop -> accepts, 1, memory_order_relaxed);
+    add_conn(loop, client_sockfd, client_addr, NULL);
+  }
+}
+
+/**
+ * @brief Unregister, close and free a connection owned by loop, closing only this process's descriptor.
+ */
+static void drop_conn(struct event_loop * loop, struct epoll_conn * conn) {
+  epoll_ctl(loop -> epfd, EPOLL_CTL_DEL, conn -> client_sockfd, NULL);
+  if (conn -> parked) {
+    TAILQ_REMOVE( & loop -> parked, conn, park_entries);
+  }
+  pthread_mutex_lock( & loop -> lock);
+  LIST_REMOVE(conn, entries);
+  pthread_mutex_unlock( & loop -> lock);
+  close(conn -> client_sockfd);
+  release_session( & conn -> session);
+  line_framer_free( & conn -> framer);
+  outq_free( & conn -> out);
+  free(conn);
+}
+
+static void close_conn(struct event_loop * loop, struct epoll_conn * conn) {
+  log_closed_connection(conn -> client_addr);
+  drop_conn(loop, conn);
+}
+
+/**
+ * @brief Park conn until release_parked() resumes it: after a group commit, or once the log is open.
+ */
+static void park_conn(struct event_loop * loop, struct epoll_conn * conn) {
+  conn -> parked = true;
+  conn -> park_ns = stats_now_ns();
+  TAILQ_INSERT_TAIL( & loop -> parked, conn, park_entries);
+}
+
+/**
+ * @brief Flush queued responses, then read and process requests until the socket has nothing more to give.
+ *
+ * A connection whose queue is above the high-water mark is not read from: its requests wait in the kernel
+ * until it has caught up, so only that client is slowed down. Requests (a record, or a run of frames) are
+ * handled one at a time with a flush in between, which keeps at most one replay beyond the high-water mark queued per connection.
+ *
+ * A request whose reply waits for the group commit parks the connection: nothing more is read from it until
+ * release_parked() has sent that reply. So does any connection while the log is not open yet.
+ *
+ * @return true if the connection stays open, false if it should be closed
+ */
+static bool service_conn(struct event_loop * loop, struct epoll_conn * conn) {
+  size_t avail;
+  while (1) {
+    bool corked = outq_bytes( & conn -> out) > 0;
+    if (corked) {
+      listener_cork(conn -> client_sockfd, true);
+    }
+    int flushed = outq_flush( & conn -> out, conn -> client_sockfd);
+    if (corked) {
+      listener_cork(conn -> client_sockfd, false);
+    }
+    if (flushed < 0) {
+      return false;
+    }
+    if (conn -> parked || outq_bytes( & conn -> out) >= config.outq_high_water) {
+      return true; // group commit pending, or backpressure: resume on the park eventfd or EPOLLOUT
+    }
+    if (!log_ready()) {
+      park_conn(loop, conn); // a hot restart predecessor still has the log
+      return true;
+    }
+    int handled = handle_next_request(conn -> client_sockfd, & conn -> session, & conn -> framer);
+    if (handled < 0) {
+      return false;
+    }
+    if (conn -> session.durable_wait != 0) {
+      park_conn(loop, conn);
+      return true;
+    }
+    if (handled > 0) {
+      continue;
+    }
+    if (conn -> peer_closed) {
+      return flushed == 1; // close once the last replay has been sent
+    }
+    char * recv_space = line_framer_recv_space( & conn -> framer, & avail);
+    if (recv_space == NULL) {
+      syslog(LOG_ERR, "Receive buffer unavailable or record exceeds %d bytes, closing connection", FRAMER_MAX_RECORD);
+      return false;
+    }
+    ssize_t bytes_recvd = recv(conn -> client_sockfd, recv_space, avail, 0);
+    if (bytes_recvd == 0) {
+      conn -> peer_closed = true;
+      continue;
+    }
+    if (bytes_recvd == SYSCALL_ERROR) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      perror("recv");
+      syslog(LOG_ERR, "recv failed: %s", strerror(errno));
+      return false;
+    }
+    stats_add(STAT_BYTES_IN, bytes_recvd);
+    line_framer_commit( & conn -> framer, bytes_recvd);
+  }
+}
+
+/**
+ * @brief After a group commit or once the log is open: send the replies of the parked connections that were
+ * waiting for it and resume them.
+ */
+static void release_parked(struct event_loop * loop) {
+  uint64_t count;
+  if (read(loop -> park_efd, & count, sizeof(count)) == SYSCALL_ERROR && errno != EAGAIN) {
+    syslog(LOG_ERR, "eventfd read failed: %s", strerror(errno));
+  }
+  struct epoll_conn * conn = TAILQ_FIRST( & loop -> parked);
+  while (conn != NULL) {
+    // A resumed connection may park again at the tail; it is then skipped until the next commit
+    struct epoll_conn * next = TAILQ_NEXT(conn, park_entries);
+    bool durable_wait = conn -> session.durable_wait != 0;
+    if (durable_wait ? config.backend -> durable(conn -> session.durable_wait) : log_ready()) {
+      TAILQ_REMOVE( & loop -> parked, conn, park_entries);
+      conn -> parked = false;
+      if (durable_wait) {
+        stats_record_latency(HIST_DURABLE_WAIT, stats_now_ns() - conn -> park_ns);
+      }
+      if ((durable_wait && !finish_request(conn -> client_sockfd, & conn -> session)) || !service_conn(loop, conn)) {
+        close_conn(loop, conn);
+      }
+    }
+    conn = next;
+  }
+}
+
+/**
+ * @brief While a hot restart drains this process, send every idle connection of loop to the new process: no
+ * reply queued or owed and at most a partial record buffered. Busy ones are retried after their next event.
+ */
+static void hand_over_idle(struct event_loop * loop) {
+  // The main thread stopped accepting when the drain began, so only this thread changes conns now
+  struct epoll_conn * conn = LIST_FIRST( & loop -> conns);
+  while (conn != NULL) {
+    struct epoll_conn * next = LIST_NEXT(conn, entries);
+    if (!conn -> parked && !conn -> peer_closed && outq_bytes( & conn -> out) == 0 &&
+      hot_restart_send_client(conn -> client_sockfd, conn -> client_addr, & conn -> session,
+        conn -> framer.buf + conn -> framer.start, line_framer_pending( & conn -> framer)) == 0) {
+      // The new process holds the socket now: close only this descriptor, never shutdown() the connection
+      stats_add(STAT_CONNECTIONS_CLOSED, 1);
+      syslog(LOG_INFO, "Handed connection over to the new process");
+      drop_conn(loop, conn);
+    }
+    conn = next;
+  }
+}
+
+/**
+ * @brief Event loop thread: wait for readiness on the loop's epoll instance and service ready connections.
+ * @param loop_param A pointer to the struct event_loop owned by this thread.
+ * @return NULL
+ */
+static void * event_loop_thread(void * loop_param) {
+  struct event_loop * loop = (struct event_loop * ) loop_param;
+  struct epoll_event events[MAX_EVENTS];
+
+  while (!signal_received && loops_running) {
+    int nready = epoll_wait(loop -> epfd, events, MAX_EVENTS, EPOLL_TIMEOUT_MS);
+    if (nready == SYSCALL_ERROR) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+      break;
+    }
+    for (int i = 0; i < nready; i++) {
+      struct epoll_conn * conn = (struct epoll_conn * ) events[i].data.ptr;
+      if (conn == NULL) {
+        accept_shard_clients(loop);
+        continue;
+      }
+      if (events[i].data.ptr == & loop -> park_efd) {
+        release_parked(loop);
+        continue;
+      }
+      if (!service_conn(loop, conn)) {
+        close_conn(loop, conn);
+      }
+    }
+    if (hot_restart_draining()) {
+      hand_over_idle(loop);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Register the loop's park eventfd with the storage syncer, in durable mode and once the log is open.
+ * @return 0 on success, -1 on failure
+ */
+static int add_sync_listener(struct event_loop * loop) {
+  if (loop -> sync_listening || !log_ready() || !storage_is_durable()) {
+    return 0;
+  }
+  if (storage_add_sync_listener(loop -> park_efd) != 0) {
+    syslog(LOG_ERR, "Too many storage sync listeners");
+    return -1;
+  }
+  loop -> sync_listening = true;
+  return 0;
+}
+
+/**
+ * @brief Create the loop's park eventfd and add it to its epoll set; a pointer to park_efd marks its events.
+ * @return 0 on success, -1 on failure
+ */
+static int add_park_efd(struct event_loop * loop) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = & loop -> park_efd;
+  loop -> sync_listening = false;
+  loop -> park_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (loop -> park_efd == SYSCALL_ERROR || epoll_ctl(loop -> epfd, EPOLL_CTL_ADD, loop -> park_efd, & ev) == SYSCALL_ERROR ||
+    add_sync_listener(loop) != 0) {
+    syslog(LOG_ERR, "park eventfd setup failed: %s", strerror(errno));
+    if (loop -> park_efd != SYSCALL_ERROR) {
+      close(loop -> park_efd);
+    }
+    loop -> park_efd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void close_park_efd(struct event_loop * loop) {
+  if (loop -> sync_listening) {
+    storage_remove_sync_listener(loop -> park_efd);
+    loop -> sync_listening = false;
+  }
+  if (loop -> park_efd != -1) {
+    close(loop -> park_efd);
+    loop -> park_efd = -1;
+  }
+}
+
+/**
+ * @brief Wake every loop through its park eventfd.
+ */
+static void wake_loops(void) {
+  uint64_t one = 1;
+  for (int i = 0; i < num_loops; i++) {
+    if (write(loops[i].park_efd, & one, sizeof(one)) == SYSCALL_ERROR && errno != EAGAIN) {
+      syslog(LOG_ERR, "eventfd write failed: %s", strerror(errno));
+    }
+  }
+}
+
+/**
+ * @brief Register the loop's shard listening socket; the NULL event pointer marks it as the listener.
+ * @return 0 on success, -1 on failure
+ */
+static int add_listener(struct event_loop * loop) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (set_nonblocking(loop -> listen_sockfd) != 0) {
+    return -1;
+  }
+  if (epoll_ctl(loop -> epfd, EPOLL_CTL_ADD, loop -> listen_sockfd, & ev) == SYSCALL_ERROR) {
+    syslog(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+    perror("epoll_ctl");
+    return -1;
+  }
+  return 0;
+}
+
+int event_loop_start(int requested_loops, const int * shard_fds) {
+  num_loops = requested_loops > 0 ? requested_loops : 1;
+  loops = (struct event_loop * ) calloc(num_loops, sizeof(struct event_loop));
+  if (loops == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    perror("calloc");
+    return -1;
+  }
+  loops_running = true;
+  for (int i = 0; i < num_loops; i++) {
+    loops[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loops[i].epfd == SYSCALL_ERROR) {
+      syslog(LOG_ERR, "epoll_create1 failed: %s", strerror(errno));
+      perror("epoll_create1");
+      num_loops = i;
+      event_loop_stop();
+      return -1;
+    }
+    pthread_mutex_init( & loops[i].lock, NULL);
+    LIST_INIT( & loops[i].conns);
+    TAILQ_INIT( & loops[i].parked);
+    loops[i].listen_sockfd = shard_fds != NULL ? shard_fds[i] : -1;
+    if ((loops[i].listen_sockfd != -1 && add_listener( & loops[i]) != 0) || add_park_efd( & loops[i]) != 0) {
+      close(loops[i].epfd);
+      pthread_mutex_destroy( & loops[i].lock);
+      num_loops = i;
+      event_loop_stop();
+      return -1;
+    }
+    if (pthread_create( & loops[i].thread, NULL, event_loop_thread, & loops[i]) != 0) {
+      perror("pthread_create");
+      close_park_efd( & loops[i]);
+      close(loops[i].epfd);
+      pthread_mutex_destroy( & loops[i].lock);
+      num_loops = i;
+      event_loop_stop();
+      return -1;
+    }
+  }
+  syslog(LOG_INFO, "Started %d epoll event loops%s", num_loops, shard_fds != NULL ? " with accept shards" : "");
+  return 0;
+}
+
+int event_loop_add_client(int client_sockfd, struct sockaddr_storage client_addr) {
+  return add_conn( & loops[next_loop++ % num_loops], client_sockfd, client_addr, NULL);
+}
+
+int event_loop_adopt_client(struct handoff_client * client) {
+  int retval = add_conn( & loops[next_loop++ % num_loops], client -> client_sockfd, client -> client_addr, client);
+  free(client);
+  return retval;
+}
+
+int event_loop_log_opened(void) {
+  int retval = 0;
+  for (int i = 0; i < num_loops; i++) {
+    if (add_sync_listener( & loops[i]) != 0) {
+      retval = -1;
+    }
+  }
+  wake_loops();
+  return retval;
+}
+
+void event_loop_begin_drain(void) {
+  wake_loops();
+}
+
+void event_loop_stop(void) {
+  if (loops == NULL) {
+    return;
+  }
+  loops_running = false;
+  wake_loops(); // after a hot restart the new process waits for this one to close the log
+  for (int i = 0; i < num_loops; i++) {
+    pthread_join(loops[i].thread, NULL);
+    struct epoll_conn * conn;
+    while ((conn = LIST_FIRST( & loops[i].conns)) != NULL) {
+      LIST_REMOVE(conn, entries);
+      close(conn -> client_sockfd);
+      release_session( & conn -> session);
+      line_framer_free( & conn -> framer);
+      outq_free( & conn -> out);
+      free(conn);
+    }
+    close_park_efd( & loops[i]);
+    close(loops[i].epfd);
+    pthread_mutex_destroy( & loops[i].lock);
+    if (loops[i].listen_sockfd != -1) {
+      syslog(LOG_INFO, "Accept shard %d: %llu connections", i, (unsigned long long) atomic_load( & loops[i].accepts));
+      close(loops[i].listen_sockfd);
+    }
+  }
+  free(loops);
+  loops = NULL;
+  num_loops = 0;
+}
@@ -0,0 +1,66 @@
+/*
+Author: Visweshwaran Baskaran
+File name: frame.c
+File description:
+Varint length-prefixed frames of the binary protocol: encoding and decoding. Free of sockets and queues so
+the unit tests link it on its own; frame_send.c sends the frames.
+References:
+[1] https://protobuf.dev/programming-guides/encoding/#varints
+ */
+
+#include "includes/frame.h"
+#include "includes/line_framer.h"
+
+size_t frame_put_varint(uint8_t * out, uint64_t value) {
+  size_t len = 0;
+  while (value >= 0x80) {
+    out[len++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[len++] = (uint8_t) value;
+  return len;
+}
+
+int frame_get_varint(const uint8_t * buf, size_t len, uint64_t * value) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < FRAME_VARINT_MAX; i++) {
+    if (i == len) {
+      return 0;
+    }
+    if (i == FRAME_VARINT_MAX - 1 && buf[i] > 1) {
+      return -1; // bits past the 64th
+    }
+    result |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+    if ((buf[i] & 0x80) == 0) {
+      * value = result;
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+int frame_decode(const char * buf, size_t avail, uint8_t * type, const char ** payload, size_t * len, size_t * consumed) {
+  uint64_t payload_len;
+  int varint_len = frame_get_varint((const uint8_t * ) buf, avail, & payload_len);
+  if (varint_len <= 0) {
+    return varint_len;
+  }
+  if (payload_len > FRAMER_MAX_RECORD - FRAME_HEADER_MAX) {
+    return -1; // the framer would never buffer it whole
+  }
+  size_t header_len = varint_len + 1;
+  if (avail < header_len || avail - header_len < payload_len) {
+    return 0;
+  }
+  * type = (uint8_t) buf[varint_len];
+  * payload = buf + header_len;
+  * len = payload_len;
+  * consumed = header_len + payload_len;
+  return 1;
+}
+
+size_t frame_encode_header(uint8_t * header, uint8_t type, uint64_t len) {
+  size_t header_len = frame_put_varint(header, len);
+  header[header_len++] = type;
+  return header_len;
+}
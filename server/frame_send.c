@@ -0,0 +1,58 @@
+/*
+Author: Visweshwaran Baskaran
+File name: frame_send.c
+File description:
+Sending frames of the binary protocol (frame.h), or queueing them on a non-blocking connection's outq. A
+frame header and its payload leave in one gathering sendmsg(), so a small reply is never split into two
+segments.
+ */
+
+#include "includes/aesdsocket.h"
+#include "includes/frame.h"
+#include "includes/outq.h"
+#include "includes/stats.h"
+#include <syslog.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+int frame_send_header(int client_sockfd, struct client_session * session, uint8_t type, uint64_t len) {
+  uint8_t header[FRAME_HEADER_MAX];
+  size_t header_len = frame_encode_header(header, type, len);
+  if (session -> out != NULL) {
+    return outq_push_copy(session -> out, (const char * ) header, header_len);
+  }
+  return send_all(client_sockfd, (const char * ) header, header_len);
+}
+
+int frame_send(int client_sockfd, struct client_session * session, uint8_t type, const char * payload, size_t len) {
+  uint8_t header[FRAME_HEADER_MAX];
+  size_t header_len = frame_encode_header(header, type, len);
+  if (session -> out != NULL) {
+    return (outq_push_copy(session -> out, (const char * ) header, header_len) == 0 &&
+      (len == 0 || outq_push_copy(session -> out, payload, len) == 0)) ? 0 : -1;
+  }
+  struct iovec iov[2] = {
+    { .iov_base = header, .iov_len = header_len },
+    { .iov_base = (void * ) payload, .iov_len = len },
+  };
+  struct msghdr msg = { .msg_iov = iov, .msg_iovlen = len > 0 ? 2 : 1 };
+  ssize_t bytes_sent;
+  while ((bytes_sent = sendmsg(client_sockfd, & msg, MSG_NOSIGNAL)) == SYSCALL_ERROR && errno == EINTR) {
+  }
+  if (bytes_sent == SYSCALL_ERROR) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      syslog(LOG_ERR, "sendmsg failed: %s", strerror(errno));
+      return -1;
+    }
+    bytes_sent = 0;
+  }
+  stats_add(STAT_BYTES_OUT, bytes_sent);
+  // Short send: the rest goes out with send_all(), which also waits on a full non-blocking socket
+  if ((size_t) bytes_sent < header_len &&
+    send_all(client_sockfd, (const char * ) header + bytes_sent, header_len - bytes_sent) != 0) {
+    return -1;
+  }
+  size_t payload_sent = (size_t) bytes_sent > header_len ? bytes_sent - header_len : 0;
+  return send_all(client_sockfd, payload + payload_sent, len - payload_sent) == 0 ? 0 : -1;
+}
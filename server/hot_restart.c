@@ -0,0 +1,261 @@
+/*
+Author: Visweshwaran Baskaran
+File name: hot_restart.c
+File description:
+Hot restart hand-off for aesdsocket ('-U path'). The running process listens on a SOCK_SEQPACKET Unix socket
+at path. A new process started with the same option connects to it first and sends a takeover request; the
+old process answers with its listening socket as SCM_RIGHTS ancillary data and stops accepting; the new
+process accepts from it at once.
+If the new process asked for them, the old process then sends its client sockets the same way, between
+records, together with their tail mode state and any partial record already received: blocking connection
+threads when interrupted, event loops once a connection is idle. Once its remaining connections are gone and
+the log is closed the old process sends a final message. Only then does the new process open the log and
+serve requests, so the two never append at the same time; until then its connections only wait.
+Every message is one seqpacket record, so concurrent senders never interleave.
+References:
+[1] Linux manual pages https://man7.org/linux/man-pages/man7/unix.7.html (SCM_RIGHTS, SOCK_SEQPACKET)
+[2] Linux manual pages https://man7.org/linux/man-pages/man3/cmsg.3.html
+ */
+
+#define _GNU_SOURCE // accept4()
+#include "includes/aesdsocket.h"
+#include "includes/hot_restart.h"
+#include <syslog.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+
+enum handoff_type {
+  HANDOFF_REQUEST, // new -> old: takeover request
+  HANDOFF_LISTENER, // old -> new: the listening socket
+  HANDOFF_CLIENT, // old -> new: one client connection
+  HANDOFF_DONE // old -> new: the log is closed
+};
+
+struct handoff_header {
+  uint32_t type;
+  uint32_t pending_len;
+  int64_t delivered;
+  uint8_t tail_mode;
+  uint8_t framed;
+  uint8_t accept_clients;
+  struct sockaddr_storage client_addr;
+};
+
+static int drain_channel = -1;
+static atomic_bool draining = false;
+
+/**
+ * @brief Send a header, optional payload and optional descriptor as one message.
+ */
+static int send_message(int channel_fd, const struct handoff_header * header, const char * payload, size_t len, int fd) {
+  struct iovec iov[2] = {
+    { .iov_base = (void * ) header, .iov_len = sizeof( * header) },
+    { .iov_base = (void * ) payload, .iov_len = len },
+  };
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg = { .msg_iov = iov, .msg_iovlen = len > 0 ? 2 : 1 };
+  if (fd != -1) {
+    memset( & control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR( & msg);
+    cmsg -> cmsg_level = SOL_SOCKET;
+    cmsg -> cmsg_type = SCM_RIGHTS;
+    cmsg -> cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), & fd, sizeof(int));
+  }
+  while (sendmsg(channel_fd, & msg, MSG_NOSIGNAL) == SYSCALL_ERROR) {
+    if (errno != EINTR) {
+      syslog(LOG_ERR, "Hot restart sendmsg failed: %s", strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Receive one message into header and payload (up to cap bytes).
+ * @param fd Set to the descriptor it carried, or -1.
+ * @return Payload length, or -1 on failure or end of file
+ */
+static ssize_t receive_message(int channel_fd, struct handoff_header * header, char * payload, size_t cap, int * fd) {
+  struct iovec iov[2] = {
+    { .iov_base = header, .iov_len = sizeof( * header) },
+    { .iov_base = payload, .iov_len = cap },
+  };
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+  ssize_t len;
+  * fd = -1;
+  while ((len = recvmsg(channel_fd, & msg, MSG_CMSG_CLOEXEC)) == SYSCALL_ERROR && errno == EINTR) {
+  }
+  if (len == SYSCALL_ERROR) {
+    syslog(LOG_ERR, "Hot restart recvmsg failed: %s", strerror(errno));
+    return -1;
+  }
+  for (struct cmsghdr * cmsg = CMSG_FIRSTHDR( & msg); cmsg != NULL; cmsg = CMSG_NXTHDR( & msg, cmsg)) {
+    if (cmsg -> cmsg_level == SOL_SOCKET && cmsg -> cmsg_type == SCM_RIGHTS) {
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  if ((size_t) len < sizeof( * header) || (msg.msg_flags & MSG_TRUNC)) {
+    if (* fd != -1) {
+      close( * fd);
+    }
+    return -1;
+  }
+  return len - sizeof( * header);
+}
+
+static int unix_socket(const char * path, struct sockaddr_un * addr) {
+  memset(addr, 0, sizeof( * addr));
+  addr -> sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr -> sun_path)) {
+    syslog(LOG_ERR, "Hot restart socket path too long: %s", path);
+    return -1;
+  }
+  strcpy(addr -> sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == SYSCALL_ERROR) {
+    perror("socket");
+    syslog(LOG_ERR, "socket failed: %s", strerror(errno));
+  }
+  return fd;
+}
+
+int hot_restart_takeover(const char * path, bool accept_clients, int * listen_sockfd) {
+  struct sockaddr_un addr;
+  int channel_fd = unix_socket(path, & addr);
+  if (channel_fd == SYSCALL_ERROR) {
+    return -1;
+  }
+  if (connect(channel_fd, (struct sockaddr * ) & addr, sizeof(addr)) == SYSCALL_ERROR) {
+    // No predecessor: a first start, or a stale socket file
+    close(channel_fd);
+    return -1;
+  }
+  struct handoff_header header = { .type = HANDOFF_REQUEST, .accept_clients = accept_clients };
+  int fd;
+  if (send_message(channel_fd, & header, NULL, 0, -1) != 0 ||
+    receive_message(channel_fd, & header, NULL, 0, & fd) != 0 || header.type != HANDOFF_LISTENER || fd == -1) {
+    syslog(LOG_ERR, "Hot restart: no listener received from %s", path);
+    close(channel_fd);
+    return -1;
+  }
+  * listen_sockfd = fd;
+  syslog(LOG_INFO, "Hot restart: took over the listening socket from %s", path);
+  return channel_fd;
+}
+
+int hot_restart_receive_client(int channel_fd, struct handoff_client ** received) {
+  struct handoff_header header;
+  struct handoff_client * client = (struct handoff_client * ) malloc(sizeof(struct handoff_client) + HANDOFF_MAX_PENDING);
+  if (client == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    return -1;
+  }
+  ssize_t len = receive_message(channel_fd, & header, client -> pending, HANDOFF_MAX_PENDING, & client -> client_sockfd);
+  if (len < 0 || header.type != HANDOFF_CLIENT || client -> client_sockfd == -1) {
+    if (len >= 0 && client -> client_sockfd != -1) {
+      close(client -> client_sockfd); // a descriptor on any other message is not a client this process serves
+    }
+    free(client);
+    return (len < 0 || header.type == HANDOFF_DONE) ? -1 : 0;
+  }
+  client -> client_addr = header.client_addr;
+  client -> tail_mode = header.tail_mode;
+  client -> framed = header.framed;
+  client -> delivered = header.delivered;
+  client -> pending_len = len;
+  * received = client;
+  return 1;
+}
+
+int hot_restart_listen(const char * path) {
+  struct sockaddr_un addr;
+  int restart_fd = unix_socket(path, & addr);
+  if (restart_fd == SYSCALL_ERROR) {
+    return -1;
+  }
+  unlink(path); // the previous process's socket, which it no longer accepts on
+  if (bind(restart_fd, (struct sockaddr * ) & addr, sizeof(addr)) == SYSCALL_ERROR ||
+    listen(restart_fd, 1) == SYSCALL_ERROR) {
+    perror("bind");
+    syslog(LOG_ERR, "Hot restart socket %s failed: %s", path, strerror(errno));
+    close(restart_fd);
+    return -1;
+  }
+  return restart_fd;
+}
+
+int hot_restart_hand_over(int restart_fd, int listen_sockfd, bool * clients_wanted) {
+  struct handoff_header header;
+  int fd;
+  int channel_fd = accept4(restart_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (channel_fd == SYSCALL_ERROR) {
+    return -1;
+  }
+  // Called from the accept loop: a peer that connects but never sends must not stall it
+  struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+  setsockopt(channel_fd, SOL_SOCKET, SO_RCVTIMEO, & timeout, sizeof(timeout));
+  if (receive_message(channel_fd, & header, NULL, 0, & fd) != 0 || header.type != HANDOFF_REQUEST) {
+    if (fd != -1) {
+      close(fd);
+    }
+    close(channel_fd);
+    return -1;
+  }
+  struct handoff_header reply = { .type = HANDOFF_LISTENER };
+  if (send_message(channel_fd, & reply, NULL, 0, listen_sockfd) != 0) {
+    close(channel_fd);
+    return -1;
+  }
+  * clients_wanted = header.accept_clients;
+  syslog(LOG_INFO, "Hot restart: listening socket handed over%s", header.accept_clients ? ", handing over clients" : "");
+  return channel_fd;
+}
+
+void hot_restart_begin_drain(int channel_fd) {
+  drain_channel = channel_fd;
+  atomic_store( & draining, true);
+}
+
+bool hot_restart_draining(void) {
+  return atomic_load_explicit( & draining, memory_order_relaxed);
+}
+
+int hot_restart_send_client(int client_sockfd, struct sockaddr_storage client_addr, const struct client_session * session,
+  const char * pending, size_t pending_len) {
+  if (drain_channel == -1 || pending_len > HANDOFF_MAX_PENDING) {
+    return -1;
+  }
+  struct handoff_header header = {
+    .type = HANDOFF_CLIENT,
+    .pending_len = pending_len,
+    .delivered = session -> delivered,
+    .tail_mode = session -> tail_mode,
+    .framed = session -> framed,
+    .client_addr = client_addr,
+  };
+  return send_message(drain_channel, & header, pending, pending_len, client_sockfd);
+}
+
+void hot_restart_finish(int channel_fd) {
+  struct handoff_header header = { .type = HANDOFF_DONE };
+  send_message(channel_fd, & header, NULL, 0, -1);
+  close(channel_fd);
+}
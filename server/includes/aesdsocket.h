@@ -0,0 +1,275 @@
+/*
+Author: Visweshwaran Baskaran
+File name: aesdsocket.h
+File description:
+Definitions shared between the aesdsocket connection models: compile time defaults, the runtime
+configuration selected on the command line or in a configuration file and the packet handling helpers
+implemented in aesdsocket.c.
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+struct outq;
+struct line_framer;
+
+/**
+ * Per-connection protocol state kept by every connection model and passed to handle_packet()
+ */
+struct client_session {
+  /**
+   * NULL to send replies before handle_packet() returns (blocking models), or the outbound queue of a
+   * non-blocking connection to append them to
+   */
+  struct outq * out;
+  /**
+   * Set by AESDTAIL: a record is answered with the log bytes appended since the previous reply only
+   */
+  bool tail_mode;
+  /**
+   * Log offset up to which this client has been sent the log
+   */
+  off_t delivered;
+  /**
+   * Set by AESDBINARY: requests and replies are length-prefixed frames (frame.h) instead of text lines
+   */
+  bool framed;
+  /**
+   * The chardev backend's handle on the device for this connection, -1 until its first request
+   */
+  int device_fd;
+  /**
+   * Non-blocking sessions in durable mode: log offset the reply to the last request waits for, 0 when none.
+   * The event loop parks the connection until a group commit covers it, then calls finish_request()
+   */
+  off_t durable_wait;
+  /**
+   * Records the parked acknowledgement covers, framed sessions only
+   */
+  uint64_t ack_records;
+};
+
+#define CLIENT_SESSION_INIT(queue) { .out = (queue), .tail_mode = false, .delivered = 0, .framed = false, .device_fd = -1, \
+  .durable_wait = 0, .ack_records = 0 }
+
+#define PORT "9000" // Default port, see '-p'
+#define BACKLOG 10 // Default of how many pending connections queue will hold, see '-b'
+#define MAX_CONNECTIONS 65536 // connection registry slots, the thread per connection mode's connection limit
+#define MAX_PACKET_SIZE 30000 // Default replay copy buffer, set as a large value instead of 1024 for sockettest.sh test cases, see '-M'
+
+#define USE_AESD_CHAR_DEVICE 1 // default to the char device backend, see '-B'
+
+#define SYSCALL_ERROR - 1
+#define TIMESTAMP_FORMAT "%Y %b %d %H:%M:%S" // RFC 2822 compliant strftime format
+#define TIMESTAMP_PERIOD_S 10 // Interval between the file backend's timestamp records
+
+#define SEEKTO_COMMAND "AESDCHAR_IOCSEEKTO:"
+#define SEEKTO_COMMAND_LEN 19
+#define TAIL_COMMAND "AESDTAIL\n" // switches a connection to incremental replies, never stored
+#define TAIL_COMMAND_LEN 9
+
+/**
+ * Connection models selectable with the '-m' command-line argument
+ */
+enum server_mode {
+  MODE_THREAD, // one thread per accepted connection (default)
+  MODE_EPOLL, // edge-triggered epoll loops multiplexing all connections over a fixed set of threads
+  MODE_POOL, // pre-spawned workers fed by a bounded queue of accepted sockets
+  MODE_URING // io_uring rings batching accept, recv, storage writes and replays (file backend only)
+};
+
+/**
+ * Socket tuning profile selected with '-O'; all zero keeps the kernel defaults
+ */
+struct socket_profile {
+  bool accept4; // accept4() with SOCK_CLOEXEC, plus SOCK_NONBLOCK for sockets handed to an event loop
+  bool nodelay; // TCP_NODELAY on every client socket (the epoll and io_uring models always set it)
+  bool cork; // TCP_CORK around each replay, so it leaves in full segments and is pushed once complete
+  int defer_accept_s; // TCP_DEFER_ACCEPT: accept a connection only once its first data arrived
+  int sndbuf; // SO_SNDBUF and SO_RCVBUF of the listener, inherited by accepted sockets; 0 keeps the default
+  int rcvbuf;
+};
+
+struct backend;
+
+struct server_config {
+  /**
+   * Storage backend, and the file or device it uses (NULL selects the backend's default)
+   */
+  const struct backend * backend;
+  const char * path;
+  const char * port;
+  enum server_mode mode;
+  /**
+   * Number of event loop threads (MODE_EPOLL), workers (MODE_POOL) or rings (MODE_URING), 0 selects the mode's default
+   */
+  int num_threads;
+  /**
+   * Capacity of the accepted socket hand-off queue used in MODE_POOL
+   */
+  int queue_capacity;
+  /**
+   * Memory cap of the file backend's in-memory replay cache, 0 disables it
+   */
+  size_t cache_bytes;
+  /**
+   * Listen backlog of each listening socket
+   */
+  int backlog;
+  /**
+   * Size of the buffer replays are copied through when sendfile() is not available
+   */
+  size_t max_packet_size;
+  /**
+   * Slab reserved for each size class of the buffer pool, 0 to malloc() every buffer
+   */
+  size_t pool_bytes;
+  struct socket_profile sockets;
+  /**
+   * Number of SO_REUSEPORT accept shards, each owned by one event loop or ring; 0 uses a single listener
+   */
+  int shards;
+  /**
+   * Durable mode: replays wait for fdatasync(), grouped over a commit window of sync_window_us
+   * microseconds or sync_window_bytes pending bytes (0 for no byte limit)
+   */
+  bool durable;
+  unsigned long long sync_window_us;
+  size_t sync_window_bytes;
+  /**
+   * Unsent bytes queued for an epoll client above which its requests are no longer read
+   */
+  size_t outq_high_water;
+  /**
+   * Segment file size of the file backend's log, 0 keeps the log in the single file path
+   */
+  size_t segment_bytes;
+  /**
+   * Retention of a segmented log: oldest segments are dropped beyond retain_bytes or once sealed for
+   * retain_seconds, 0 disables a limit
+   */
+  unsigned long long retain_bytes;
+  unsigned long long retain_seconds;
+  /**
+   * zlib level sealed segments are compressed with, 0 leaves them uncompressed
+   */
+  int compress_level;
+  /**
+   * Memory cap of the cache of decompressed hot segments
+   */
+  size_t hot_cache_bytes;
+  /**
+   * Hand appends to a single writer thread that stores them in batches
+   */
+  bool writer_thread;
+  /**
+   * Unix socket through which a newer process takes the listener and clients over, NULL without hot restart
+   */
+  const char * restart_path;
+};
+
+extern struct server_config config;
+extern atomic_bool signal_received; // set by the SIGINT/SIGTERM handler, polled by every loop
+
+void log_accepted_connection(struct sockaddr_storage their_addr);
+void log_closed_connection(struct sockaddr_storage their_addr);
+
+/**
+ * @brief Send a complete buffer, retrying short sends.
+ * @return 0 on success, SYSCALL_ERROR if the connection failed
+ */
+int send_all(int client_sockfd, const char * buf, size_t len);
+
+/**
+ * @brief Send up to count bytes of file_fd with sendfile(), handling partial transfers.
+ *
+ * Files without splice support, such as /dev/aesdchar, fall back to a read()/send() loop.
+ *
+ * @param offset Where to start, advanced past the bytes sent; NULL uses the file position.
+ * @param count Bytes to send, SIZE_MAX for everything up to end of file.
+ * @return 0 on success, SYSCALL_ERROR if the connection failed
+ */
+int replay_fd(int client_sockfd, int file_fd, off_t * offset, size_t count);
+
+struct handoff_client;
+
+/**
+ * The component that shuts a blocking connection down from another thread when the server stops: the
+ * connection registry in thread mode, the worker pool in pool mode. serve_connection() detaches the socket
+ * from it before sending the connection to a hot restart successor, so that shutdown() never reaches a
+ * connection the new process holds, and attaches it again if the hand-over failed.
+ */
+struct conn_owner {
+  bool (* detach)(void * owner); // false if the server is stopping: the connection stays here
+  bool (* attach)(void * owner, int client_sockfd); // false if it began stopping meanwhile: the caller closes it
+  void * owner;
+};
+
+/**
+ * @brief Serve one client connection on the calling thread until the client disconnects, then close it.
+ * @param adopted Session state and partial record of a connection taken over by a hot restart, or NULL.
+ * @param owner Whoever may shut the connection down on exit, or NULL if it is never handed over.
+ */
+void serve_connection(int client_sockfd, struct sockaddr_storage client_addr, const struct handoff_client * adopted,
+  const struct conn_owner * owner);
+
+/**
+ * @brief Whether the log is open. A process started by a hot restart accepts and adopts connections at once,
+ * but opens the log only after its predecessor closed it; until then no request is handled.
+ */
+bool log_ready(void);
+
+/**
+ * @brief Block until the log is open, see log_ready().
+ * @return true once it is, false if the server stops first
+ */
+bool wait_for_log(void);
+
+/**
+ * @brief Store one newline terminated packet (or apply an AESDCHAR_IOCSEEKTO command) in the configured backend
+ * and replay its log to the client.
+ *
+ * The reserved AESDSTATS command is answered with the server metrics instead and is not stored. AESDTAIL puts
+ * the session in tail mode and is answered with the log appended since the previous reply (the whole log on a
+ * new connection); afterwards a record is answered with only the bytes appended since the previous reply.
+ * @return true if the connection may continue, false if it should be closed
+ */
+bool handle_packet(int client_sockfd, struct client_session * session, const char * buf, size_t len);
+
+/**
+ * @brief Handle the next complete request buffered in framer: one text record, or in framed mode a run of
+ * data frames (acknowledged together) or one other frame.
+ *
+ * A non-blocking session in durable mode may be left with session->durable_wait set: its reply waits for the
+ * group commit, and no further request may be handled until finish_request() has sent it.
+ * @return 1 if a request was handled, 0 if no complete request is buffered, -1 if the connection should be closed
+ */
+int handle_next_request(int client_sockfd, struct client_session * session, struct line_framer * framer);
+
+/**
+ * @brief Send the reply a parked request owes once the log is durable up to session->durable_wait.
+ * @return true if the connection may continue, false if it should be closed
+ */
+bool finish_request(int client_sockfd, struct client_session * session);
+
+/**
+ * @brief Release what the backend holds for a session whose connection is closing or handed over.
+ */
+void release_session(struct client_session * session);
+
+/**
+ * @brief Parse the arguments of AESDCHAR_IOCSEEKTO:<write_cmd>,<write_cmd_offset>, optionally newline
+ * terminated, in place and without allocating.
+ * @param buf The whole command, starting with SEEKTO_COMMAND.
+ * @return 0 on success, -1 if the command is malformed or a value does not fit in 32 bits
+ */
+int parse_seekto(const char * buf, size_t len, uint32_t * write_cmd, uint32_t * write_cmd_offset);
+
+#endif /* AESDSOCKET_H */
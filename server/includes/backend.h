@@ -0,0 +1,84 @@
+/*
+Author: Visweshwaran Baskaran
+File name: backend.h
+File description:
+Storage backends of aesdsocket, selected at runtime with '-B': the file log (storage.c), the aesdchar
+character device, an in-memory log and the aesdchar circular buffer run in user space. handle_packet() parses a record and dispatches it to the selected
+backend, which stores it and answers the client with its replay.
+ */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "aesdsocket.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * What handle_packet() found in a record
+ */
+enum packet_kind {
+  PACKET_RECORD, // data to append
+  PACKET_SEEKTO, // AESDCHAR_IOCSEEKTO:<write_cmd>,<write_cmd_offset>
+  PACKET_TAIL, // AESDTAIL, already applied to the session
+  PACKET_REPLAY // nothing to apply: the replay a record parked for the group commit still owes
+};
+
+struct backend {
+  const char * name; // as given to '-B'
+  const char * default_path; // used when no '-P' is given
+  /**
+   * Log offsets are stable, so a tail mode session can resume from its delivered offset
+   */
+  bool stable_offsets;
+  /**
+   * Records are stored by storage.c, which the io_uring model drives directly
+   */
+  bool storage_log;
+  /**
+   * @brief Open the backend at config.path.
+   * @param resume Continue the existing log (hot restart) instead of starting an empty one.
+   * @return 0 on success, -1 on failure
+   */
+  int (*open)(bool resume);
+  /**
+   * @brief Close the backend; keep leaves the log in place for a successor process.
+   */
+  void (*close)(bool keep);
+  /**
+   * @brief Apply one record or command and send the client its replay (or queue it on session->out), as one
+   * FRAME_REPLAY frame when session->framed.
+   * @return true if the connection may continue, false if it should be closed
+   */
+  bool (*handle)(int client_sockfd, struct client_session * session, enum packet_kind kind, const char * buf, size_t len);
+  /**
+   * @brief Store one data frame of the binary protocol without replying.
+   * @param end Set to the log offset following the record, 0 without stable offsets.
+   * @return 0 on success, -1 on failure
+   */
+  int (*append)(struct client_session * session, const char * buf, size_t len, off_t * end);
+  /**
+   * @brief Wait until the log is durable up to end before it is acknowledged, NULL if append() is enough.
+   */
+  void (*wait_durable)(off_t end);
+  /**
+   * @brief Non-blocking counterpart of wait_durable: whether the log is durable up to end, asking for a group
+   * commit when it is not yet. NULL if append() is enough.
+   */
+  bool (*durable)(off_t end);
+  /**
+   * @brief Append a periodic timestamp record, NULL if the backend takes none.
+   */
+  void (*timestamp)(const char * line, size_t len);
+  /**
+   * @brief Release what the session holds in the backend when its connection closes, NULL if nothing.
+   */
+  void (*release)(struct client_session * session);
+};
+
+extern const struct backend file_backend;
+extern const struct backend chardev_backend;
+extern const struct backend memory_backend;
+extern const struct backend ring_backend;
+
+#endif /* BACKEND_H */
@@ -0,0 +1,50 @@
+/*
+Author: Visweshwaran Baskaran
+File name: buffer_pool.h
+File description:
+Shared lock-free pool of fixed-size I/O buffers for the receive framers, the outbound queues and the replay
+copy buffer, so a connection reuses warm buffers instead of going through the global allocator per record.
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUFFER_POOL_CLASSES 3 // 4 KiB, 16 KiB and 64 KiB buffers
+#define BUFFER_POOL_MIN_SHIFT 12
+#define BUFFER_POOL_MAX_SIZE ((size_t) 1 << (BUFFER_POOL_MIN_SHIFT + 2 * (BUFFER_POOL_CLASSES - 1)))
+#define BUFFER_POOL_DEFAULT_BYTES (16 * 1024 * 1024) // slab per size class, only touched as buffers are first used
+
+/**
+ * @brief Reserve a slab of class_bytes for every size class. Without it every buffer comes from malloc().
+ *
+ * A class whose buffers are larger than class_bytes gets no slab and is served by malloc().
+ * @return 0 on success, -1 on failure
+ */
+int buffer_pool_init(size_t class_bytes);
+
+/**
+ * @brief Take a buffer of at least size bytes from the smallest class that fits. Lock-free.
+ *
+ * Sizes above BUFFER_POOL_MAX_SIZE, and classes without a slab or whose slab is used up, fall back to malloc().
+ * @param cap Set to the usable size of the buffer, to be passed back to buffer_pool_put().
+ * @return The buffer, or NULL if malloc() failed
+ */
+void * buffer_pool_get(size_t size, size_t * cap);
+
+/**
+ * @brief Return a buffer taken with buffer_pool_get(). Lock-free.
+ */
+void buffer_pool_put(void * buf, size_t cap);
+
+/**
+ * @brief Bytes of buffers currently handed out, and the most there ever were.
+ */
+uint64_t buffer_pool_in_use(void);
+uint64_t buffer_pool_peak(void);
+
+void buffer_pool_free(void);
+
+#endif /* BUFFER_POOL_H */
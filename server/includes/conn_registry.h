@@ -0,0 +1,100 @@
+/*
+Author: Visweshwaran Baskaran
+File name: conn_registry.h
+File description:
+Registry of the connections served by thread per connection mode: a slab of slots preallocated at startup,
+a free list and a generation counter per slot, so registering, looking up and releasing a connection are
+O(1) and allocate nothing.
+ */
+
+#ifndef CONN_REGISTRY_H
+#define CONN_REGISTRY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define REGISTRY_INDEX_BITS 20 // slot index part of a conn_id_t, the rest is the slot's generation
+#define REGISTRY_MAX_SLOTS (1U << REGISTRY_INDEX_BITS)
+
+/**
+ * Slot index plus the slot's generation at registration. It fits in a pointer, so it can be handed to a
+ * thread as its argument; once the slot is released and reused the old id no longer resolves.
+ */
+typedef uintptr_t conn_id_t;
+
+struct handoff_client;
+
+struct conn_slot {
+  pthread_t thread;
+  int client_sockfd; // -1 while its thread hands the connection over, see conn_registry_detach()
+  struct sockaddr_storage client_addr;
+  struct handoff_client * adopted; // set for a connection taken over from the previous process, freed by its thread
+  conn_id_t id;
+  uint32_t next; // free list link while free, finished stack link once its thread is done
+  bool in_use;
+};
+
+/**
+ * @brief Allocate the slab. Its pages are only touched as slots are first used.
+ * @param capacity Maximum number of simultaneous connections, at most REGISTRY_MAX_SLOTS.
+ * @return 0 on success, -1 on failure
+ */
+int conn_registry_init(size_t capacity);
+
+/**
+ * @brief Take a free slot for a new connection. Main thread only.
+ * @return The slot with a fresh id, or NULL if every slot is in use
+ */
+struct conn_slot * conn_registry_acquire(int client_sockfd, struct sockaddr_storage client_addr);
+
+/**
+ * @brief Resolve an id to its slot.
+ * @return The slot, or NULL if the connection was released since
+ */
+struct conn_slot * conn_registry_lookup(conn_id_t id);
+
+/**
+ * @brief Return a slot whose thread never started to the free list. Main thread only.
+ */
+void conn_registry_release(struct conn_slot * slot);
+
+/**
+ * @brief Called by a connection's thread when it is done: queues the slot for conn_registry_reap(). Lock-free.
+ */
+void conn_registry_finished(struct conn_slot * slot);
+
+/**
+ * @brief Join the threads that finished since the last call and release their slots. Main thread only.
+ */
+void conn_registry_reap(void);
+
+/**
+ * @brief Called by a connection's thread before it sends its socket to a new process: hides the socket from
+ * conn_registry_close_all(), which must not shut down a connection the new process owns.
+ * @return true if detached, false if the connections are being shut down already and this one stays here
+ */
+bool conn_registry_detach(struct conn_slot * slot);
+
+/**
+ * @brief Give a detached slot its socket back after the hand-over failed.
+ * @return true if attached, false if conn_registry_close_all() ran meanwhile: the caller closes the connection
+ */
+bool conn_registry_attach(struct conn_slot * slot, int client_sockfd);
+
+/**
+ * @brief Send sig to the thread of every registered connection. Main thread only.
+ * @return Number of registered connections
+ */
+size_t conn_registry_signal_all(int sig);
+
+/**
+ * @brief Shut down every registered connection except detached ones, join its thread and release its slot.
+ */
+void conn_registry_close_all(void);
+
+void conn_registry_free(void);
+
+#endif /* CONN_REGISTRY_H */
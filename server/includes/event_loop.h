@@ -0,0 +1,54 @@
+/*
+Author: Visweshwaran Baskaran
+File name: event_loop.h
+File description:
+Edge-triggered epoll connection model for aesdsocket. Accepted client sockets are made non-blocking and
+distributed round robin over a fixed set of event loop threads, or accepted by the loops themselves from
+per-loop SO_REUSEPORT shard sockets.
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <sys/socket.h>
+
+struct handoff_client;
+
+/**
+ * @brief Create the epoll instances and start num_loops event loop threads.
+ * @param shard_fds NULL, or num_loops listening sockets; loop i then accepts from shard_fds[i] and closes it on stop.
+ * @return 0 on success, -1 on failure
+ */
+int event_loop_start(int num_loops, const int * shard_fds);
+
+/**
+ * @brief Hand an accepted client socket to the next event loop.
+ * @return 0 on success, -1 on failure (the socket is closed)
+ */
+int event_loop_add_client(int client_sockfd, struct sockaddr_storage client_addr);
+
+/**
+ * @brief Hand a connection taken over from a hot restart predecessor to the next event loop.
+ * @param client Freed before returning; its socket must be non-blocking.
+ * @return 0 on success, -1 on failure (the socket is closed)
+ */
+int event_loop_adopt_client(struct handoff_client * client);
+
+/**
+ * @brief Resume the connections parked until the log opened, registering the loops with the storage syncer in
+ * durable mode. Does nothing before event_loop_start().
+ * @return 0 on success, -1 if a loop could not be registered
+ */
+int event_loop_log_opened(void);
+
+/**
+ * @brief Wake every loop so that it hands its idle connections over to the new process, see hot_restart_begin_drain().
+ */
+void event_loop_begin_drain(void);
+
+/**
+ * @brief Stop the event loop threads, close their connections and release the epoll instances.
+ */
+void event_loop_stop(void);
+
+#endif /* EVENT_LOOP_H */
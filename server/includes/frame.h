@@ -0,0 +1,74 @@
+/*
+Author: Visweshwaran Baskaran
+File name: frame.h
+File description:
+Length-prefixed binary framing, negotiated per connection with the text command AESDBINARY. Every frame is
+a LEB128 varint payload length, one type byte and the payload, so records may contain any byte and are
+split without scanning them. Requests are answered with the request type | FRAME_REPLY: consecutive data
+frames with one batched ack, a seek with the replay, a stats request with the metrics text.
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct client_session;
+
+#define BINARY_COMMAND "AESDBINARY\n" // text command switching a connection to framed mode, never stored
+#define BINARY_COMMAND_LEN 11
+
+#define FRAME_VARINT_MAX 10 // bytes of a 64-bit LEB128 varint
+#define FRAME_HEADER_MAX (FRAME_VARINT_MAX + 1)
+#define FRAME_REPLY 0x80 // set in the type of every server to client frame
+
+enum frame_type {
+  FRAME_DATA = 0x01, // payload: one record, stored as is; answered by a FRAME_ACK covering the batch
+  FRAME_SEEK = 0x02, // payload: varint write_cmd, varint write_cmd_offset; answered like AESDCHAR_IOCSEEKTO
+  FRAME_STATS = 0x03, // empty payload; answered with the AESDSTATS text
+  FRAME_ACK = FRAME_DATA | FRAME_REPLY, // payload: varint records acknowledged, varint log end offset
+  FRAME_REPLAY = FRAME_SEEK | FRAME_REPLY, // payload: log bytes
+  FRAME_STATS_REPLY = FRAME_STATS | FRAME_REPLY, // payload: metrics text
+};
+
+/**
+ * @brief Encode value as an unsigned LEB128 varint.
+ * @return Number of bytes written to out, at most FRAME_VARINT_MAX
+ */
+size_t frame_put_varint(uint8_t * out, uint64_t value);
+
+/**
+ * @brief Decode an unsigned LEB128 varint from the len bytes at buf.
+ * @return Bytes consumed, 0 if buf ends inside the varint, or -1 if it is longer than FRAME_VARINT_MAX or
+ * does not fit in 64 bits
+ */
+int frame_get_varint(const uint8_t * buf, size_t len, uint64_t * value);
+
+/**
+ * @brief Split the next frame off the avail bytes at buf.
+ * @param consumed Set to the length of the whole frame.
+ * @return 1 if a complete frame was found, 0 if more bytes are needed, -1 if the frame is malformed or too long
+ */
+int frame_decode(const char * buf, size_t avail, uint8_t * type, const char ** payload, size_t * len, size_t * consumed);
+
+/**
+ * @brief Write the header of a frame of len payload bytes to header, FRAME_HEADER_MAX bytes at most.
+ * @return The length of the header
+ */
+size_t frame_encode_header(uint8_t * header, uint8_t type, uint64_t len);
+
+/**
+ * @brief Send (or queue on session->out) the header of a frame whose len payload bytes follow.
+ * @return 0 on success, -1 if the connection failed
+ */
+int frame_send_header(int client_sockfd, struct client_session * session, uint8_t type, uint64_t len);
+
+/**
+ * @brief Send (or queue on session->out) a complete frame.
+ * @return 0 on success, -1 if the connection failed
+ */
+int frame_send(int client_sockfd, struct client_session * session, uint8_t type, const char * payload, size_t len);
+
+#endif /* FRAME_H */
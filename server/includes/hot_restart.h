@@ -0,0 +1,94 @@
+/*
+Author: Visweshwaran Baskaran
+File name: hot_restart.h
+File description:
+Hot restart of aesdsocket: a new process takes the listening socket, and optionally the live client
+connections, over from the running one through a Unix socket with SCM_RIGHTS, so a deploy refuses no
+connection.
+ */
+
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+#include "queue.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+struct client_session;
+
+#define HOT_RESTART_DRAIN_MS 5000 // how long the old process lets its remaining connections finish
+#define HOT_RESTART_WAIT_MS (HOT_RESTART_DRAIN_MS + 2000) // how long the new process keeps its log closed for it
+#define HANDOFF_MAX_PENDING (64 * 1024) // partial record bytes a connection may carry over
+
+/**
+ * A client connection received from the previous process, with the protocol state it had there
+ */
+struct handoff_client {
+  int client_sockfd;
+  struct sockaddr_storage client_addr;
+  bool tail_mode;
+  bool framed;
+  off_t delivered;
+  size_t pending_len;
+  STAILQ_ENTRY(handoff_client) entries;
+  char pending[]; // received bytes of the next, still incomplete, record
+};
+
+STAILQ_HEAD(handoff_list, handoff_client);
+
+/**
+ * @brief New process: ask the process serving the hot restart socket at path for its listener.
+ * @param accept_clients Also ask for its live client connections, which are then sent on the channel.
+ * @param listen_sockfd Set to the received listening socket.
+ * @return The channel to receive clients on with hot_restart_receive_client(), or -1 if no process answers at path
+ */
+int hot_restart_takeover(const char * path, bool accept_clients, int * listen_sockfd);
+
+/**
+ * @brief New process: receive the next message on the channel, which poll() reported readable.
+ *
+ * The new process serves the listener and the adopted clients while the old one drains; only the log stays
+ * closed until the old process sent DONE, after closing it.
+ * @param received Set to the received connection, which the caller frees once it is served.
+ * @return 1 if a client was received, 0 for any other message, -1 once the old process is done (DONE, exit or
+ * error): the caller closes the channel and opens the log
+ */
+int hot_restart_receive_client(int channel_fd, struct handoff_client ** received);
+
+/**
+ * @brief Create the hot restart socket at path for the next process to connect to, replacing any old one.
+ * @return The listening Unix socket, or -1 on failure
+ */
+int hot_restart_listen(const char * path);
+
+/**
+ * @brief Old process: answer a takeover request waiting on restart_fd by sending listen_sockfd.
+ * @param clients_wanted Set if the new process asked for the live client connections too.
+ * @return The channel for hot_restart_send_client() and hot_restart_finish(), or -1 on failure
+ */
+int hot_restart_hand_over(int restart_fd, int listen_sockfd, bool * clients_wanted);
+
+/**
+ * @brief Old process: from now on connections are handed over on channel_fd when their thread is interrupted.
+ */
+void hot_restart_begin_drain(int channel_fd);
+
+bool hot_restart_draining(void);
+
+/**
+ * @brief Old process: send one client connection with its protocol state and buffered partial record.
+ * Safe to call from several connection threads at once.
+ * @return 0 on success, -1 if the connection has to stay here, e.g. with more than HANDOFF_MAX_PENDING bytes
+ * of a partial record: the caller keeps serving it until it is handed over on a later try or the drain ends
+ */
+int hot_restart_send_client(int client_sockfd, struct sockaddr_storage client_addr, const struct client_session * session,
+  const char * pending, size_t pending_len);
+
+/**
+ * @brief Old process: tell the new process every record is stored and it may open the log, then close the channel.
+ */
+void hot_restart_finish(int channel_fd);
+
+#endif /* HOT_RESTART_H */
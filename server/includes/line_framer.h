@@ -0,0 +1,86 @@
+/*
+Author: Visweshwaran Baskaran
+File name: line_framer.h
+File description:
+Per-connection streaming framer that accumulates received bytes across recv() calls and splits out
+complete newline terminated records, or length-prefixed frames once a connection switched to the binary
+protocol.
+ */
+
+#ifndef LINE_FRAMER_H
+#define LINE_FRAMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAMER_INITIAL_SIZE 8192 // first allocation, made on the first recv
+#define FRAMER_MIN_RECV 4096 // free space guaranteed to every recv call
+#define FRAMER_MAX_RECORD (64 * 1024 * 1024) // records longer than this close the connection
+
+struct line_framer {
+  /**
+   * Growable receive buffer, NULL until the first recv
+   */
+  char * buf;
+  size_t cap;
+  /**
+   * Offset of the first byte not yet returned as part of a record
+   */
+  size_t start;
+  /**
+   * Offset one past the last received byte
+   */
+  size_t end;
+  /**
+   * Bytes before this offset are known not to contain a newline, so they are never scanned twice
+   */
+  size_t scan;
+};
+
+void line_framer_init(struct line_framer * framer);
+
+/**
+ * @brief Make room for the next recv, compacting or growing the buffer.
+ * @param avail Set to the number of bytes that may be written at the returned pointer.
+ * @return Where received bytes should be stored, or NULL on allocation failure / oversized record
+ */
+char * line_framer_recv_space(struct line_framer * framer, size_t * avail);
+
+/**
+ * @brief Account for bytes written into the space returned by line_framer_recv_space().
+ */
+void line_framer_commit(struct line_framer * framer, size_t len);
+
+/**
+ * @brief Return the next complete record, including its newline.
+ *
+ * The returned pointer stays valid until the next call to line_framer_recv_space().
+ *
+ * @return true if a record was returned, false if only a partial record is buffered
+ */
+bool line_framer_next(struct line_framer * framer, const char ** record, size_t * len);
+
+/**
+ * @brief Return the next complete frame of the binary protocol (frame.h).
+ *
+ * The payload pointer stays valid until the next call to line_framer_recv_space().
+ *
+ * @return 1 if a frame was returned, 0 if only a partial frame is buffered, -1 if the frame is malformed
+ */
+int line_framer_next_frame(struct line_framer * framer, uint8_t * type, const char ** payload, size_t * len);
+
+/**
+ * @brief Type of the next complete frame, which stays buffered for line_framer_next_frame().
+ * @return 1 if a frame is buffered, 0 if only a partial frame is, -1 if the frame is malformed
+ */
+int line_framer_peek_frame(const struct line_framer * framer, uint8_t * type);
+
+/**
+ * @brief Number of buffered bytes that do not yet form a complete record.
+ */
+size_t line_framer_pending(const struct line_framer * framer);
+
+void line_framer_free(struct line_framer * framer);
+
+#endif /* LINE_FRAMER_H */
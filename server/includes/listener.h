@@ -0,0 +1,40 @@
+/*
+Author: Visweshwaran Baskaran
+File name: listener.h
+File description:
+Creation of the aesdsocket listening sockets: either the single socket shared by every connection model or
+one SO_REUSEPORT socket per accept shard, so the kernel spreads incoming connections across shard threads.
+ */
+
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stdbool.h>
+
+/**
+ * @brief Create a TCP socket bound to port on all IPv4 addresses and start listening.
+ * @param backlog Length of the kernel queue of completed connections waiting for accept().
+ * @param reuseport Set SO_REUSEPORT so several sockets can listen on the same port as one shard group.
+ * @return The listening socket, or -1 on failure
+ */
+int listener_open(const char * port, int backlog, bool reuseport);
+
+/**
+ * @brief Apply the client side of config.sockets to an accepted socket.
+ */
+void listener_tune_client(int client_sockfd);
+
+/**
+ * @brief Cork (on) or uncork a client socket around a replay when config.sockets.cork is set.
+ *
+ * Uncorking pushes out the final partial segment at once.
+ */
+void listener_cork(int client_sockfd, bool on);
+
+/**
+ * @brief Open num_shards SO_REUSEPORT listening sockets on port into fds.
+ * @return 0 on success, -1 on failure (no socket is left open)
+ */
+int listener_open_shards(const char * port, int backlog, int num_shards, int * fds);
+
+#endif /* LISTENER_H */
@@ -0,0 +1,79 @@
+/*
+Author: Visweshwaran Baskaran
+File name: outq.h
+File description:
+Per-connection outbound queue for non-blocking sockets. Responses are queued as memory segments, as borrowed
+pointers to memory that outlives the queue, or as byte ranges of the data log, and flushed when the socket is
+writable: consecutive memory and borrowed segments with one gathering sendmsg(), log ranges with sendfile()
+from the segment files. Nothing is ever dropped on a partial send; only
+log bytes that retention deletes before they are sent are skipped. Memory segments come from the shared
+buffer pool and segment headers are kept for reuse by their queue until it is freed.
+ */
+
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include "queue.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+#define OUTQ_DEFAULT_HIGH_WATER (1024 * 1024) // queued bytes above which a connection stops reading requests
+
+struct outq_segment;
+struct log_segment;
+
+struct outq {
+  TAILQ_HEAD(segment_list, outq_segment) segments;
+  size_t queued_bytes; // bytes not yet sent, memory and file segments
+  struct segment_list spare; // retired segment headers kept for reuse
+  size_t spare_count;
+};
+
+void outq_init(struct outq * queue);
+
+/**
+ * @brief Queue a copy of len bytes of buf.
+ * @return 0 on success, -1 on allocation failure
+ */
+int outq_push_copy(struct outq * queue, const char * buf, size_t len);
+
+/**
+ * @brief Queue len bytes of buf without copying them.
+ * @param buf Must stay valid and unchanged until the bytes are sent or the queue freed.
+ * @return 0 on success, -1 on allocation failure
+ */
+int outq_push_borrowed(struct outq * queue, const char * buf, size_t len);
+
+/**
+ * @brief Queue log bytes [from, to), sent with sendfile() from the storage layer's segment files when flushed.
+ * @param hold A storage_hold() on from, released once the range is sent or the queue freed; NULL if retention
+ * may skip bytes of the range dropped before they are sent.
+ * @return 0 on success, -1 on allocation failure (hold is released)
+ */
+int outq_push_log(struct outq * queue, off_t from, off_t to, struct log_segment * hold);
+
+/**
+ * @brief Queue everything readable from file_fd (from its current position to end of file) as memory segments.
+ *
+ * For files without sendfile() support such as /dev/aesdchar.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int outq_push_contents(struct outq * queue, int file_fd);
+
+/**
+ * @brief Send as much as the non-blocking socket accepts.
+ * @return 0 if the queue is empty, 1 if the socket is full and data remains, -1 if the connection failed
+ */
+int outq_flush(struct outq * queue, int client_sockfd);
+
+static inline size_t outq_bytes(const struct outq * queue) {
+  return queue -> queued_bytes;
+}
+
+/**
+ * @brief Release every segment and spare header of the queue.
+ */
+void outq_free(struct outq * queue);
+
+#endif /* OUTQ_H */
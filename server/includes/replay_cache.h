@@ -0,0 +1,51 @@
+/*
+Author: Visweshwaran Baskaran
+File name: replay_cache.h
+File description:
+Optional in-memory copy of the tail of the aesdsocket data log. Replays are served from memory for the
+cached tail and from the data file for anything older than the configured memory cap.
+ */
+
+#ifndef REPLAY_CACHE_H
+#define REPLAY_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define REPLAY_CACHE_CHUNK (64 * 1024) // bytes per cache chunk, the unit of eviction
+
+/**
+ * @brief Allocate the cache.
+ * @param cap_bytes Memory cap, rounded down to whole chunks (at least two).
+ * @param base_offset Log offset of the first byte that will be appended; older data is only on disk.
+ * @return 0 on success, -1 on failure
+ */
+int replay_cache_init(size_t cap_bytes, off_t base_offset);
+
+bool replay_cache_enabled(void);
+
+/**
+ * @brief Copy a record into the cache at its log offset.
+ *
+ * Must be called by one writer at a time, in log order; storage_append() calls it while it holds the
+ * publishing turn for the record.
+ */
+void replay_cache_publish(off_t offset, const char * buf, size_t len);
+
+/**
+ * @brief Lowest log offset that may currently be served from memory.
+ */
+off_t replay_cache_low(void);
+
+/**
+ * @brief Send log bytes [from, to) to a client from memory.
+ * @param sent_to Set to the offset up to which bytes were sent; less than to if a chunk was evicted while
+ * it was being copied, in which case the caller must send the rest from disk.
+ * @return 0 on success, -1 if the connection failed
+ */
+int replay_cache_send(int client_sockfd, off_t from, off_t to, off_t * sent_to);
+
+void replay_cache_free(void);
+
+#endif /* REPLAY_CACHE_H */
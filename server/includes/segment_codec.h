@@ -0,0 +1,39 @@
+/*
+Author: Visweshwaran Baskaran
+File name: segment_codec.h
+File description:
+zlib codec for sealed aesdsocket log segments. A compressed segment file is a sequence of independent
+zlib blocks of CODEC_BLOCK_BYTES raw bytes each, every one prefixed with its compressed length, so a replay
+can start at any offset by inflating only the block holding it.
+ */
+
+#ifndef SEGMENT_CODEC_H
+#define SEGMENT_CODEC_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define CODEC_BLOCK_BYTES (64 * 1024) // raw bytes per independently compressed block
+#define CODEC_SUFFIX ".z" // appended to the segment file name
+
+/**
+ * @brief Compress bytes [0, raw_len) of raw_fd into out_fd.
+ * @param level zlib compression level, 1 (fastest) to 9 (smallest).
+ * @return Size of the compressed file, or -1 on failure
+ */
+off_t codec_compress_file(int raw_fd, size_t raw_len, int out_fd, int level);
+
+/**
+ * @brief Read the block headers of a compressed segment file.
+ * @return malloc()ed file offsets of the raw_len / CODEC_BLOCK_BYTES (rounded up) blocks, NULL on failure
+ */
+off_t * codec_load_index(int fd, size_t raw_len);
+
+/**
+ * @brief Inflate one block of a compressed segment file.
+ * @param out At least CODEC_BLOCK_BYTES bytes.
+ * @return Raw bytes in the block, or -1 on failure
+ */
+ssize_t codec_read_block(int fd, const off_t * index, size_t raw_len, size_t block, char * out);
+
+#endif /* SEGMENT_CODEC_H */
@@ -0,0 +1,86 @@
+/*
+Author: Visweshwaran Baskaran
+File name: stats.h
+File description:
+Low-overhead runtime metrics for aesdsocket. Every thread updates its own block of counters and latency
+histograms without atomic read-modify-write or shared cache lines; blocks are only summed when a client
+asks for them with the AESDSTATS command.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_COMMAND "AESDSTATS\n" // reserved record answered with the merged counters, never stored
+#define STATS_COMMAND_LEN 10
+#define STATS_BUCKETS 48 // log2 latency buckets: bucket i counts samples in [2^i, 2^(i+1)) ns
+#define STATS_MAX_RESPONSE 16384 // upper bound of the AESDSTATS response
+
+enum stats_counter {
+  STAT_CONNECTIONS_ACCEPTED,
+  STAT_CONNECTIONS_CLOSED,
+  STAT_RECORDS, // records appended to the log
+  STAT_SEEK_COMMANDS,
+  STAT_STATS_COMMANDS,
+  STAT_TAIL_COMMANDS,
+  STAT_BYTES_IN, // bytes received from clients
+  STAT_BYTES_OUT, // bytes sent to clients, replays and stats responses
+  STAT_REPLAY_ZERO_COPY_BYTES, // replayed with sendfile()
+  STAT_REPLAY_COPIED_BYTES, // replayed through a user space buffer
+  STAT_REPLAY_CACHE_BYTES, // replayed from the in-memory replay cache
+  STAT_LOCK_WAIT_NS, // time spent waiting for the publish turn or a full hand-off queue
+  STAT_SYNCS, // fdatasync() calls in durable mode
+  STAT_SYNCED_BYTES,
+  STAT_SEGMENTS_DROPPED,
+  STAT_COMPRESS_IN_BYTES,
+  STAT_COMPRESS_OUT_BYTES,
+  STAT_DECOMPRESSED_BYTES,
+  STAT_DECOMPRESS_NS,
+  STAT_HOT_CACHE_HIT_BYTES,
+  STAT_WRITER_QUEUED, // records pushed on the writer thread's queue
+  STAT_WRITER_BATCHES, // pwritev() batches of the writer thread
+  STAT_WRITER_BATCHED_RECORDS,
+  STAT_FRAMED_CONNECTIONS, // connections switched to the binary protocol
+  STAT_FRAME_ACKS, // batched acks of the binary protocol
+  STAT_POOL_HITS, // buffers reused from the buffer pool
+  STAT_POOL_MISSES, // buffers carved from a slab for the first time or malloc()ed
+  STAT_NUM_COUNTERS
+};
+
+enum stats_histogram {
+  HIST_WRITE, // appending one record to the backend
+  HIST_REPLAY, // replaying the log to one client
+  HIST_SYNC, // one fdatasync() in durable mode
+  HIST_DURABLE_WAIT, // latency durable mode adds to a record: from publish until its sync completed
+  STAT_NUM_HISTOGRAMS
+};
+
+/**
+ * @brief Add n to a counter of the calling thread.
+ */
+void stats_add(enum stats_counter counter, uint64_t n);
+
+/**
+ * @brief Record one latency sample in a histogram of the calling thread.
+ */
+void stats_record_latency(enum stats_histogram histogram, uint64_t ns);
+
+/**
+ * @brief Sum of one counter over all threads, past and present.
+ */
+uint64_t stats_total(enum stats_counter counter);
+
+/**
+ * @brief Monotonic clock in nanoseconds, for latency samples.
+ */
+uint64_t stats_now_ns(void);
+
+/**
+ * @brief Merge every thread's block and format them as "name value" lines ending with an empty line.
+ * @return Length of the text written to buf (at most cap - 1, NUL terminated)
+ */
+size_t stats_format(char * buf, size_t cap);
+
+#endif /* STATS_H */
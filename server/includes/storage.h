@@ -0,0 +1,184 @@
+/*
+Author: Visweshwaran Baskaran
+File name: storage.h
+File description:
+Append-only storage for the aesdsocket file backend. One long-lived descriptor is shared by all threads;
+writers reserve their byte range with an atomic fetch-add and pwrite() into it without a global lock.
+With a writer thread, appends are queued lock-free and stored in batches by that thread alone.
+In durable mode a syncer thread group-commits the published log with one fdatasync() per commit window.
+The log is one file, or fixed-size segment files with a manifest whose oldest segments retention drops.
+All offsets are log offsets; storage_pin() maps one to its segment file. Sealed segments may be compressed,
+in which case they are read through storage_read() instead of their descriptor.
+ */
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct log_segment;
+
+/**
+ * @brief Open (creating if needed) the log and resume appending at its current end.
+ * @param cache_bytes Memory cap of the in-memory replay cache, 0 to replay everything from the file.
+ * @param segment_bytes 0 keeps the log in the single file path; otherwise it is stored as segment files
+ * path.<index> of this size, listed by path.manifest, which an earlier run may have left to resume.
+ * @return 0 on success, -1 on failure
+ */
+int storage_open(const char * path, size_t cache_bytes, size_t segment_bytes);
+
+/**
+ * @brief Set the retention of a segmented log: whole segments are dropped from the front while the rest still
+ * holds max_bytes, or once they were sealed max_seconds ago. 0 disables a limit.
+ */
+void storage_set_retention(uint64_t max_bytes, uint64_t max_seconds);
+
+/**
+ * @brief Apply the retention limits now. Byte limits are also applied whenever a new segment is started;
+ * age limits need this to be called periodically.
+ */
+void storage_trim(void);
+
+/**
+ * @brief Log offset of the oldest retained byte; replays start no earlier than this.
+ */
+off_t storage_first(void);
+
+/**
+ * @brief Pin the segment file holding a log offset, for callers that issue their own I/O on it.
+ *
+ * A pinned segment stays open, even if retention drops it, until storage_unpin().
+ * @param create Create the segment if the log has not reached it yet (writers only).
+ * @param file_offset Set to the position of offset within the segment file.
+ * @param span Set to the number of bytes from offset to the end of the segment.
+ * @return The pinned segment, or NULL if offset was dropped by retention (or could not be created)
+ */
+struct log_segment * storage_pin(off_t offset, bool create, off_t * file_offset, off_t * span);
+
+/**
+ * @brief Keep the log from offset on: retention drops neither the segment holding it nor any later one until
+ * storage_release(), so a range whose length was already announced is sent in full.
+ * @param offset Raised to the oldest retained byte first, atomically with the hold.
+ * @return The held segment, or NULL if there is nothing to hold (single file log, or offset at its end)
+ */
+struct log_segment * storage_hold(off_t * offset);
+
+/**
+ * @brief Release a storage_hold(); NULL is ignored.
+ */
+void storage_release(struct log_segment * seg);
+
+/**
+ * @brief Descriptor of a pinned segment file, -1 for a compressed segment.
+ */
+int storage_segment_fd(const struct log_segment * seg);
+
+/**
+ * @brief Read up to len bytes of a pinned segment at file_offset, inflating compressed segments.
+ *
+ * A read of a compressed segment stops at the end of the zlib block holding file_offset.
+ * @return Bytes read, 0 at the end of the segment, or -1 with errno set
+ */
+ssize_t storage_read(struct log_segment * seg, char * buf, size_t len, off_t file_offset);
+
+void storage_unpin(struct log_segment * seg);
+
+/**
+ * @brief Append one record.
+ *
+ * The byte range is reserved atomically and written with pwrite(); the call returns once every record
+ * reserved before it has also been written, so the committed length never covers a hole.
+ *
+ * @param end_offset If not NULL, set to the log offset one past the appended record.
+ * @return 0 on success, -1 on failure
+ */
+int storage_append(const char * buf, size_t len, off_t * end_offset);
+
+/**
+ * @brief Reserve len bytes at the end of the log for a writer that performs the write itself.
+ * @return Log offset of the reserved range; it must later be passed to storage_publish()
+ */
+off_t storage_reserve(size_t len);
+
+/**
+ * @brief Publish a reserved range once its bytes are written, waiting for earlier ranges to be published.
+ *
+ * Every reserved range must be published exactly once, even if writing it failed.
+ */
+void storage_publish(off_t start, const char * buf, size_t len);
+
+/**
+ * @brief The data file descriptor of an unsegmented log, which is never dropped; -1 for a segmented log.
+ */
+int storage_file_fd(void);
+
+/**
+ * @brief Length of the log prefix that is completely written and safe to replay.
+ */
+off_t storage_committed(void);
+
+/**
+ * @brief Start the syncer thread: published records become durable in groups, one fdatasync() per window.
+ * @param window_us How long the syncer lets records accumulate after the first unsynced one, 0 syncs at once.
+ * @param window_bytes Sync early once this many bytes are pending, 0 for no size limit.
+ * @return 0 on success, -1 on failure
+ */
+int storage_enable_durable(uint64_t window_us, size_t window_bytes);
+
+bool storage_is_durable(void);
+
+/**
+ * @brief Start the writer thread: storage_append() then queues the record and waits while the writer stores
+ * every queued record with one pwritev() per batch, in queue order.
+ * @return 0 on success, -1 on failure
+ */
+int storage_enable_writer(void);
+
+/**
+ * @brief Start the compressor thread: every sealed segment is rewritten as zlib blocks once fully committed.
+ * @param level zlib level, 1 to 9.
+ * @param hot_cache_bytes Memory cap of the LRU of decompressed segments, 0 to inflate every replay block by block.
+ * @return 0 on success, -1 on failure or for an unsegmented log
+ */
+int storage_enable_compression(int level, size_t hot_cache_bytes);
+
+/**
+ * @brief Length of the log prefix that is on stable storage (storage_committed() when not in durable mode).
+ *
+ * Replays, which clients take as acknowledgement, never go past this offset.
+ */
+off_t storage_durable(void);
+
+/**
+ * @brief Block until the log is durable up to end. Returns at once when not in durable mode.
+ */
+void storage_wait_durable(off_t end);
+
+/**
+ * @brief Tell the syncer that published records are waiting, without blocking.
+ */
+void storage_request_sync(void);
+
+/**
+ * @brief Register an eventfd that is written after every completed sync, for event loops that cannot block.
+ * @return 0 on success, -1 if too many listeners are registered
+ */
+int storage_add_sync_listener(int event_fd);
+
+/**
+ * @brief Unregister an eventfd added with storage_add_sync_listener(); it may be closed afterwards.
+ */
+void storage_remove_sync_listener(int event_fd);
+
+/**
+ * @brief Send log bytes [from, to) to a client, from the replay cache when possible and with sendfile() otherwise.
+ * @return 0 on success, -1 if the connection failed
+ */
+int storage_replay(int client_sockfd, off_t from, off_t to);
+
+void storage_close(void);
+
+#endif /* STORAGE_H */
@@ -0,0 +1,49 @@
+/*
+Author: Visweshwaran Baskaran
+File name: thread_pool.h
+File description:
+Pre-spawned worker pool for aesdsocket. The accept loop pushes accepted client sockets onto a bounded
+multi-producer/multi-consumer hand-off queue and a fixed number of workers serve them.
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+struct handoff_client;
+
+/**
+ * @brief Allocate the hand-off queue and start num_workers worker threads.
+ * @param num_workers Number of worker threads, which is also the maximum number of connections served at once.
+ * @param queue_capacity Maximum number of accepted sockets waiting for a worker.
+ * @return 0 on success, -1 on failure
+ */
+int thread_pool_start(int num_workers, int queue_capacity);
+
+/**
+ * @brief Queue an accepted client socket for the next free worker, blocking while the queue is full.
+ * @return 0 on success, -1 if the pool is stopping (the socket is closed)
+ */
+int thread_pool_submit(int client_sockfd, struct sockaddr_storage client_addr);
+
+/**
+ * @brief Queue a connection handed over by a hot restart predecessor, like thread_pool_submit().
+ * @param client Freed by the worker once the connection is served.
+ * @return 0 on success, -1 if the pool is stopping (the socket is closed and client freed)
+ */
+int thread_pool_adopt(struct handoff_client * client);
+
+/**
+ * @brief Send sig to every worker serving a connection; a hot restart uses SIGUSR1 to interrupt their recv().
+ * @return Number of workers serving a connection
+ */
+size_t thread_pool_signal_all(int sig);
+
+/**
+ * @brief Stop the workers, shutting down the connections they are serving, and close any queued sockets.
+ */
+void thread_pool_stop(void);
+
+#endif /* THREAD_POOL_H */
@@ -0,0 +1,25 @@
+/*
+Author: Visweshwaran Baskaran
+File name: uring_loop.h
+File description:
+io_uring connection model for aesdsocket: accept, recv, storage writes and replays are submitted as
+io_uring requests from a fixed set of ring threads.
+ */
+
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+/**
+ * @brief Create num_rings rings accepting on listen_sockfd and start their threads.
+ * @param shard_fds NULL, or num_rings listening sockets; ring i then accepts from shard_fds[i] instead of
+ * listen_sockfd and closes it on stop.
+ * @return 0 on success, -1 if io_uring is unavailable or setup failed (nothing is left running)
+ */
+int uring_loop_start(int num_rings, int listen_sockfd, const int * shard_fds);
+
+/**
+ * @brief Stop the ring threads, close their connections and log the syscalls issued per record.
+ */
+void uring_loop_stop(void);
+
+#endif /* URING_LOOP_H */
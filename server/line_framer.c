@@ -0,0 +1,98 @@
+/*
+Author: Visweshwaran Baskaran
+File name: line_framer.c
+File description:
+Streaming newline framer used by every aesdsocket connection model. One buffer is owned by each connection
+for its whole lifetime; recv() writes straight into its free tail, complete records are handed out in place
+and the consumed prefix is only compacted away when the tail runs short, so several records arriving in one
+segment and records larger than a single recv() are both handled without per-packet allocation. The buffer
+comes from the shared buffer pool and goes back to it when the connection closes.
+ */
+
+#include "includes/line_framer.h"
+#include "includes/frame.h"
+#include "includes/buffer_pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+void line_framer_init(struct line_framer * framer) {
+  memset(framer, 0, sizeof( * framer));
+}
+
+char * line_framer_recv_space(struct line_framer * framer, size_t * avail) {
+  if (framer -> start == framer -> end) {
+    // Everything consumed: restart at the front for free
+    framer -> start = framer -> end = framer -> scan = 0;
+  }
+  if (framer -> cap - framer -> end < FRAMER_MIN_RECV && framer -> start > 0) {
+    size_t pending = framer -> end - framer -> start;
+    memmove(framer -> buf, framer -> buf + framer -> start, pending);
+    framer -> scan -= framer -> start;
+    framer -> end = pending;
+    framer -> start = 0;
+  }
+  if (framer -> cap - framer -> end < FRAMER_MIN_RECV) {
+    if (framer -> end >= FRAMER_MAX_RECORD) {
+      return NULL;
+    }
+    size_t new_cap;
+    char * new_buf = (char * ) buffer_pool_get(framer -> cap ? framer -> cap * 2 : FRAMER_INITIAL_SIZE, & new_cap);
+    if (new_buf == NULL) {
+      return NULL;
+    }
+    memcpy(new_buf, framer -> buf, framer -> end);
+    buffer_pool_put(framer -> buf, framer -> cap);
+    framer -> buf = new_buf;
+    framer -> cap = new_cap;
+  }
+  * avail = framer -> cap - framer -> end;
+  return framer -> buf + framer -> end;
+}
+
+void line_framer_commit(struct line_framer * framer, size_t len) {
+  framer -> end += len;
+}
+
+bool line_framer_next(struct line_framer * framer, const char ** record, size_t * len) {
+  size_t from = framer -> scan > framer -> start ? framer -> scan : framer -> start;
+  if (from == framer -> end) {
+    return false;
+  }
+  char * newline = memchr(framer -> buf + from, '\n', framer -> end - from);
+  if (newline == NULL) {
+    framer -> scan = framer -> end;
+    return false;
+  }
+  * record = framer -> buf + framer -> start;
+  * len = newline + 1 - * record;
+  framer -> start += * len;
+  framer -> scan = framer -> start;
+  return true;
+}
+
+int line_framer_next_frame(struct line_framer * framer, uint8_t * type, const char ** payload, size_t * len) {
+  size_t consumed;
+  // The length header says where the frame ends: no byte of the payload is scanned
+  int result = frame_decode(framer -> buf + framer -> start, framer -> end - framer -> start, type, payload, len, & consumed);
+  if (result > 0) {
+    framer -> start += consumed;
+    framer -> scan = framer -> start;
+  }
+  return result;
+}
+
+int line_framer_peek_frame(const struct line_framer * framer, uint8_t * type) {
+  const char * payload;
+  size_t len;
+  size_t consumed;
+  return frame_decode(framer -> buf + framer -> start, framer -> end - framer -> start, type, & payload, & len, & consumed);
+}
+
+size_t line_framer_pending(const struct line_framer * framer) {
+  return framer -> end - framer -> start;
+}
+
+void line_framer_free(struct line_framer * framer) {
+  buffer_pool_put(framer -> buf, framer -> cap);
+  line_framer_init(framer);
+}
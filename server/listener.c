@@ -0,0 +1,135 @@
+/*
+Author: Visweshwaran Baskaran
+File name: listener.c
+File description:
+Creation of the aesdsocket listening sockets. Without sharding one socket is bound and every accepted
+connection goes through it. With sharding N sockets are bound to the same port with SO_REUSEPORT; the kernel
+hashes each incoming connection to one of them, so N acceptor threads accept in parallel from separate
+queues instead of contending on a single listen backlog.
+The socket profile ('-O') is applied here too: buffer sizes and TCP_DEFER_ACCEPT on the listener, which
+accepted sockets inherit, and TCP_NODELAY and TCP_CORK on the client sockets.
+References:
+[1] https://beej.us/guide/bgnet/html/ 6.1 A Simple Stream Server
+[2] Linux manual pages https://man7.org/linux/man-pages/man7/socket.7.html (SO_REUSEPORT)
+[3] Linux manual pages https://man7.org/linux/man-pages/man7/tcp.7.html (TCP_NODELAY, TCP_CORK, TCP_DEFER_ACCEPT)
+ */
+
+#include "includes/aesdsocket.h"
+#include "includes/listener.h"
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+int listener_open(const char * port, int backlog, bool reuseport) {
+  struct addrinfo hints, * servinfo, * p;
+  int listen_sockfd = -1;
+  int yes = 1;
+  int rv;
+
+  // Initialize the 'hints' structure to specify socket configuration options.
+  memset( & hints, 0, sizeof(hints));
+  // Set the address family to IPv4 (AF_INET) to ensure compatibility with IPv4 addresses.
+  hints.ai_family = AF_INET;
+  // Set the socket type to SOCK_STREAM, indicating a TCP socket.
+  hints.ai_socktype = SOCK_STREAM;
+  // Set the AI_PASSIVE flag, which indicates that the socket will be used for accepting incoming connections.
+  hints.ai_flags = AI_PASSIVE;
+
+  // Use getaddrinfo to retrieve a list of address structures that match the specified criteria.
+  if ((rv = getaddrinfo(NULL, port, & hints, & servinfo)) != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    return -1;
+  }
+
+  // Iterate through the list of address structures to find a suitable one for binding.
+  for (p = servinfo; p != NULL; p = p -> ai_next) {
+    // Create a socket using the address family, socket type, and protocol specified in the address structure.
+    if ((listen_sockfd = socket(p -> ai_family, p -> ai_socktype | SOCK_CLOEXEC, p -> ai_protocol)) == -1) {
+      perror("server: socket");
+      continue; // If socket creation fails, try the next address.
+    }
+
+    // Allow reusing the address/port even if it's in TIME_WAIT state.
+    if (setsockopt(listen_sockfd, SOL_SOCKET, SO_REUSEADDR, & yes, sizeof(int)) == -1 ||
+      (reuseport && setsockopt(listen_sockfd, SOL_SOCKET, SO_REUSEPORT, & yes, sizeof(int)) == -1)) {
+      perror("setsockopt");
+      syslog(LOG_ERR, "setsockopt failed: %s", strerror(errno));
+      close(listen_sockfd);
+      freeaddrinfo(servinfo);
+      return -1;
+    }
+
+    // Buffer sizes must be set before listen() for the receive window scale to follow them
+    if ((config.sockets.sndbuf > 0 &&
+        setsockopt(listen_sockfd, SOL_SOCKET, SO_SNDBUF, & config.sockets.sndbuf, sizeof(int)) == -1) ||
+      (config.sockets.rcvbuf > 0 &&
+        setsockopt(listen_sockfd, SOL_SOCKET, SO_RCVBUF, & config.sockets.rcvbuf, sizeof(int)) == -1)) {
+      syslog(LOG_WARNING, "setsockopt SO_SNDBUF/SO_RCVBUF failed: %s", strerror(errno));
+    }
+
+    // Bind the socket to the address and port specified in the address structure.
+    if (bind(listen_sockfd, p -> ai_addr, p -> ai_addrlen) == -1) {
+      close(listen_sockfd);
+      perror("server: bind");
+      continue; // If binding fails, try the next address.
+    }
+
+    // If binding is successful, break out of the loop.
+    break;
+  }
+
+  // Free the memory allocated by getaddrinfo.
+  freeaddrinfo(servinfo);
+
+  if (p == NULL) {
+    fprintf(stderr, "server: failed to bind\n");
+    return -1;
+  }
+
+  if (listen(listen_sockfd, backlog) == -1) {
+    perror("listen");
+    close(listen_sockfd);
+    return -1;
+  }
+  // Connections are only queued for accept() once the client sent its first record
+  if (config.sockets.defer_accept_s > 0 && setsockopt(listen_sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+      & config.sockets.defer_accept_s, sizeof(int)) == -1) {
+    syslog(LOG_WARNING, "setsockopt TCP_DEFER_ACCEPT failed: %s", strerror(errno));
+  }
+  return listen_sockfd;
+}
+
+void listener_tune_client(int client_sockfd) {
+  int yes = 1;
+  if (config.sockets.nodelay) {
+    setsockopt(client_sockfd, IPPROTO_TCP, TCP_NODELAY, & yes, sizeof(yes));
+  }
+}
+
+void listener_cork(int client_sockfd, bool on) {
+  int value = on;
+  if (config.sockets.cork) {
+    setsockopt(client_sockfd, IPPROTO_TCP, TCP_CORK, & value, sizeof(value));
+  }
+}
+
+int listener_open_shards(const char * port, int backlog, int num_shards, int * fds) {
+  for (int i = 0; i < num_shards; i++) {
+    fds[i] = listener_open(port, backlog, true);
+    if (fds[i] == -1) {
+      while (i-- > 0) {
+        close(fds[i]);
+      }
+      return -1;
+    }
+  }
+  syslog(LOG_INFO, "Listening on port %s with %d SO_REUSEPORT shards, backlog %d", port, num_shards, backlog);
+  return 0;
+}
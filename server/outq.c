@@ -0,0 +1,374 @@
+/*
+Author: Visweshwaran Baskaran
+File name: outq.c
+File description:
+Per-connection outbound queue for the non-blocking connection models. A slow reader only grows its own
+queue; the event loop thread never waits for one socket to drain. Small responses are coalesced into
+shared memory segments, up to OUTQ_MAX_IOV of which go out in one sendmsg() call, and log replays are
+queued as log ranges so they stay zero-copy: each flush pins the segment file holding the head of the range
+and sendfile()s from it. Bytes that outlive the queue, such as the in-memory backend's chunks, are queued as
+borrowed segments that point at them instead of being copied. Memory segment buffers are drawn from the lock-free buffer pool and returned to it
+as soon as they are sent; a queue keeps up to OUTQ_SPARE_SEGMENTS retired segment headers, so a long session
+stops allocating once it is warm.
+References:
+[1] Linux manual pages https://man7.org/linux/man-pages/man2/sendmsg.2.html
+[2] Linux manual pages https://man7.org/linux/man-pages/man2/sendfile.2.html
+[3] queue.h leveraged from: https://raw.githubusercontent.com/freebsd/freebsd/stable/10/sys/sys/queue.h
+ */
+
+#include "includes/aesdsocket.h"
+#include "includes/outq.h"
+#include "includes/storage.h"
+#include "includes/stats.h"
+#include "includes/buffer_pool.h"
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#define OUTQ_SEGMENT_SIZE 4096 // minimum memory segment, small responses share one
+#define OUTQ_MAX_IOV 64 // memory segments gathered per sendmsg()
+#define OUTQ_SENDFILE_CHUNK (1024 * 1024) // bytes requested per sendfile() call
+#define OUTQ_READ_CHUNK (64 * 1024) // bytes read per memory segment by outq_push_contents() and the sendfile fallback
+#define OUTQ_SPARE_SEGMENTS 8 // retired segment headers a queue keeps for reuse
+
+enum segment_kind {
+  SEGMENT_MEMORY,
+  SEGMENT_BORROWED, // points into memory owned by the caller, never copied or freed
+  SEGMENT_LOG
+};
+
+struct outq_segment {
+  enum segment_kind kind;
+  char * data; // SEGMENT_MEMORY and SEGMENT_BORROWED
+  size_t cap;
+  size_t len;
+  size_t sent;
+  off_t offset; // SEGMENT_LOG: log bytes [offset, end) remain to be sent
+  off_t end;
+  struct log_segment * hold; // SEGMENT_LOG: keeps retention off the range, or NULL
+  TAILQ_ENTRY(outq_segment) entries;
+};
+
+void outq_init(struct outq * queue) {
+  TAILQ_INIT( & queue -> segments);
+  queue -> queued_bytes = 0;
+  TAILQ_INIT( & queue -> spare);
+  queue -> spare_count = 0;
+}
+
+static struct outq_segment * new_segment(struct outq * queue, enum segment_kind kind) {
+  struct outq_segment * seg = TAILQ_FIRST( & queue -> spare);
+  if (seg != NULL) {
+    TAILQ_REMOVE( & queue -> spare, seg, entries);
+    queue -> spare_count--;
+  } else if ((seg = (struct outq_segment * ) malloc(sizeof(struct outq_segment))) == NULL) {
+    return NULL;
+  }
+  seg -> kind = kind;
+  seg -> hold = NULL;
+  return seg;
+}
+
+static void free_segment(struct outq * queue, struct outq_segment * seg) {
+  if (seg -> kind == SEGMENT_MEMORY) {
+    buffer_pool_put(seg -> data, seg -> cap);
+  }
+  storage_release(seg -> hold);
+  if (queue -> spare_count < OUTQ_SPARE_SEGMENTS) {
+    TAILQ_INSERT_HEAD( & queue -> spare, seg, entries);
+    queue -> spare_count++;
+  } else {
+    free(seg);
+  }
+}
+
+/**
+ * @brief A memory segment with room for at least size bytes; its cap may be larger.
+ */
+static struct outq_segment * new_memory_segment(struct outq * queue, size_t size) {
+  struct outq_segment * seg = new_segment(queue, SEGMENT_LOG);
+  if (seg == NULL) {
+    return NULL;
+  }
+  seg -> data = (char * ) buffer_pool_get(size, & seg -> cap);
+  if (seg -> data == NULL) {
+    free_segment(queue, seg);
+    return NULL;
+  }
+  seg -> kind = SEGMENT_MEMORY;
+  seg -> len = 0;
+  seg -> sent = 0;
+  return seg;
+}
+
+int outq_push_copy(struct outq * queue, const char * buf, size_t len) {
+  struct outq_segment * tail = TAILQ_LAST( & queue -> segments, segment_list);
+  if (tail != NULL && tail -> kind == SEGMENT_MEMORY && tail -> cap - tail -> len >= len) {
+    memcpy(tail -> data + tail -> len, buf, len);
+    tail -> len += len;
+    queue -> queued_bytes += len;
+    return 0;
+  }
+  struct outq_segment * seg = new_memory_segment(queue, len > OUTQ_SEGMENT_SIZE ? len : OUTQ_SEGMENT_SIZE);
+  if (seg == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    return -1;
+  }
+  memcpy(seg -> data, buf, len);
+  seg -> len = len;
+  TAILQ_INSERT_TAIL( & queue -> segments, seg, entries);
+  queue -> queued_bytes += len;
+  return 0;
+}
+
+int outq_push_borrowed(struct outq * queue, const char * buf, size_t len) {
+  if (len == 0) {
+    return 0;
+  }
+  struct outq_segment * seg = new_segment(queue, SEGMENT_BORROWED);
+  if (seg == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    return -1;
+  }
+  seg -> data = (char * ) buf;
+  seg -> cap = len;
+  seg -> len = len;
+  seg -> sent = 0;
+  TAILQ_INSERT_TAIL( & queue -> segments, seg, entries);
+  queue -> queued_bytes += len;
+  return 0;
+}
+
+int outq_push_log(struct outq * queue, off_t from, off_t to, struct log_segment * hold) {
+  if (to <= from) {
+    storage_release(hold);
+    return 0;
+  }
+  struct outq_segment * seg = new_segment(queue, SEGMENT_LOG);
+  if (seg == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    storage_release(hold);
+    return -1;
+  }
+  seg -> offset = from;
+  seg -> end = to;
+  seg -> hold = hold;
+  TAILQ_INSERT_TAIL( & queue -> segments, seg, entries);
+  queue -> queued_bytes += to - from;
+  return 0;
+}
+
+int outq_push_contents(struct outq * queue, int file_fd) {
+  while (1) {
+    struct outq_segment * seg = new_memory_segment(queue, OUTQ_READ_CHUNK);
+    if (seg == NULL) {
+      syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+      return -1;
+    }
+    ssize_t bytes_read;
+    do {
+      bytes_read = read(file_fd, seg -> data, seg -> cap);
+    } while (bytes_read == SYSCALL_ERROR && errno == EINTR);
+    if (bytes_read <= 0) {
+      free_segment(queue, seg);
+      if (bytes_read == SYSCALL_ERROR) {
+        perror("read");
+        syslog(LOG_ERR, "read failed: %s", strerror(errno));
+        return -1;
+      }
+      return 0;
+    }
+    seg -> len = bytes_read;
+    TAILQ_INSERT_TAIL( & queue -> segments, seg, entries);
+    queue -> queued_bytes += bytes_read;
+    stats_add(STAT_REPLAY_COPIED_BYTES, bytes_read);
+  }
+}
+
+/**
+ * @brief Retire the head of a log range that retention dropped before it was sent.
+ * @return 0 on success, -1 if the range is not in the log at all
+ */
+static int skip_dropped(struct outq * queue, struct outq_segment * log_seg) {
+  off_t first = storage_first();
+  if (first <= log_seg -> offset) {
+    syslog(LOG_ERR, "Replay offset %lld is not in the log", (long long) log_seg -> offset);
+    return -1;
+  }
+  off_t skip_to = first < log_seg -> end ? first : log_seg -> end;
+  syslog(LOG_WARNING, "Replay skipped %lld bytes dropped by log retention", (long long)(skip_to - log_seg -> offset));
+  queue -> queued_bytes -= skip_to - log_seg -> offset;
+  log_seg -> offset = skip_to;
+  if (log_seg -> offset == log_seg -> end) {
+    TAILQ_REMOVE( & queue -> segments, log_seg, entries);
+    free_segment(queue, log_seg);
+  }
+  return 0;
+}
+
+/**
+ * @brief Replace the head of a log range whose file cannot be spliced (or is compressed) by a memory segment read from it.
+ * @return 0 on success, -1 on failure
+ */
+static int file_segment_to_memory(struct outq * queue, struct outq_segment * file_seg, struct log_segment * log_seg,
+  off_t file_offset, off_t span) {
+  size_t chunk = file_seg -> end - file_seg -> offset;
+  if ((off_t) chunk > span) {
+    chunk = span;
+  }
+  if (chunk > OUTQ_READ_CHUNK) {
+    chunk = OUTQ_READ_CHUNK;
+  }
+  struct outq_segment * seg = new_memory_segment(queue, chunk);
+  if (seg == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    return -1;
+  }
+  // Never past the range: the pooled buffer may be larger than chunk
+  ssize_t bytes_read = storage_read(log_seg, seg -> data, chunk, file_offset);
+  if (bytes_read <= 0) {
+    free_segment(queue, seg);
+    syslog(LOG_ERR, "pread failed: %s", bytes_read == 0 ? "unexpected end of file" : strerror(errno));
+    return -1;
+  }
+  seg -> len = bytes_read;
+  file_seg -> offset += bytes_read;
+  TAILQ_INSERT_BEFORE(file_seg, seg, entries);
+  if (file_seg -> offset == file_seg -> end) {
+    TAILQ_REMOVE( & queue -> segments, file_seg, entries);
+    free_segment(queue, file_seg);
+  }
+  stats_add(STAT_REPLAY_COPIED_BYTES, bytes_read);
+  return 0;
+}
+
+/**
+ * @brief Send consecutive memory and borrowed segments from the head of the queue with one sendmsg().
+ * @return bytes sent, or SYSCALL_ERROR with errno set
+ */
+static ssize_t flush_memory(struct outq * queue, int client_sockfd) {
+  struct iovec iov[OUTQ_MAX_IOV];
+  int iovcnt = 0;
+  struct outq_segment * seg;
+  TAILQ_FOREACH(seg, & queue -> segments, entries) {
+    if (seg -> kind == SEGMENT_LOG || iovcnt == OUTQ_MAX_IOV) {
+      break;
+    }
+    iov[iovcnt].iov_base = seg -> data + seg -> sent;
+    iov[iovcnt].iov_len = seg -> len - seg -> sent;
+    iovcnt++;
+  }
+  struct msghdr msg;
+  memset( & msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  ssize_t bytes_sent = sendmsg(client_sockfd, & msg, MSG_NOSIGNAL);
+  if (bytes_sent <= 0) {
+    return bytes_sent;
+  }
+  // Retire fully sent segments, leave the partially sent one at the head
+  size_t remaining = bytes_sent;
+  while (remaining > 0 && (seg = TAILQ_FIRST( & queue -> segments)) != NULL) {
+    size_t unsent = seg -> len - seg -> sent;
+    if (remaining < unsent) {
+      seg -> sent += remaining;
+      break;
+    }
+    remaining -= unsent;
+    TAILQ_REMOVE( & queue -> segments, seg, entries);
+    free_segment(queue, seg);
+  }
+  return bytes_sent;
+}
+
+int outq_flush(struct outq * queue, int client_sockfd) {
+  struct outq_segment * seg;
+  while ((seg = TAILQ_FIRST( & queue -> segments)) != NULL) {
+    ssize_t bytes_sent;
+    if (seg -> kind != SEGMENT_LOG) {
+      bytes_sent = flush_memory(queue, client_sockfd);
+    } else {
+      off_t file_offset;
+      off_t span;
+      struct log_segment * log_seg = storage_pin(seg -> offset, false, & file_offset, & span);
+      if (log_seg == NULL) {
+        if (skip_dropped(queue, seg) != 0) {
+          return -1;
+        }
+        continue;
+      }
+      // One sendfile() never crosses into the next segment file
+      off_t count = seg -> end - seg -> offset;
+      if (count > span) {
+        count = span;
+      }
+      int file_fd = storage_segment_fd(log_seg);
+      bytes_sent = file_fd == -1 ? SYSCALL_ERROR :
+        sendfile(client_sockfd, file_fd, & file_offset, count < OUTQ_SENDFILE_CHUNK ? count : OUTQ_SENDFILE_CHUNK);
+      if (file_fd == -1 || (bytes_sent == SYSCALL_ERROR && (errno == EINVAL || errno == ENOSYS))) {
+        // Compressed, or no splice_read support: continue this range through user space
+        int result = file_segment_to_memory(queue, seg, log_seg, file_offset, span);
+        storage_unpin(log_seg);
+        if (result != 0) {
+          return -1;
+        }
+        continue;
+      }
+      int sendfile_errno = errno;
+      storage_unpin(log_seg);
+      errno = sendfile_errno;
+      if (bytes_sent == 0) {
+        syslog(LOG_ERR, "sendfile: replay range past end of file");
+        return -1;
+      }
+      if (bytes_sent > 0) {
+        seg -> offset += bytes_sent;
+        stats_add(STAT_REPLAY_ZERO_COPY_BYTES, bytes_sent);
+        if (seg -> offset == seg -> end) {
+          TAILQ_REMOVE( & queue -> segments, seg, entries);
+          free_segment(queue, seg);
+        }
+      }
+    }
+    if (bytes_sent == SYSCALL_ERROR) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 1;
+      }
+      if (errno != EPIPE && errno != ECONNRESET) {
+        perror("send");
+        syslog(LOG_ERR, "send failed: %s", strerror(errno));
+      }
+      return -1;
+    }
+    queue -> queued_bytes -= bytes_sent;
+    stats_add(STAT_BYTES_OUT, bytes_sent);
+  }
+  return 0;
+}
+
+void outq_free(struct outq * queue) {
+  struct outq_segment * seg;
+  while ((seg = TAILQ_FIRST( & queue -> segments)) != NULL) {
+    TAILQ_REMOVE( & queue -> segments, seg, entries);
+    if (seg -> kind == SEGMENT_MEMORY) {
+      buffer_pool_put(seg -> data, seg -> cap);
+    }
+    storage_release(seg -> hold);
+    free(seg);
+  }
+  while ((seg = TAILQ_FIRST( & queue -> spare)) != NULL) {
+    TAILQ_REMOVE( & queue -> spare, seg, entries);
+    free(seg);
+  }
+  queue -> queued_bytes = 0;
+  queue -> spare_count = 0;
+}
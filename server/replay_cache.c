@@ -0,0 +1,174 @@
+/*
+Author: Visweshwaran Baskaran
+File name: replay_cache.c
+File description:
+In-memory replay cache for the aesdsocket file backend. The log tail is kept in a ring of fixed size chunks;
+chunk c of the log lives in slot c % num_slots, so once the memory cap is reached appending a new chunk
+evicts the oldest one in O(1). Records are published by a single writer at a time (the writer holding the
+storage publishing turn) and readers copy under a per-slot seqlock: the slot's chunk id is checked before
+and after the copy, and a reader that raced with an eviction falls back to the data file for the rest of
+its replay.
+References:
+[1] Seqlocks https://www.kernel.org/doc/html/latest/locking/seqlock.html
+[2] C11 atomics https://en.cppreference.com/w/c/atomic
+ */
+
+#include "includes/aesdsocket.h"
+#include "includes/replay_cache.h"
+#include "includes/stats.h"
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define REPLAY_CACHE_BATCH (4 * REPLAY_CACHE_CHUNK) // bytes gathered per send() during a memory replay
+
+struct cache_slot {
+  /**
+   * Index of the log chunk held in data, -1 when empty. Doubles as the seqlock sequence.
+   */
+  atomic_llong chunk_id;
+  char * data;
+};
+
+static struct cache_slot * slots = NULL;
+static long long num_slots = 0;
+static off_t cache_base = 0; // first offset ever published into the cache
+static atomic_llong newest_chunk = -1;
+static pthread_key_t batch_key; // per-thread bounce buffer for validated copies, freed when the thread exits
+
+
+int replay_cache_init(size_t cap_bytes, off_t base_offset) {
+  num_slots = cap_bytes / REPLAY_CACHE_CHUNK;
+  if (num_slots < 2) {
+    num_slots = 2;
+  }
+  slots = (struct cache_slot * ) calloc(num_slots, sizeof(struct cache_slot));
+  if (slots == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    perror("calloc");
+    return -1;
+  }
+  for (long long i = 0; i < num_slots; i++) {
+    atomic_init( & slots[i].chunk_id, -1);
+    slots[i].data = (char * ) malloc(REPLAY_CACHE_CHUNK);
+    if (slots[i].data == NULL) {
+      syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+      perror("malloc");
+      replay_cache_free();
+      return -1;
+    }
+  }
+  if (pthread_key_create( & batch_key, free) != 0) {
+    perror("pthread_key_create");
+    replay_cache_free();
+    return -1;
+  }
+  cache_base = base_offset;
+  atomic_store( & newest_chunk, -1);
+  syslog(LOG_INFO, "Replay cache of %lld chunks (%lld bytes)", num_slots, num_slots * REPLAY_CACHE_CHUNK);
+  return 0;
+}
+
+bool replay_cache_enabled(void) {
+  return slots != NULL;
+}
+
+void replay_cache_publish(off_t offset, const char * buf, size_t len) {
+  while (len > 0) {
+    long long chunk = offset / REPLAY_CACHE_CHUNK;
+    size_t chunk_offset = offset % REPLAY_CACHE_CHUNK;
+    size_t count = REPLAY_CACHE_CHUNK - chunk_offset < len ? REPLAY_CACHE_CHUNK - chunk_offset : len;
+    struct cache_slot * slot = & slots[chunk % num_slots];
+
+    if (atomic_load_explicit( & slot -> chunk_id, memory_order_relaxed) != chunk) {
+      // Evict the chunk num_slots behind: readers still copying it see the id change and retry from disk
+      atomic_store_explicit( & slot -> chunk_id, chunk, memory_order_relaxed);
+      atomic_store_explicit( & newest_chunk, chunk, memory_order_release);
+      atomic_thread_fence(memory_order_release);
+    }
+    memcpy(slot -> data + chunk_offset, buf, count);
+    offset += count;
+    buf += count;
+    len -= count;
+  }
+}
+
+off_t replay_cache_low(void) {
+  long long newest = atomic_load_explicit( & newest_chunk, memory_order_acquire);
+  off_t low = (newest - num_slots + 1) * (off_t) REPLAY_CACHE_CHUNK;
+  return low > cache_base ? low : cache_base;
+}
+
+/**
+ * @brief Copy log bytes [offset, offset + count) of one chunk out of the cache.
+ * @return true if the copy is consistent, false if the chunk was evicted meanwhile
+ */
+static bool copy_chunk(char * dest, off_t offset, size_t count) {
+  long long chunk = offset / REPLAY_CACHE_CHUNK;
+  struct cache_slot * slot = & slots[chunk % num_slots];
+  if (atomic_load_explicit( & slot -> chunk_id, memory_order_acquire) != chunk) {
+    return false;
+  }
+  memcpy(dest, slot -> data + offset % REPLAY_CACHE_CHUNK, count);
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit( & slot -> chunk_id, memory_order_relaxed) == chunk;
+}
+
+int replay_cache_send(int client_sockfd, off_t from, off_t to, off_t * sent_to) {
+  * sent_to = from;
+  char * batch_buffer = (char * ) pthread_getspecific(batch_key);
+  if (batch_buffer == NULL) {
+    batch_buffer = (char * ) malloc(REPLAY_CACHE_BATCH);
+    if (batch_buffer == NULL || pthread_setspecific(batch_key, batch_buffer) != 0) {
+      free(batch_buffer);
+      return 0; // caller sends everything from disk
+    }
+  }
+  while (from < to) {
+    size_t batched = 0;
+    bool consistent = true;
+    while (from + (off_t) batched < to && batched < REPLAY_CACHE_BATCH) {
+      off_t offset = from + batched;
+      size_t count = REPLAY_CACHE_CHUNK - offset % REPLAY_CACHE_CHUNK;
+      if (count > (size_t)(to - offset)) {
+        count = to - offset;
+      }
+      if (count > REPLAY_CACHE_BATCH - batched) {
+        count = REPLAY_CACHE_BATCH - batched;
+      }
+      if (!copy_chunk(batch_buffer + batched, offset, count)) {
+        consistent = false;
+        break;
+      }
+      batched += count;
+    }
+    if (batched > 0) {
+      if (send_all(client_sockfd, batch_buffer, batched) != 0) {
+        return -1;
+      }
+      stats_add(STAT_REPLAY_CACHE_BYTES, batched);
+      from += batched;
+      * sent_to = from;
+    }
+    if (!consistent) {
+      break;
+    }
+  }
+  return 0;
+}
+
+void replay_cache_free(void) {
+  if (slots == NULL) {
+    return;
+  }
+  for (long long i = 0; i < num_slots; i++) {
+    free(slots[i].data);
+  }
+  free(slots);
+  slots = NULL;
+  num_slots = 0;
+}
@@ -0,0 +1,47 @@
+/*
+Author: Visweshwaran Baskaran
+File name: seekto.c
+File description:
+Parser for the AESDCHAR_IOCSEEKTO:<write_cmd>,<write_cmd_offset> command shared by the backends that
+support seeking. Kept apart from aesdsocket.c so the unit tests can link it without the server.
+ */
+
+#include "includes/aesdsocket.h"
+#include <stdint.h>
+
+/**
+ * @brief Parse an unsigned decimal of at most 32 bits at * p, advancing * p past its digits.
+ * @return 0 on success, -1 if there is no digit or the value overflows
+ */
+static int parse_u32(const char ** p, const char * end, uint32_t * value) {
+  const char * start = * p;
+  uint64_t result = 0;
+  while ( * p < end && ** p >= '0' && ** p <= '9') {
+    result = result * 10 + (uint64_t)( ** p - '0');
+    if (result > UINT32_MAX) {
+      return -1;
+    }
+    ( * p)++;
+  }
+  if ( * p == start) {
+    return -1;
+  }
+  * value = (uint32_t) result;
+  return 0;
+}
+
+int parse_seekto(const char * buf, size_t len, uint32_t * write_cmd, uint32_t * write_cmd_offset) {
+  if (len < SEEKTO_COMMAND_LEN) {
+    return -1;
+  }
+  const char * p = buf + SEEKTO_COMMAND_LEN;
+  const char * end = buf + len;
+  if (end > p && end[-1] == '\n') {
+    end--;
+  }
+  if (parse_u32( & p, end, write_cmd) != 0 || p == end || * p++ != ',' ||
+    parse_u32( & p, end, write_cmd_offset) != 0 || p != end) {
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,134 @@
+/*
+Author: Visweshwaran Baskaran
+File name: segment_codec.c
+File description:
+zlib block codec for sealed log segments. Blocks are compressed with compress2() and inflated with
+uncompress(): each one is a complete zlib stream, so no inflate state has to be kept between the chunks of
+a replay and a reader positioned anywhere in the segment decodes at most one block it does not need.
+File layout: for every block a 4 byte compressed length in host byte order followed by the zlib stream.
+References:
+[1] zlib manual https://www.zlib.net/manual.html
+ */
+
+#include "includes/aesdsocket.h"
+#include "includes/segment_codec.h"
+#include <zlib.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+/**
+ * compressBound() of one block, usable for buffer sizes
+ */
+#define CODEC_MAX_COMPRESSED (CODEC_BLOCK_BYTES + (CODEC_BLOCK_BYTES >> 12) + (CODEC_BLOCK_BYTES >> 14) + 13)
+
+static int read_full(int fd, void * buf, size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t bytes_read = pread(fd, (char * ) buf + done, len - done, offset + done);
+    if (bytes_read == SYSCALL_ERROR && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      syslog(LOG_ERR, "pread failed: %s", bytes_read == 0 ? "unexpected end of file" : strerror(errno));
+      return -1;
+    }
+    done += bytes_read;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void * buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t bytes_written = write(fd, (const char * ) buf + done, len - done);
+    if (bytes_written == SYSCALL_ERROR) {
+      if (errno == EINTR) {
+        continue;
+      }
+      syslog(LOG_ERR, "write failed: %s", strerror(errno));
+      return -1;
+    }
+    done += bytes_written;
+  }
+  return 0;
+}
+
+off_t codec_compress_file(int raw_fd, size_t raw_len, int out_fd, int level) {
+  char * raw = (char * ) malloc(CODEC_BLOCK_BYTES);
+  unsigned char * packed = (unsigned char * ) malloc(sizeof(uint32_t) + CODEC_MAX_COMPRESSED);
+  off_t out_len = 0;
+  if (raw == NULL || packed == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    out_len = -1;
+  }
+  for (size_t pos = 0; out_len != -1 && pos < raw_len; pos += CODEC_BLOCK_BYTES) {
+    size_t len = raw_len - pos < CODEC_BLOCK_BYTES ? raw_len - pos : CODEC_BLOCK_BYTES;
+    uLongf packed_len = CODEC_MAX_COMPRESSED;
+    if (read_full(raw_fd, raw, len, pos) != 0) {
+      out_len = -1;
+      break;
+    }
+    int result = compress2(packed + sizeof(uint32_t), & packed_len, (const Bytef * ) raw, len, level);
+    if (result != Z_OK) {
+      syslog(LOG_ERR, "compress2 failed: %s", zError(result));
+      out_len = -1;
+      break;
+    }
+    uint32_t header = packed_len;
+    memcpy(packed, & header, sizeof(header));
+    if (write_full(out_fd, packed, sizeof(header) + packed_len) != 0) {
+      out_len = -1;
+      break;
+    }
+    out_len += sizeof(header) + packed_len;
+  }
+  free(raw);
+  free(packed);
+  return out_len;
+}
+
+off_t * codec_load_index(int fd, size_t raw_len) {
+  size_t blocks = (raw_len + CODEC_BLOCK_BYTES - 1) / CODEC_BLOCK_BYTES;
+  off_t * index = (off_t * ) malloc((blocks ? blocks : 1) * sizeof(off_t));
+  if (index == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    return NULL;
+  }
+  off_t pos = 0;
+  for (size_t block = 0; block < blocks; block++) {
+    uint32_t header;
+    if (read_full(fd, & header, sizeof(header), pos) != 0 || header > CODEC_MAX_COMPRESSED) {
+      syslog(LOG_ERR, "Corrupt compressed segment: bad header of block %zu", block);
+      free(index);
+      return NULL;
+    }
+    index[block] = pos;
+    pos += sizeof(header) + header;
+  }
+  return index;
+}
+
+ssize_t codec_read_block(int fd, const off_t * index, size_t raw_len, size_t block, char * out) {
+  unsigned char packed[sizeof(uint32_t) + CODEC_MAX_COMPRESSED];
+  uint32_t header;
+  if (read_full(fd, & header, sizeof(header), index[block]) != 0 || header > CODEC_MAX_COMPRESSED ||
+    read_full(fd, packed, header, index[block] + sizeof(header)) != 0) {
+    return -1;
+  }
+  size_t expected = raw_len - block * CODEC_BLOCK_BYTES;
+  if (expected > CODEC_BLOCK_BYTES) {
+    expected = CODEC_BLOCK_BYTES;
+  }
+  uLongf out_len = CODEC_BLOCK_BYTES;
+  int result = uncompress((Bytef * ) out, & out_len, packed, header);
+  if (result != Z_OK || out_len != expected) {
+    syslog(LOG_ERR, "uncompress of block %zu failed: %s", block, result != Z_OK ? zError(result) : "short block");
+    return -1;
+  }
+  return out_len;
+}
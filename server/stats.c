@@ -0,0 +1,259 @@
+/*
+Author: Visweshwaran Baskaran
+File name: stats.c
+File description:
+Per-thread metrics for aesdsocket. A thread gets its own stats block on first use and is the only writer
+of it, so an update is a relaxed load and store on a cache line no other thread writes. Blocks are linked
+in a global list under a mutex that is only taken when a thread starts, exits or a client asks for the
+merged view; the block of an exiting thread is folded into a retired block so thread per connection mode
+does not grow the list.
+References:
+[1] C11 atomics https://en.cppreference.com/w/c/atomic
+[2] Linux manual pages https://man7.org/linux/man-pages/man3/pthread_key_create.3p.html
+ */
+
+#include "includes/queue.h"
+#include "includes/aesdsocket.h"
+#include "includes/stats.h"
+#include "includes/buffer_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+struct stats_block {
+  atomic_ullong counters[STAT_NUM_COUNTERS];
+  atomic_ullong buckets[STAT_NUM_HISTOGRAMS][STATS_BUCKETS];
+  LIST_ENTRY(stats_block) entries;
+};
+
+static const char * counter_names[STAT_NUM_COUNTERS] = {
+  "connections_accepted",
+  "connections_closed",
+  "records",
+  "seek_commands",
+  "stats_commands",
+  "tail_commands",
+  "bytes_in",
+  "bytes_out",
+  "replay_zero_copy_bytes",
+  "replay_copied_bytes",
+  "replay_cache_hit_bytes",
+  "lock_wait_ns",
+  "syncs",
+  "synced_bytes",
+  "segments_dropped",
+  "compress_in_bytes",
+  "compress_out_bytes",
+  "decompressed_bytes",
+  "decompress_ns",
+  "hot_segment_cache_hit_bytes",
+  "writer_queued",
+  "writer_batches",
+  "writer_batched_records",
+  "framed_connections",
+  "frame_acks",
+  "pool_hits",
+  "pool_misses",
+};
+
+static const char * histogram_names[STAT_NUM_HISTOGRAMS] = {
+  "write_latency",
+  "replay_latency",
+  "sync_latency",
+  "durable_wait_latency",
+};
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(blocklist, stats_block) blocks = LIST_HEAD_INITIALIZER(blocks);
+static struct stats_block retired; // totals of threads that have exited, protected by blocks_lock
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_block * local_block = NULL;
+
+static void add_relaxed(atomic_ullong * value, uint64_t n) {
+  // Single writer: a plain load and store, no locked read-modify-write
+  atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * @brief pthread_key destructor: fold an exiting thread's block into the retired totals.
+ */
+static void retire_block(void * block_param) {
+  struct stats_block * block = (struct stats_block * ) block_param;
+  pthread_mutex_lock( & blocks_lock);
+  LIST_REMOVE(block, entries);
+  for (int i = 0; i < STAT_NUM_COUNTERS; i++) {
+    add_relaxed( & retired.counters[i], atomic_load( & block -> counters[i]));
+  }
+  for (int h = 0; h < STAT_NUM_HISTOGRAMS; h++) {
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      add_relaxed( & retired.buckets[h][b], atomic_load( & block -> buckets[h][b]));
+    }
+  }
+  pthread_mutex_unlock( & blocks_lock);
+  free(block);
+}
+
+static void create_block_key(void) {
+  pthread_key_create( & block_key, retire_block);
+}
+
+static struct stats_block * get_block(void) {
+  if (local_block == NULL) {
+    pthread_once( & block_key_once, create_block_key);
+    local_block = (struct stats_block * ) calloc(1, sizeof(struct stats_block));
+    if (local_block == NULL) {
+      return & retired; // out of memory: lose the sample rather than fail the request
+    }
+    pthread_mutex_lock( & blocks_lock);
+    LIST_INSERT_HEAD( & blocks, local_block, entries);
+    pthread_mutex_unlock( & blocks_lock);
+    pthread_setspecific(block_key, local_block);
+  }
+  return local_block;
+}
+
+void stats_add(enum stats_counter counter, uint64_t n) {
+  struct stats_block * block = get_block();
+  if (block == & retired) {
+    return;
+  }
+  add_relaxed( & block -> counters[counter], n);
+}
+
+void stats_record_latency(enum stats_histogram histogram, uint64_t ns) {
+  struct stats_block * block = get_block();
+  if (block == & retired) {
+    return;
+  }
+  int bucket = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+  if (bucket >= STATS_BUCKETS) {
+    bucket = STATS_BUCKETS - 1;
+  }
+  add_relaxed( & block -> buckets[histogram][bucket], 1);
+}
+
+uint64_t stats_total(enum stats_counter counter) {
+  struct stats_block * block;
+  pthread_mutex_lock( & blocks_lock);
+  uint64_t total = atomic_load_explicit( & retired.counters[counter], memory_order_relaxed);
+  LIST_FOREACH(block, & blocks, entries) {
+    total += atomic_load_explicit( & block -> counters[counter], memory_order_relaxed);
+  }
+  pthread_mutex_unlock( & blocks_lock);
+  return total;
+}
+
+uint64_t stats_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, & ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Upper bound in microseconds of the bucket holding the p-th sample.
+ */
+static double bucket_percentile_us(const unsigned long long * buckets, unsigned long long count, double p) {
+  unsigned long long rank = (unsigned long long)(p * count);
+  unsigned long long seen = 0;
+  for (int b = 0; b < STATS_BUCKETS; b++) {
+    seen += buckets[b];
+    if (seen > rank) {
+      return (double)(1ULL << (b + 1)) / 1000.0;
+    }
+  }
+  return 0;
+}
+
+size_t stats_format(char * buf, size_t cap) {
+  unsigned long long counters[STAT_NUM_COUNTERS] = {0};
+  unsigned long long buckets[STAT_NUM_HISTOGRAMS][STATS_BUCKETS] = {{0}};
+  int threads = 0;
+  struct stats_block * block;
+
+  pthread_mutex_lock( & blocks_lock);
+  for (int i = 0; i < STAT_NUM_COUNTERS; i++) {
+    counters[i] = atomic_load_explicit( & retired.counters[i], memory_order_relaxed);
+  }
+  for (int h = 0; h < STAT_NUM_HISTOGRAMS; h++) {
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      buckets[h][b] = atomic_load_explicit( & retired.buckets[h][b], memory_order_relaxed);
+    }
+  }
+  LIST_FOREACH(block, & blocks, entries) {
+    threads++;
+    for (int i = 0; i < STAT_NUM_COUNTERS; i++) {
+      counters[i] += atomic_load_explicit( & block -> counters[i], memory_order_relaxed);
+    }
+    for (int h = 0; h < STAT_NUM_HISTOGRAMS; h++) {
+      for (int b = 0; b < STATS_BUCKETS; b++) {
+        buckets[h][b] += atomic_load_explicit( & block -> buckets[h][b], memory_order_relaxed);
+      }
+    }
+  }
+  pthread_mutex_unlock( & blocks_lock);
+
+  size_t len = 0;
+  #define STATS_APPEND(...) \
+    do { \
+      if (len < cap) { \
+        int n = snprintf(buf + len, cap - len, __VA_ARGS__); \
+        len += n > 0 ? (size_t) n : 0; \
+      } \
+    } while (0)
+
+  // Threads update their blocks without a barrier, so "closed" may briefly run ahead of "accepted"
+  unsigned long long active = counters[STAT_CONNECTIONS_ACCEPTED] > counters[STAT_CONNECTIONS_CLOSED] ?
+    counters[STAT_CONNECTIONS_ACCEPTED] - counters[STAT_CONNECTIONS_CLOSED] : 0;
+  STATS_APPEND("connections_active %llu\n", active);
+  for (int i = 0; i < STAT_NUM_COUNTERS; i++) {
+    STATS_APPEND("%s %llu\n", counter_names[i], counters[i]);
+  }
+  STATS_APPEND("replay_bytes %llu\n", counters[STAT_REPLAY_ZERO_COPY_BYTES] + counters[STAT_REPLAY_COPIED_BYTES] +
+    counters[STAT_REPLAY_CACHE_BYTES]);
+  STATS_APPEND("compression_ratio %.3f\n", counters[STAT_COMPRESS_OUT_BYTES] ?
+    (double) counters[STAT_COMPRESS_IN_BYTES] / counters[STAT_COMPRESS_OUT_BYTES] : 0.0);
+  // bytes per ns * 1000 = MB/s
+  STATS_APPEND("decompress_mb_per_s %.1f\n", counters[STAT_DECOMPRESS_NS] ?
+    (double) counters[STAT_DECOMPRESSED_BYTES] * 1000.0 / counters[STAT_DECOMPRESS_NS] : 0.0);
+  // Producers count before they push, so the difference is the queue depth plus pushes about to happen
+  STATS_APPEND("writer_queue_depth %llu\n", counters[STAT_WRITER_QUEUED] > counters[STAT_WRITER_BATCHED_RECORDS] ?
+    counters[STAT_WRITER_QUEUED] - counters[STAT_WRITER_BATCHED_RECORDS] : 0);
+  STATS_APPEND("writer_batch_avg %.2f\n", counters[STAT_WRITER_BATCHES] ?
+    (double) counters[STAT_WRITER_BATCHED_RECORDS] / counters[STAT_WRITER_BATCHES] : 0.0);
+  STATS_APPEND("frame_ack_batch_avg %.2f\n", counters[STAT_FRAME_ACKS] ?
+    (double) counters[STAT_RECORDS] / counters[STAT_FRAME_ACKS] : 0.0);
+  STATS_APPEND("pool_hit_rate %.3f\n", counters[STAT_POOL_HITS] + counters[STAT_POOL_MISSES] ?
+    (double) counters[STAT_POOL_HITS] / (counters[STAT_POOL_HITS] + counters[STAT_POOL_MISSES]) : 0.0);
+  STATS_APPEND("pool_bytes_in_use %llu\n", (unsigned long long) buffer_pool_in_use());
+  STATS_APPEND("pool_peak_bytes %llu\n", (unsigned long long) buffer_pool_peak());
+  STATS_APPEND("stats_threads %d\n", threads);
+  for (int h = 0; h < STAT_NUM_HISTOGRAMS; h++) {
+    unsigned long long count = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      count += buckets[h][b];
+    }
+    STATS_APPEND("%s_count %llu\n", histogram_names[h], count);
+    if (count == 0) {
+      continue;
+    }
+    STATS_APPEND("%s_p50_us %.3f\n", histogram_names[h], bucket_percentile_us(buckets[h], count, 0.50));
+    STATS_APPEND("%s_p99_us %.3f\n", histogram_names[h], bucket_percentile_us(buckets[h], count, 0.99));
+    STATS_APPEND("%s_p999_us %.3f\n", histogram_names[h], bucket_percentile_us(buckets[h], count, 0.999));
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      if (buckets[h][b] != 0) {
+        // Bucket b holds samples below 2^(b+1) ns
+        STATS_APPEND("%s_bucket_le_ns %llu %llu\n", histogram_names[h], 1ULL << (b + 1), buckets[h][b]);
+      }
+    }
+  }
+  STATS_APPEND("\n");
+  #undef STATS_APPEND
+  if (len >= cap) {
+    len = cap > 0 ? cap - 1 : 0;
+  }
+  return len;
+}
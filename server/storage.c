@@ -0,0 +1,1330 @@
+/*
+Author: Visweshwaran Baskaran
+File name: storage.c
+File description:
+Append-only storage for the aesdsocket file backend. The data file is opened once and every thread appends
+through the same descriptor: a writer claims [start, start + len) with an atomic fetch-add on the reserved
+end, pwrite()s its record there concurrently with other writers, then publishes it by advancing the
+committed end once all earlier reservations are published. Readers only need the committed length, so no
+lock is held across writes or replays.
+In durable mode a syncer thread group-commits the log: once records are pending it waits for the commit
+window (a time and/or byte budget), syncs everything published so far with one fdatasync() and wakes every
+writer it covered. Writers arriving while a sync runs are picked up by the next one, so under load the
+number of syncs follows the window, not the number of records.
+With '-g' the log is split into fixed-size segment files PATH.<index> listed by a small manifest; log offsets
+stay global (segment index = offset / segment size) so every replay path streams the segments in order.
+Retention drops whole segments from the front, one unlink() each, instead of rewriting the log. Every
+access to a segment file pins it, so a segment dropped while a replay or sync is still using it is only
+closed once the last user unpins it.
+With '-w' connection threads do not write at all: storage_append() links the record into a lock-free
+multi-producer/single-consumer queue (an intrusive Vyukov queue, one exchange per push) and sleeps until a
+writer thread has stored it. The writer drains the queue in arrival order, reserves one range for the whole
+batch and writes it with a single pwritev(), so N concurrent small appends cost one system call.
+With '-z' a compressor thread rewrites every sealed segment, once all of its bytes are committed, as zlib
+blocks (segment_codec.c) and swaps the compressed file into the table; replays of it inflate one block at a
+time, or copy from a bounded LRU of fully decompressed hot segments.
+References:
+[1] Linux manual pages https://man7.org/linux/man-pages/man2/pwrite.2.html
+[2] C11 atomics https://en.cppreference.com/w/c/atomic
+[3] Linux manual pages https://man7.org/linux/man-pages/man2/fdatasync.2.html
+[4] Linux manual pages https://man7.org/linux/man-pages/man2/rename.2.html
+[5] Linux manual pages https://man7.org/linux/man-pages/man2/pwritev.2.html
+[6] Vyukov intrusive MPSC queue https://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+[7] queue.h leveraged from: https://raw.githubusercontent.com/freebsd/freebsd/stable/10/sys/sys/queue.h
+ */
+
+#include "includes/queue.h"
+#include "includes/aesdsocket.h"
+#include "includes/storage.h"
+#include "includes/replay_cache.h"
+#include "includes/segment_codec.h"
+#include "includes/stats.h"
+#include <syslog.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#define MAX_SYNC_LISTENERS 64 // eventfds notified after each sync, one per io_uring ring
+#define SEGMENT_TABLE_INITIAL 16 // live segments the table holds before it grows
+#define MANIFEST_SUFFIX ".manifest"
+// log_path, a dot, an index of up to 20 characters and CODEC_SUFFIX; the manifest's temporary name fits as well
+#define SEGMENT_NAME_MAX (PATH_MAX + 1 + 20 + sizeof(CODEC_SUFFIX))
+#define WRITER_BATCH_MAX 256 // records the writer thread stores with one pwritev()
+#define COMPRESSOR_POLL_NS (100 * 1000000ULL) // recheck interval while a sealed segment still has writes in flight
+
+struct log_segment {
+  long long index;
+  int fd;
+  atomic_int refs; // the segment table's reference while the segment is live, plus one per pin
+  atomic_int holds; // storage_hold() calls: retention drops neither this segment nor any later one
+  time_t sealed_at; // when the next segment was started, 0 for the active one
+  bool compressed; // fd is the CODEC_SUFFIX file, read through storage_read()
+  off_t * block_index; // compressed: file offset of every block
+  char * hot; // compressed: whole decompressed segment while it is in the hot cache
+  TAILQ_ENTRY(log_segment) hot_entries;
+};
+
+/**
+ * Live segments [first, next), kept in a ring indexed by segment number so lookups and drops are O(1).
+ * Pins take the lock shared; creating and dropping segments take it exclusive.
+ */
+struct segment_table {
+  pthread_rwlock_t lock;
+  struct log_segment ** ring;
+  size_t capacity;
+  long long first;
+  long long next;
+};
+
+static struct segment_table segments;
+static char log_path[PATH_MAX];
+/**
+ * Segment size, 0 when the log is the single unbounded file at log_path
+ */
+static size_t segment_bytes = 0;
+static uint64_t retain_bytes = 0;
+static uint64_t retain_seconds = 0;
+/**
+ * Log offset of the oldest byte still retained
+ */
+static atomic_llong first_offset = 0;
+
+/**
+ * Background compression of sealed segments, only used when enabled
+ */
+struct compressor {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // signalled when a segment is sealed
+  bool running;
+  int level;
+};
+
+static struct compressor compressor;
+static bool compression = false;
+
+/**
+ * LRU of decompressed segments, least recently used first
+ */
+struct hot_cache {
+  pthread_mutex_t lock;
+  TAILQ_HEAD(hot_list, log_segment) segments;
+  size_t bytes;
+  size_t cap;
+};
+
+/**
+ * Last block a thread inflated: consecutive replay chunks smaller than a block (io_uring's registered
+ * buffers) decode it once. Compressed segments never change, so the segment index identifies the data.
+ */
+struct decoded_block {
+  long long segment;
+  size_t block;
+  ssize_t len;
+  char data[CODEC_BLOCK_BYTES];
+};
+
+static pthread_key_t decoded_key; // per-thread struct decoded_block, allocated on its first compressed read, freed when the thread exits
+static bool decoded_key_created = false;
+
+static struct hot_cache hot_cache = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .segments = TAILQ_HEAD_INITIALIZER(hot_cache.segments),
+  .bytes = 0,
+  .cap = 0,
+};
+/**
+ * End of the last reserved byte range; new records are placed here
+ */
+static atomic_llong reserved_end = 0;
+/**
+ * Every byte before this offset has been written
+ */
+static atomic_llong committed_end = 0;
+
+/**
+ * Group commit state, only used in durable mode
+ */
+struct syncer {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t sync_needed; // signalled by writers waiting for durability
+  pthread_cond_t sync_done; // broadcast after every fdatasync()
+  bool running;
+  uint64_t window_ns;
+  size_t window_bytes;
+  int listeners[MAX_SYNC_LISTENERS];
+  int num_listeners;
+};
+
+static struct syncer syncer;
+static bool durable = false;
+/**
+ * Every byte before this offset has been fdatasync()ed
+ */
+static atomic_llong synced_end = 0;
+
+/**
+ * One pending append, on the stack of the connection thread waiting for it
+ */
+struct append_request {
+  _Atomic(struct append_request * ) next;
+  const char * buf;
+  size_t len;
+  off_t end; // set by the writer: log offset one past the record
+  int result;
+  sem_t done; // posted by the writer once end and result are set; only the owner waits on it
+};
+
+/**
+ * Writer thread state, only used with '-w'. head is only touched by the writer thread; producers only
+ * exchange tail. stub keeps the queue non-empty so a push never has to update head.
+ */
+struct writer {
+  pthread_t thread;
+  _Atomic(struct append_request * ) tail;
+  struct append_request * head;
+  struct append_request stub;
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // signalled by a producer that finds the writer asleep
+  atomic_bool sleeping;
+  bool running;
+};
+
+static struct writer writer;
+static bool writer_enabled = false;
+
+/**
+ * @brief Name of a segment file: log_path itself for an unsegmented log, log_path.<index>[.z] otherwise.
+ * @return 0, or -1 if the name does not fit in size bytes: a truncated name would be another file
+ */
+static int segment_name(long long index, bool compressed, char * name, size_t size) {
+  int len;
+  if (segment_bytes == 0) {
+    len = snprintf(name, size, "%s", log_path);
+  } else {
+    len = snprintf(name, size, "%s.%010lld%s", log_path, index, compressed ? CODEC_SUFFIX : "");
+  }
+  if (len < 0 || (size_t) len >= size) {
+    syslog(LOG_ERR, "Name of segment %lld does not fit in %zu bytes", index, size);
+    return -1;
+  }
+  return 0;
+}
+
+static struct log_segment * open_segment(long long index, bool compressed, int flags) {
+  char name[SEGMENT_NAME_MAX];
+  if (segment_name(index, compressed, name, sizeof(name)) != 0) {
+    return NULL;
+  }
+  struct log_segment * seg = (struct log_segment * ) calloc(1, sizeof(struct log_segment));
+  if (seg == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    return NULL;
+  }
+  seg -> fd = open(name, (compressed ? O_RDONLY : O_RDWR) | O_CLOEXEC | flags, 0664);
+  if (seg -> fd == SYSCALL_ERROR) {
+    syslog(LOG_ERR, "Open of %s failed: %s", name, strerror(errno));
+    perror("open");
+    free(seg);
+    return NULL;
+  }
+  // Only sealed segments are compressed, and a sealed segment is always segment_bytes long
+  if (compressed && (seg -> block_index = codec_load_index(seg -> fd, segment_bytes)) == NULL) {
+    close(seg -> fd);
+    free(seg);
+    return NULL;
+  }
+  seg -> index = index;
+  seg -> compressed = compressed;
+  atomic_init( & seg -> refs, 1);
+  atomic_init( & seg -> holds, 0);
+  return seg;
+}
+
+/**
+ * @brief Append a segment at the end of the table, growing the ring when it is full. Caller holds the lock exclusive.
+ * @return 0 on success, -1 on allocation failure
+ */
+static int table_push(struct log_segment * seg) {
+  if ((size_t)(segments.next - segments.first) == segments.capacity) {
+    size_t capacity = segments.capacity * 2;
+    struct log_segment ** ring = (struct log_segment ** ) calloc(capacity, sizeof(struct log_segment * ));
+    if (ring == NULL) {
+      syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+      return -1;
+    }
+    for (long long index = segments.first; index < segments.next; index++) {
+      ring[index % capacity] = segments.ring[index % segments.capacity];
+    }
+    free(segments.ring);
+    segments.ring = ring;
+    segments.capacity = capacity;
+  }
+  segments.ring[seg -> index % segments.capacity] = seg;
+  segments.next = seg -> index + 1;
+  return 0;
+}
+
+/**
+ * @brief Pin a live segment by index.
+ * @return The segment, or NULL if it was dropped or does not exist yet
+ */
+static struct log_segment * pin_index(long long index) {
+  struct log_segment * seg = NULL;
+  pthread_rwlock_rdlock( & segments.lock);
+  if (index >= segments.first && index < segments.next) {
+    seg = segments.ring[index % segments.capacity];
+    atomic_fetch_add_explicit( & seg -> refs, 1, memory_order_relaxed);
+  }
+  pthread_rwlock_unlock( & segments.lock);
+  return seg;
+}
+
+void storage_unpin(struct log_segment * seg) {
+  if (atomic_fetch_sub_explicit( & seg -> refs, 1, memory_order_acq_rel) == 1) {
+    // Eviction by hot_cache_read() may unlink and free the image concurrently: seg->hot is only read locked
+    pthread_mutex_lock( & hot_cache.lock);
+    char * hot = seg -> hot;
+    if (hot != NULL) {
+      TAILQ_REMOVE( & hot_cache.segments, seg, hot_entries);
+      hot_cache.bytes -= segment_bytes;
+      seg -> hot = NULL;
+    }
+    pthread_mutex_unlock( & hot_cache.lock);
+    free(hot);
+    close(seg -> fd);
+    free(seg -> block_index);
+    free(seg);
+  }
+}
+
+/**
+ * @brief Rewrite the manifest (segment size and the live index range) atomically with rename(). Caller holds the lock exclusive.
+ */
+static void write_manifest(void) {
+  char name[SEGMENT_NAME_MAX];
+  char tmp_name[SEGMENT_NAME_MAX];
+  snprintf(name, sizeof(name), "%s" MANIFEST_SUFFIX, log_path);
+  snprintf(tmp_name, sizeof(tmp_name), "%s" MANIFEST_SUFFIX ".tmp", log_path);
+  FILE * manifest = fopen(tmp_name, "we");
+  if (manifest == NULL) {
+    syslog(LOG_ERR, "Open of %s failed: %s", tmp_name, strerror(errno));
+    return;
+  }
+  fprintf(manifest, "segment_bytes %zu\nfirst %lld\nnext %lld\n", segment_bytes, segments.first, segments.next);
+  if (fflush(manifest) != 0 || fsync(fileno(manifest)) == SYSCALL_ERROR) {
+    syslog(LOG_ERR, "Manifest write failed: %s", strerror(errno));
+  }
+  fclose(manifest);
+  if (rename(tmp_name, name) == SYSCALL_ERROR) {
+    syslog(LOG_ERR, "Manifest rename failed: %s", strerror(errno));
+  }
+}
+
+/**
+ * @brief Drop the oldest sealed segments beyond the retention limits. Caller holds the lock exclusive.
+ * @return true if a segment was dropped
+ */
+static bool trim_locked(void) {
+  bool dropped = false;
+  off_t committed = storage_committed();
+  time_t now = time(NULL);
+  while (segments.first < segments.next - 1) {
+    struct log_segment * seg = segments.ring[segments.first % segments.capacity];
+    off_t end = (off_t)(segments.first + 1) * segment_bytes;
+    // Only whole segments that readers may already have been sent are dropped, never the active one
+    if (end > committed) {
+      break;
+    }
+    bool over_bytes = retain_bytes > 0 && (uint64_t)(committed - end) >= retain_bytes;
+    bool too_old = retain_seconds > 0 && seg -> sealed_at != 0 && (uint64_t)(now - seg -> sealed_at) >= retain_seconds;
+    if ((!over_bytes && !too_old) || atomic_load( & seg -> holds) > 0) {
+      break;
+    }
+    char name[SEGMENT_NAME_MAX];
+    if (segment_name(seg -> index, seg -> compressed, name, sizeof(name)) == 0 && unlink(name) == SYSCALL_ERROR) {
+      syslog(LOG_ERR, "unlink of %s failed: %s", name, strerror(errno));
+    }
+    segments.ring[segments.first % segments.capacity] = NULL;
+    segments.first++;
+    atomic_store( & first_offset, end);
+    storage_unpin(seg); // closed now, or by the last reader still using it
+    stats_add(STAT_SEGMENTS_DROPPED, 1);
+    dropped = true;
+  }
+  return dropped;
+}
+
+/**
+ * @brief Create the segments up to and including index, sealing the previous active one.
+ * @return 0 on success, -1 on failure
+ */
+static int extend_log(long long index) {
+  int retval = 0;
+  pthread_rwlock_wrlock( & segments.lock);
+  while (segments.next <= index) {
+    struct log_segment * seg = open_segment(segments.next, false, O_CREAT | O_TRUNC);
+    if (seg == NULL) {
+      retval = -1;
+      break;
+    }
+    if (segments.next > segments.first) {
+      segments.ring[(segments.next - 1) % segments.capacity] -> sealed_at = time(NULL);
+      if (compression) {
+        pthread_mutex_lock( & compressor.lock);
+        pthread_cond_signal( & compressor.wake);
+        pthread_mutex_unlock( & compressor.lock);
+      }
+    }
+    if (table_push(seg) != 0) {
+      storage_unpin(seg);
+      retval = -1;
+      break;
+    }
+  }
+  trim_locked();
+  write_manifest();
+  pthread_rwlock_unlock( & segments.lock);
+  return retval;
+}
+
+struct log_segment * storage_pin(off_t offset, bool create, off_t * file_offset, off_t * span) {
+  long long index = segment_bytes == 0 ? 0 : offset / (off_t) segment_bytes;
+  struct log_segment * seg = pin_index(index);
+  if (seg == NULL && create && extend_log(index) == 0) {
+    seg = pin_index(index);
+  }
+  if (seg != NULL) {
+    * file_offset = segment_bytes == 0 ? offset : offset % (off_t) segment_bytes;
+    * span = segment_bytes == 0 ? LLONG_MAX - offset : (off_t) segment_bytes - * file_offset;
+  }
+  return seg;
+}
+
+struct log_segment * storage_hold(off_t * offset) {
+  if (segment_bytes == 0) {
+    return NULL; // the single file is never trimmed
+  }
+  struct log_segment * seg = NULL;
+  // Shared with pins, exclusive with trim_locked(): the offset cannot be dropped between the check and the hold
+  pthread_rwlock_rdlock( & segments.lock);
+  if ( * offset < storage_first()) {
+    * offset = storage_first();
+  }
+  long long index = * offset / (off_t) segment_bytes;
+  if (index >= segments.first && index < segments.next) {
+    seg = segments.ring[index % segments.capacity];
+    atomic_fetch_add_explicit( & seg -> refs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit( & seg -> holds, 1, memory_order_relaxed);
+  }
+  pthread_rwlock_unlock( & segments.lock);
+  return seg;
+}
+
+void storage_release(struct log_segment * seg) {
+  if (seg != NULL) {
+    atomic_fetch_sub_explicit( & seg -> holds, 1, memory_order_relaxed);
+    storage_unpin(seg);
+  }
+}
+
+int storage_segment_fd(const struct log_segment * seg) {
+  return seg -> compressed ? -1 : seg -> fd;
+}
+
+/**
+ * @brief Copy [file_offset, file_offset + len) of a compressed segment from the hot cache, inflating the whole
+ * segment into it on a miss.
+ * @return true if the bytes were copied, false if the cache is disabled or the segment could not be inflated
+ */
+static bool hot_cache_read(struct log_segment * seg, char * buf, size_t len, off_t file_offset) {
+  if (hot_cache.cap < segment_bytes) {
+    return false;
+  }
+  pthread_mutex_lock( & hot_cache.lock);
+  if (seg -> hot != NULL) {
+    memcpy(buf, seg -> hot + file_offset, len);
+    TAILQ_REMOVE( & hot_cache.segments, seg, hot_entries);
+    TAILQ_INSERT_TAIL( & hot_cache.segments, seg, hot_entries);
+    pthread_mutex_unlock( & hot_cache.lock);
+    stats_add(STAT_HOT_CACHE_HIT_BYTES, len);
+    return true;
+  }
+  pthread_mutex_unlock( & hot_cache.lock);
+
+  char * image = (char * ) malloc(segment_bytes);
+  if (image == NULL) {
+    return false;
+  }
+  uint64_t start_ns = stats_now_ns();
+  for (size_t block = 0; block * CODEC_BLOCK_BYTES < segment_bytes; block++) {
+    if (codec_read_block(seg -> fd, seg -> block_index, segment_bytes, block, image + block * CODEC_BLOCK_BYTES) < 0) {
+      free(image);
+      return false;
+    }
+  }
+  stats_add(STAT_DECOMPRESS_NS, stats_now_ns() - start_ns);
+  stats_add(STAT_DECOMPRESSED_BYTES, segment_bytes);
+
+  pthread_mutex_lock( & hot_cache.lock);
+  if (seg -> hot == NULL) {
+    seg -> hot = image;
+    TAILQ_INSERT_TAIL( & hot_cache.segments, seg, hot_entries);
+    hot_cache.bytes += segment_bytes;
+    struct log_segment * victim;
+    while (hot_cache.bytes > hot_cache.cap && (victim = TAILQ_FIRST( & hot_cache.segments)) != seg) {
+      TAILQ_REMOVE( & hot_cache.segments, victim, hot_entries);
+      hot_cache.bytes -= segment_bytes;
+      free(victim -> hot);
+      victim -> hot = NULL;
+    }
+  } else {
+    free(image); // another reader inflated it meanwhile
+  }
+  memcpy(buf, seg -> hot + file_offset, len);
+  pthread_mutex_unlock( & hot_cache.lock);
+  return true;
+}
+
+ssize_t storage_read(struct log_segment * seg, char * buf, size_t len, off_t file_offset) {
+  if (!seg -> compressed) {
+    ssize_t bytes_read;
+    do {
+      bytes_read = pread(seg -> fd, buf, len, file_offset);
+    } while (bytes_read == SYSCALL_ERROR && errno == EINTR);
+    return bytes_read;
+  }
+  if (file_offset >= (off_t) segment_bytes) {
+    return 0;
+  }
+  // Never past the block holding file_offset, so the next read starts block aligned
+  size_t block = file_offset / CODEC_BLOCK_BYTES;
+  size_t in_block = file_offset % CODEC_BLOCK_BYTES;
+  size_t block_len = segment_bytes - block * CODEC_BLOCK_BYTES;
+  if (block_len > CODEC_BLOCK_BYTES) {
+    block_len = CODEC_BLOCK_BYTES;
+  }
+  if (len > block_len - in_block) {
+    len = block_len - in_block;
+  }
+  if (hot_cache_read(seg, buf, len, file_offset)) {
+    return len;
+  }
+  struct decoded_block * decoded = (struct decoded_block * ) pthread_getspecific(decoded_key);
+  if (decoded == NULL) {
+    decoded = (struct decoded_block * ) malloc(sizeof(struct decoded_block));
+    if (decoded == NULL || pthread_setspecific(decoded_key, decoded) != 0) {
+      syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+      free(decoded);
+      errno = ENOMEM;
+      return SYSCALL_ERROR;
+    }
+    decoded -> segment = -1;
+  }
+  if (decoded -> segment != seg -> index || decoded -> block != block) {
+    uint64_t start_ns = stats_now_ns();
+    decoded -> segment = -1;
+    decoded -> len = codec_read_block(seg -> fd, seg -> block_index, segment_bytes, block, decoded -> data);
+    if (decoded -> len < 0) {
+      errno = EIO;
+      return SYSCALL_ERROR;
+    }
+    stats_add(STAT_DECOMPRESS_NS, stats_now_ns() - start_ns);
+    stats_add(STAT_DECOMPRESSED_BYTES, decoded -> len);
+    decoded -> segment = seg -> index;
+    decoded -> block = block;
+  }
+  memcpy(buf, decoded -> data + in_block, len);
+  return len;
+}
+
+/**
+ * @brief Rewrite one sealed, fully committed segment as a compressed file and swap it into the table.
+ */
+static void compress_segment(long long index) {
+  struct log_segment * raw = pin_index(index);
+  if (raw == NULL || raw -> compressed) {
+    if (raw != NULL) {
+      storage_unpin(raw);
+    }
+    return; // dropped by retention, or compressed by an earlier run
+  }
+  char name[SEGMENT_NAME_MAX];
+  char tmp_name[SEGMENT_NAME_MAX + sizeof(".tmp")];
+  char raw_name[SEGMENT_NAME_MAX];
+  if (segment_name(index, true, name, sizeof(name)) != 0 || segment_name(index, false, raw_name, sizeof(raw_name)) != 0) {
+    storage_unpin(raw);
+    return;
+  }
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+  int out_fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+  if (out_fd == SYSCALL_ERROR) {
+    syslog(LOG_ERR, "Open of %s failed: %s", tmp_name, strerror(errno));
+    storage_unpin(raw);
+    return;
+  }
+  off_t packed_len = codec_compress_file(raw -> fd, segment_bytes, out_fd, compressor.level);
+  // The raw file is deleted once the compressed one replaces it, so it must be on disk first
+  bool written = packed_len >= 0 && fdatasync(out_fd) == 0;
+  close(out_fd);
+  struct log_segment * packed = NULL;
+  if (!written || rename(tmp_name, name) == SYSCALL_ERROR || (packed = open_segment(index, true, 0)) == NULL) {
+    syslog(LOG_ERR, "Compression of segment %lld failed, keeping it uncompressed", index);
+    unlink(tmp_name);
+    unlink(name);
+    storage_unpin(raw);
+    return;
+  }
+  packed -> sealed_at = raw -> sealed_at;
+  bool swapped = false;
+  pthread_rwlock_wrlock( & segments.lock);
+  if (index >= segments.first && index < segments.next && segments.ring[index % segments.capacity] == raw) {
+    segments.ring[index % segments.capacity] = packed;
+    swapped = true;
+  }
+  pthread_rwlock_unlock( & segments.lock);
+  if (swapped) {
+    unlink(raw_name);
+    storage_unpin(raw); // the table's reference, readers still using the raw file keep it open
+    stats_add(STAT_COMPRESS_IN_BYTES, segment_bytes);
+    stats_add(STAT_COMPRESS_OUT_BYTES, packed_len);
+  } else {
+    unlink(name);
+    storage_unpin(packed);
+  }
+  storage_unpin(raw);
+}
+
+/**
+ * @brief Compressor thread: compress sealed segments in order once every write into them has been published.
+ * @return NULL
+ */
+static void * compressor_thread(void * unused) {
+  (void) unused;
+  long long next_index = 0;
+  pthread_mutex_lock( & compressor.lock);
+  while (compressor.running) {
+    pthread_mutex_unlock( & compressor.lock);
+    pthread_rwlock_rdlock( & segments.lock);
+    if (next_index < segments.first) {
+      next_index = segments.first;
+    }
+    long long active = segments.next - 1;
+    pthread_rwlock_unlock( & segments.lock);
+    bool ready = next_index < active && (off_t)(next_index + 1) * (off_t) segment_bytes <= storage_committed();
+    if (ready) {
+      compress_segment(next_index++);
+    }
+    pthread_mutex_lock( & compressor.lock);
+    if (!ready && compressor.running) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, & deadline);
+      deadline.tv_sec += (deadline.tv_nsec + COMPRESSOR_POLL_NS) / 1000000000ULL;
+      deadline.tv_nsec = (deadline.tv_nsec + COMPRESSOR_POLL_NS) % 1000000000ULL;
+      pthread_cond_timedwait( & compressor.wake, & compressor.lock, & deadline);
+    }
+  }
+  pthread_mutex_unlock( & compressor.lock);
+  return NULL;
+}
+
+int storage_enable_compression(int level, size_t hot_cache_bytes) {
+  if (segment_bytes == 0) {
+    syslog(LOG_ERR, "Compression needs a segmented log");
+    return -1;
+  }
+  pthread_condattr_t attr;
+  pthread_condattr_init( & attr);
+  pthread_condattr_setclock( & attr, CLOCK_MONOTONIC);
+  pthread_mutex_init( & compressor.lock, NULL);
+  pthread_cond_init( & compressor.wake, & attr);
+  pthread_condattr_destroy( & attr);
+  compressor.level = level;
+  compressor.running = true;
+  hot_cache.cap = hot_cache_bytes;
+  if (pthread_create( & compressor.thread, NULL, compressor_thread, NULL) != 0) {
+    perror("pthread_create");
+    pthread_cond_destroy( & compressor.wake);
+    pthread_mutex_destroy( & compressor.lock);
+    return -1;
+  }
+  compression = true;
+  if (hot_cache_bytes > 0 && hot_cache_bytes < segment_bytes) {
+    syslog(LOG_WARNING, "Hot segment cache of %zu bytes cannot hold one %zu byte segment, disabled", hot_cache_bytes, segment_bytes);
+  }
+  syslog(LOG_INFO, "Compressing sealed segments with zlib level %d, hot cache %zu bytes", level, hot_cache_bytes);
+  return 0;
+}
+
+/**
+ * @brief Reopen the segments listed by an existing manifest, or start an empty segmented log.
+ * @param end Set to the log offset appending resumes at.
+ * @return 0 on success, -1 on failure
+ */
+static int load_manifest(off_t * end) {
+  char name[SEGMENT_NAME_MAX];
+  snprintf(name, sizeof(name), "%s" MANIFEST_SUFFIX, log_path);
+  segments.first = 0;
+  segments.next = 0;
+  * end = 0;
+  FILE * manifest = fopen(name, "re");
+  if (manifest == NULL) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    syslog(LOG_ERR, "Open of %s failed: %s", name, strerror(errno));
+    return -1;
+  }
+  size_t manifest_segment_bytes;
+  long long first;
+  long long next;
+  int fields = fscanf(manifest, "segment_bytes %zu first %lld next %lld", & manifest_segment_bytes, & first, & next);
+  fclose(manifest);
+  if (fields != 3 || first < 0 || next < first) {
+    syslog(LOG_ERR, "Malformed manifest %s", name);
+    return -1;
+  }
+  if (manifest_segment_bytes != segment_bytes) {
+    syslog(LOG_ERR, "%s was written with %zu byte segments, not %zu", name, manifest_segment_bytes, segment_bytes);
+    return -1;
+  }
+  segments.first = first;
+  segments.next = first;
+  * end = (off_t) first * segment_bytes;
+  for (long long index = first; index < next; index++) {
+    struct stat st;
+    char raw_name[SEGMENT_NAME_MAX];
+    char packed_name[SEGMENT_NAME_MAX];
+    if (segment_name(index, false, raw_name, sizeof(raw_name)) != 0 || segment_name(index, true, packed_name, sizeof(packed_name)) != 0) {
+      return -1;
+    }
+    // The raw file is only deleted after its compressed copy is complete, so if both exist the raw one wins
+    bool compressed = access(raw_name, F_OK) != 0 && access(packed_name, F_OK) == 0;
+    if (!compressed) {
+      unlink(packed_name);
+    }
+    struct log_segment * seg = open_segment(index, compressed, 0);
+    if (seg == NULL || table_push(seg) != 0) {
+      return -1;
+    }
+    if (fstat(seg -> fd, & st) == SYSCALL_ERROR) {
+      syslog(LOG_ERR, "fstat failed: %s", strerror(errno));
+      return -1;
+    }
+    seg -> sealed_at = index < next - 1 ? st.st_mtime : 0;
+    * end = (off_t) index * segment_bytes + (compressed ? (off_t) segment_bytes : st.st_size);
+  }
+  return 0;
+}
+
+int storage_open(const char * path, size_t cache_bytes, size_t seg_bytes) {
+  off_t end = 0;
+  if (strlen(path) >= sizeof(log_path)) {
+    syslog(LOG_ERR, "Log path %s is longer than %zu bytes", path, sizeof(log_path) - 1);
+    return -1;
+  }
+  snprintf(log_path, sizeof(log_path), "%s", path);
+  segment_bytes = seg_bytes;
+  // A segmented log may hold compressed segments from an earlier run even without -z
+  if (segment_bytes > 0 && !decoded_key_created) {
+    if (pthread_key_create( & decoded_key, free) != 0) {
+      perror("pthread_key_create");
+      return -1;
+    }
+    decoded_key_created = true;
+  }
+  pthread_rwlock_init( & segments.lock, NULL);
+  segments.capacity = SEGMENT_TABLE_INITIAL;
+  segments.first = 0;
+  segments.next = 0;
+  segments.ring = (struct log_segment ** ) calloc(segments.capacity, sizeof(struct log_segment * ));
+  if (segments.ring == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    storage_close();
+    return -1;
+  }
+  if (segment_bytes == 0) {
+    // Unsegmented: one file, resumed at its current end
+    struct stat st;
+    struct log_segment * seg = open_segment(0, false, O_CREAT);
+    if (seg == NULL || table_push(seg) != 0) {
+      storage_close();
+      return -1;
+    }
+    if (fstat(seg -> fd, & st) == SYSCALL_ERROR) {
+      syslog(LOG_ERR, "fstat failed: %s", strerror(errno));
+      perror("fstat");
+      storage_close();
+      return -1;
+    }
+    end = st.st_size;
+  } else if (load_manifest( & end) != 0) {
+    storage_close();
+    return -1;
+  }
+  atomic_store( & first_offset, (off_t) segments.first * segment_bytes);
+  atomic_store( & reserved_end, end);
+  atomic_store( & committed_end, end);
+  atomic_store( & synced_end, end);
+  if (cache_bytes > 0 && replay_cache_init(cache_bytes, end) != 0) {
+    storage_close();
+    return -1;
+  }
+  if (segment_bytes > 0) {
+    syslog(LOG_INFO, "Segmented log: %zu byte segments, %lld live, resuming at offset %lld", segment_bytes,
+      segments.next - segments.first, (long long) end);
+  }
+  return 0;
+}
+
+void storage_set_retention(uint64_t max_bytes, uint64_t max_seconds) {
+  retain_bytes = max_bytes;
+  retain_seconds = max_seconds;
+}
+
+void storage_trim(void) {
+  if (segment_bytes == 0 || (retain_bytes == 0 && retain_seconds == 0)) {
+    return;
+  }
+  pthread_rwlock_wrlock( & segments.lock);
+  if (trim_locked()) {
+    write_manifest();
+  }
+  pthread_rwlock_unlock( & segments.lock);
+}
+
+off_t storage_first(void) {
+  return atomic_load( & first_offset);
+}
+
+/**
+ * @brief Write iovecs at a log offset, split at segment boundaries and resumed after short writes.
+ * @param iov Consumed: its entries are advanced past the bytes written. At most WRITER_BATCH_MAX, below IOV_MAX.
+ * @return 0 on success, -1 on failure
+ */
+static int write_log(off_t offset, struct iovec * iov, int iovcnt) {
+  while (iovcnt > 0) {
+    if (iov -> iov_len == 0) {
+      iov++;
+      iovcnt--;
+      continue;
+    }
+    off_t file_offset;
+    off_t span;
+    struct log_segment * seg = storage_pin(offset, true, & file_offset, & span);
+    if (seg == NULL) {
+      return -1;
+    }
+    // Only the iovecs that fit in this segment; the one crossing its end is cut short for this call
+    int count = 0;
+    size_t bytes = 0;
+    while (count < iovcnt && bytes + iov[count].iov_len <= (size_t) span) {
+      bytes += iov[count++].iov_len;
+    }
+    size_t cut_len = 0;
+    if (count < iovcnt && bytes < (size_t) span) {
+      cut_len = iov[count].iov_len;
+      iov[count++].iov_len = span - bytes;
+    }
+    ssize_t bytes_written = pwritev(seg -> fd, iov, count, file_offset);
+    if (cut_len > 0) {
+      iov[count - 1].iov_len = cut_len;
+    }
+    storage_unpin(seg);
+    if (bytes_written == SYSCALL_ERROR) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("pwritev");
+      syslog(LOG_ERR, "pwritev failed: %s", strerror(errno));
+      return -1;
+    }
+    offset += bytes_written;
+    while (bytes_written > 0) {
+      if ((size_t) bytes_written >= iov -> iov_len) {
+        bytes_written -= iov -> iov_len;
+        iov++;
+        iovcnt--;
+      } else {
+        iov -> iov_base = (char * ) iov -> iov_base + bytes_written;
+        iov -> iov_len -= bytes_written;
+        bytes_written = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+off_t storage_reserve(size_t len) {
+  return atomic_fetch_add_explicit( & reserved_end, len, memory_order_relaxed);
+}
+
+/**
+ * @brief Publish in reservation order: wait for the writers of every range before start.
+ */
+static void wait_publish_turn(off_t start) {
+  if (atomic_load_explicit( & committed_end, memory_order_acquire) != start) {
+    uint64_t wait_start_ns = stats_now_ns();
+    while (atomic_load_explicit( & committed_end, memory_order_acquire) != start) {
+      sched_yield();
+    }
+    stats_add(STAT_LOCK_WAIT_NS, stats_now_ns() - wait_start_ns);
+  }
+}
+
+void storage_publish(off_t start, const char * buf, size_t len) {
+  wait_publish_turn(start);
+  if (replay_cache_enabled()) {
+    replay_cache_publish(start, buf, len); // only the publishing writer touches the cache
+  }
+  atomic_store_explicit( & committed_end, start + len, memory_order_release);
+}
+
+/**
+ * @brief Producer side of the writer queue: link a request at the tail.
+ */
+static void writer_push(struct append_request * req) {
+  atomic_store_explicit( & req -> next, NULL, memory_order_relaxed);
+  struct append_request * prev = atomic_exchange( & writer.tail, req);
+  atomic_store( & prev -> next, req);
+}
+
+/**
+ * @brief Consumer side of the writer queue, writer thread only.
+ * @return The oldest request, or NULL if the queue is empty or its next push is still being linked
+ */
+static struct append_request * writer_pop(void) {
+  struct append_request * head = writer.head;
+  struct append_request * next = atomic_load( & head -> next);
+  if (head == & writer.stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    writer.head = next;
+    head = next;
+    next = atomic_load( & head -> next);
+  }
+  if (next != NULL) {
+    writer.head = next;
+    return head;
+  }
+  if (head != atomic_load( & writer.tail)) {
+    return NULL;
+  }
+  // head is the last request: put the stub behind it so it can be unlinked
+  writer_push( & writer.stub);
+  next = atomic_load( & head -> next);
+  if (next != NULL) {
+    writer.head = next;
+    return head;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Drain the append queue in batches: one reservation, one pwritev() and one publish per batch.
+ * @return NULL
+ */
+static void * writer_thread(void * unused) {
+  (void) unused;
+  struct append_request * batch[WRITER_BATCH_MAX];
+  struct iovec iov[WRITER_BATCH_MAX];
+  while (1) {
+    int count = 0;
+    size_t len = 0;
+    struct append_request * req;
+    while (count < WRITER_BATCH_MAX && (req = writer_pop()) != NULL) {
+      iov[count].iov_base = (void * ) req -> buf;
+      iov[count].iov_len = req -> len;
+      len += req -> len;
+      batch[count++] = req;
+    }
+    if (count == 0) {
+      pthread_mutex_lock( & writer.lock);
+      atomic_store( & writer.sleeping, true);
+      // A producer that exchanged tail before this check is seen here; one that does so after it sees sleeping
+      bool empty = writer.head == atomic_load( & writer.tail);
+      if (empty && !writer.running) {
+        pthread_mutex_unlock( & writer.lock);
+        break;
+      }
+      if (empty) {
+        pthread_cond_wait( & writer.wake, & writer.lock);
+      }
+      atomic_store( & writer.sleeping, false);
+      pthread_mutex_unlock( & writer.lock);
+      if (!empty) {
+        sched_yield(); // a push is between its exchange and its link
+      }
+      continue;
+    }
+
+    off_t start = storage_reserve(len);
+    // A failed write leaves the range reserved; it is still published so later writers are not blocked forever
+    int result = write_log(start, iov, count);
+    wait_publish_turn(start);
+    off_t end = start;
+    for (int i = 0; i < count; i++) {
+      if (replay_cache_enabled()) {
+        replay_cache_publish(end, batch[i] -> buf, batch[i] -> len);
+      }
+      end += batch[i] -> len;
+    }
+    atomic_store_explicit( & committed_end, end, memory_order_release);
+    stats_add(STAT_WRITER_BATCHES, 1);
+    stats_add(STAT_WRITER_BATCHED_RECORDS, count);
+
+    // Each producer is woken on its own semaphore, so a batch of N wakes N threads instead of every waiter
+    end = start;
+    for (int i = 0; i < count; i++) {
+      end += batch[i] -> len;
+      batch[i] -> end = end;
+      batch[i] -> result = result;
+      sem_post( & batch[i] -> done); // the request may be gone once this returns
+    }
+  }
+  return NULL;
+}
+
+int storage_enable_writer(void) {
+  pthread_mutex_init( & writer.lock, NULL);
+  pthread_cond_init( & writer.wake, NULL);
+  atomic_store( & writer.stub.next, NULL);
+  atomic_store( & writer.tail, & writer.stub);
+  writer.head = & writer.stub;
+  atomic_store( & writer.sleeping, false);
+  writer.running = true;
+  if (pthread_create( & writer.thread, NULL, writer_thread, NULL) != 0) {
+    perror("pthread_create");
+    pthread_cond_destroy( & writer.wake);
+    pthread_mutex_destroy( & writer.lock);
+    return -1;
+  }
+  writer_enabled = true;
+  syslog(LOG_INFO, "Appends go through the writer thread, up to %d records per pwritev()", WRITER_BATCH_MAX);
+  return 0;
+}
+
+int storage_append(const char * buf, size_t len, off_t * end_offset) {
+  if (writer_enabled) {
+    struct append_request req = { .buf = buf, .len = len };
+    sem_init( & req.done, 0, 0);
+    stats_add(STAT_WRITER_QUEUED, 1);
+    writer_push( & req);
+    if (atomic_load( & writer.sleeping)) {
+      pthread_mutex_lock( & writer.lock);
+      pthread_cond_signal( & writer.wake);
+      pthread_mutex_unlock( & writer.lock);
+    }
+    while (sem_wait( & req.done) == SYSCALL_ERROR && errno == EINTR) {
+      // the hot restart drain signal; the record is already queued
+    }
+    sem_destroy( & req.done);
+    if (end_offset != NULL) {
+      * end_offset = req.end;
+    }
+    return req.result;
+  }
+
+  off_t start = storage_reserve(len);
+  struct iovec iov = { .iov_base = (void * ) buf, .iov_len = len };
+  // On failure the range stays reserved; it is still published below so later writers are not blocked forever
+  int retval = write_log(start, & iov, 1);
+  storage_publish(start, buf, len);
+  if (end_offset != NULL) {
+    * end_offset = start + len;
+  }
+  return retval;
+}
+
+int storage_file_fd(void) {
+  return segment_bytes == 0 && segments.next > 0 ? segments.ring[0] -> fd : -1;
+}
+
+off_t storage_committed(void) {
+  return atomic_load_explicit( & committed_end, memory_order_acquire);
+}
+
+/**
+ * @brief fdatasync() every segment holding log bytes [from, to); segments dropped meanwhile are skipped.
+ */
+static void sync_segments(off_t from, off_t to) {
+  long long last = segment_bytes == 0 ? 0 : (to - 1) / (off_t) segment_bytes;
+  for (long long index = segment_bytes == 0 ? 0 : from / (off_t) segment_bytes; index <= last; index++) {
+    struct log_segment * seg = pin_index(index);
+    if (seg == NULL) {
+      continue;
+    }
+    if (!seg -> compressed && fdatasync(seg -> fd) == SYSCALL_ERROR) {
+      perror("fdatasync");
+      syslog(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+    }
+    storage_unpin(seg);
+  }
+}
+
+/**
+ * @brief Syncer thread: wait for pending records, let the commit window fill, then sync them in one call.
+ * @return NULL
+ */
+static void * syncer_thread(void * unused) {
+  (void) unused;
+  pthread_mutex_lock( & syncer.lock);
+  while (syncer.running) {
+    if (storage_committed() == atomic_load( & synced_end)) {
+      pthread_cond_wait( & syncer.sync_needed, & syncer.lock);
+      continue;
+    }
+    // Commit window: give concurrent writers time to join this sync unless enough bytes are already pending
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, & deadline);
+    deadline.tv_sec += (deadline.tv_nsec + syncer.window_ns) / 1000000000ULL;
+    deadline.tv_nsec = (deadline.tv_nsec + syncer.window_ns) % 1000000000ULL;
+    while (syncer.running && syncer.window_ns > 0 &&
+      (syncer.window_bytes == 0 || (size_t)(storage_committed() - atomic_load( & synced_end)) < syncer.window_bytes)) {
+      if (pthread_cond_timedwait( & syncer.sync_needed, & syncer.lock, & deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+    off_t target = storage_committed();
+    off_t synced = atomic_load( & synced_end);
+    pthread_mutex_unlock( & syncer.lock);
+
+    uint64_t sync_start_ns = stats_now_ns();
+    sync_segments(synced, target);
+    stats_record_latency(HIST_SYNC, stats_now_ns() - sync_start_ns);
+    stats_add(STAT_SYNCS, 1);
+    stats_add(STAT_SYNCED_BYTES, target - synced);
+
+    pthread_mutex_lock( & syncer.lock);
+    atomic_store( & synced_end, target);
+    pthread_cond_broadcast( & syncer.sync_done);
+    uint64_t one = 1;
+    for (int i = 0; i < syncer.num_listeners; i++) {
+      if (write(syncer.listeners[i], & one, sizeof(one)) == SYSCALL_ERROR && errno != EAGAIN) {
+        syslog(LOG_ERR, "eventfd write failed: %s", strerror(errno));
+      }
+    }
+  }
+  pthread_mutex_unlock( & syncer.lock);
+  return NULL;
+}
+
+int storage_enable_durable(uint64_t window_us, size_t window_bytes) {
+  pthread_condattr_t attr;
+  pthread_condattr_init( & attr);
+  pthread_condattr_setclock( & attr, CLOCK_MONOTONIC);
+  pthread_mutex_init( & syncer.lock, NULL);
+  pthread_cond_init( & syncer.sync_needed, & attr);
+  pthread_cond_init( & syncer.sync_done, NULL);
+  pthread_condattr_destroy( & attr);
+  syncer.window_ns = window_us * 1000;
+  syncer.window_bytes = window_bytes;
+  syncer.num_listeners = 0;
+  syncer.running = true;
+  if (pthread_create( & syncer.thread, NULL, syncer_thread, NULL) != 0) {
+    perror("pthread_create");
+    pthread_cond_destroy( & syncer.sync_needed);
+    pthread_cond_destroy( & syncer.sync_done);
+    pthread_mutex_destroy( & syncer.lock);
+    return -1;
+  }
+  durable = true;
+  syslog(LOG_INFO, "Durable mode: commit window %llu us, %zu bytes", (unsigned long long) window_us, window_bytes);
+  return 0;
+}
+
+bool storage_is_durable(void) {
+  return durable;
+}
+
+off_t storage_durable(void) {
+  return durable ? atomic_load( & synced_end) : storage_committed();
+}
+
+void storage_request_sync(void) {
+  if (!durable) {
+    return;
+  }
+  pthread_mutex_lock( & syncer.lock);
+  pthread_cond_signal( & syncer.sync_needed);
+  pthread_mutex_unlock( & syncer.lock);
+}
+
+void storage_wait_durable(off_t end) {
+  if (!durable || atomic_load( & synced_end) >= end) {
+    return;
+  }
+  uint64_t wait_start_ns = stats_now_ns();
+  pthread_mutex_lock( & syncer.lock);
+  pthread_cond_signal( & syncer.sync_needed);
+  while (atomic_load( & synced_end) < end && syncer.running) {
+    pthread_cond_wait( & syncer.sync_done, & syncer.lock);
+  }
+  pthread_mutex_unlock( & syncer.lock);
+  stats_record_latency(HIST_DURABLE_WAIT, stats_now_ns() - wait_start_ns);
+}
+
+int storage_add_sync_listener(int event_fd) {
+  int retval = -1;
+  pthread_mutex_lock( & syncer.lock);
+  if (syncer.num_listeners < MAX_SYNC_LISTENERS) {
+    syncer.listeners[syncer.num_listeners++] = event_fd;
+    retval = 0;
+  }
+  pthread_mutex_unlock( & syncer.lock);
+  return retval;
+}
+
+void storage_remove_sync_listener(int event_fd) {
+  pthread_mutex_lock( & syncer.lock);
+  for (int i = 0; i < syncer.num_listeners; i++) {
+    if (syncer.listeners[i] == event_fd) {
+      syncer.listeners[i] = syncer.listeners[--syncer.num_listeners];
+      break;
+    }
+  }
+  pthread_mutex_unlock( & syncer.lock);
+}
+
+/**
+ * @brief Send log bytes [*from, to) from the segment files in order, with sendfile() where supported.
+ *
+ * Bytes dropped by retention while the replay runs are skipped.
+ * @return 0 on success, -1 if the connection failed
+ */
+static int replay_segments(int client_sockfd, off_t * from, off_t to) {
+  while ( * from < to) {
+    off_t file_offset;
+    off_t span;
+    struct log_segment * seg = storage_pin( * from, false, & file_offset, & span);
+    if (seg == NULL) {
+      if (storage_first() <= * from) {
+        syslog(LOG_ERR, "Replay offset %lld is not in the log", (long long) * from);
+        return -1;
+      }
+      * from = storage_first();
+      continue;
+    }
+    off_t count = to - * from < span ? to - * from : span;
+    off_t start = file_offset;
+    int result = 0;
+    if (seg -> compressed) {
+      // Inflated a block at a time, nothing to splice
+      char buf[CODEC_BLOCK_BYTES];
+      while (result == 0 && file_offset - start < count) {
+        size_t want = count - (file_offset - start) < CODEC_BLOCK_BYTES ? count - (file_offset - start) : CODEC_BLOCK_BYTES;
+        ssize_t bytes_read = storage_read(seg, buf, want, file_offset);
+        if (bytes_read <= 0 || send_all(client_sockfd, buf, bytes_read) != 0) {
+          result = -1;
+          break;
+        }
+        stats_add(STAT_REPLAY_COPIED_BYTES, bytes_read);
+        file_offset += bytes_read;
+      }
+    } else {
+      result = replay_fd(client_sockfd, seg -> fd, & file_offset, count);
+    }
+    storage_unpin(seg);
+    * from += file_offset - start;
+    if (result != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int storage_replay(int client_sockfd, off_t from, off_t to) {
+  if (from < storage_first()) {
+    from = storage_first();
+  }
+  if (replay_cache_enabled() && to > from) {
+    off_t low = replay_cache_low();
+    // Data older than the cached tail comes from the file, the rest from memory
+    if (from < low) {
+      off_t disk_to = low < to ? low : to;
+      if (replay_segments(client_sockfd, & from, disk_to) != 0) {
+        return -1;
+      }
+    }
+    if (from < to && replay_cache_send(client_sockfd, from, to, & from) != 0) {
+      return -1;
+    }
+  }
+  if (to <= from) {
+    return 0;
+  }
+  return replay_segments(client_sockfd, & from, to);
+}
+
+void storage_close(void) {
+  if (writer_enabled) {
+    pthread_mutex_lock( & writer.lock);
+    writer.running = false;
+    pthread_cond_signal( & writer.wake);
+    pthread_mutex_unlock( & writer.lock);
+    pthread_join(writer.thread, NULL);
+    uint64_t batches = stats_total(STAT_WRITER_BATCHES);
+    syslog(LOG_INFO, "Writer thread: %llu records in %llu batches (%.1f records per pwritev)",
+      (unsigned long long) stats_total(STAT_WRITER_BATCHED_RECORDS), (unsigned long long) batches,
+      batches ? (double) stats_total(STAT_WRITER_BATCHED_RECORDS) / batches : 0.0);
+    pthread_cond_destroy( & writer.wake);
+    pthread_mutex_destroy( & writer.lock);
+    writer_enabled = false;
+  }
+  if (compression) {
+    pthread_mutex_lock( & compressor.lock);
+    compressor.running = false;
+    pthread_cond_signal( & compressor.wake);
+    pthread_mutex_unlock( & compressor.lock);
+    pthread_join(compressor.thread, NULL);
+    uint64_t packed = stats_total(STAT_COMPRESS_OUT_BYTES);
+    syslog(LOG_INFO, "Compressed %llu bytes of sealed segments to %llu (ratio %.2f)",
+      (unsigned long long) stats_total(STAT_COMPRESS_IN_BYTES), (unsigned long long) packed,
+      packed ? (double) stats_total(STAT_COMPRESS_IN_BYTES) / packed : 0.0);
+    pthread_cond_destroy( & compressor.wake);
+    pthread_mutex_destroy( & compressor.lock);
+    compression = false;
+  }
+  if (durable) {
+    pthread_mutex_lock( & syncer.lock);
+    syncer.running = false;
+    pthread_cond_broadcast( & syncer.sync_needed);
+    pthread_cond_broadcast( & syncer.sync_done);
+    pthread_mutex_unlock( & syncer.lock);
+    pthread_join(syncer.thread, NULL);
+    uint64_t syncs = stats_total(STAT_SYNCS);
+    syslog(LOG_INFO, "Durable mode: %llu fdatasync calls for %llu records (%.1f records per sync)",
+      (unsigned long long) syncs, (unsigned long long) stats_total(STAT_RECORDS),
+      syncs ? (double) stats_total(STAT_RECORDS) / syncs : 0.0);
+    pthread_cond_destroy( & syncer.sync_needed);
+    pthread_cond_destroy( & syncer.sync_done);
+    pthread_mutex_destroy( & syncer.lock);
+    durable = false;
+  }
+  replay_cache_free();
+  if (segments.ring != NULL) {
+    if (segment_bytes > 0 && segments.next > segments.first) {
+      syslog(LOG_INFO, "Segmented log: segments %lld to %lld live, %llu dropped by retention", segments.first,
+        segments.next - 1, (unsigned long long) stats_total(STAT_SEGMENTS_DROPPED));
+    }
+    for (long long index = segments.first; index < segments.next; index++) {
+      storage_unpin(segments.ring[index % segments.capacity]);
+    }
+    free(segments.ring);
+    segments.ring = NULL;
+    pthread_rwlock_destroy( & segments.lock);
+  }
+}
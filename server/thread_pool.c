@@ -0,0 +1,238 @@
+/*
+Author: Visweshwaran Baskaran
+File name: thread_pool.c
+File description:
+Bounded worker pool connection model for aesdsocket. N workers are created once at startup and block on a
+fixed size ring of accepted sockets. Accepting a connection is a single O(1) enqueue: there is no per
+connection thread creation and no list of finished threads to scan. When every worker is busy and the ring
+is full the accept loop blocks, leaving further clients in the kernel listen backlog.
+References:
+[1] Linux manual pages https://man7.org/linux/man-pages/man3/pthread_cond_wait.3p.html
+ */
+
+#include "includes/aesdsocket.h"
+#include "includes/thread_pool.h"
+#include "includes/hot_restart.h"
+#include "includes/stats.h"
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+
+struct pending_client {
+  int client_sockfd;
+  struct sockaddr_storage client_addr;
+  struct handoff_client * adopted; // state from a hot restart predecessor, freed by the worker; or NULL
+};
+
+struct worker {
+  pthread_t thread;
+  int client_sockfd; // socket currently served, -1 when idle or handing it over; lets thread_pool_stop() interrupt recv()
+};
+
+/**
+ * Bounded MPMC ring of accepted sockets. Any acceptor may push and any worker may pop.
+ */
+struct handoff_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  struct pending_client * slots;
+  int capacity;
+  int head; // next slot to pop
+  int count;
+};
+
+static struct handoff_queue queue;
+static struct worker * workers = NULL;
+static int num_workers = 0;
+static bool pool_running = false;
+
+/**
+ * @brief Pop the next accepted socket, waiting while the queue is empty, and mark self as serving it.
+ *
+ * The socket is recorded on the worker in the same critical section, so thread_pool_stop() never sees a
+ * popped connection that no worker owns and skips its shutdown().
+ * @return true if client was filled in, false if the pool is stopping
+ */
+static bool queue_pop(struct worker * self, struct pending_client * client) {
+  pthread_mutex_lock( & queue.lock);
+  while (queue.count == 0 && pool_running) {
+    pthread_cond_wait( & queue.not_empty, & queue.lock);
+  }
+  if (!pool_running) {
+    pthread_mutex_unlock( & queue.lock);
+    return false;
+  }
+  * client = queue.slots[queue.head];
+  self -> client_sockfd = client -> client_sockfd;
+  queue.head = (queue.head + 1) % queue.capacity;
+  queue.count--;
+  pthread_cond_signal( & queue.not_full);
+  pthread_mutex_unlock( & queue.lock);
+  return true;
+}
+
+/**
+ * @brief Worker thread: serve queued connections one after another until the pool stops.
+ * @param worker_param A pointer to the struct worker owned by this thread.
+ * @return NULL
+ */
+/**
+ * @brief conn_owner hook: hide the worker's socket from thread_pool_stop() while it is handed over.
+ */
+static bool detach_worker(void * worker) {
+  pthread_mutex_lock( & queue.lock);
+  bool detached = pool_running;
+  if (detached) {
+    ((struct worker * ) worker) -> client_sockfd = -1;
+  }
+  pthread_mutex_unlock( & queue.lock);
+  return detached;
+}
+
+static bool attach_worker(void * worker, int client_sockfd) {
+  pthread_mutex_lock( & queue.lock);
+  bool attached = pool_running;
+  if (attached) {
+    ((struct worker * ) worker) -> client_sockfd = client_sockfd;
+  }
+  pthread_mutex_unlock( & queue.lock);
+  return attached;
+}
+
+static void * worker_thread(void * worker_param) {
+  struct worker * self = (struct worker * ) worker_param;
+  struct pending_client client;
+  struct conn_owner owner = { .detach = detach_worker, .attach = attach_worker, .owner = self };
+
+  while (queue_pop(self, & client)) {
+    serve_connection(client.client_sockfd, client.client_addr, client.adopted, & owner);
+    free(client.adopted);
+
+    pthread_mutex_lock( & queue.lock);
+    self -> client_sockfd = -1;
+    pthread_mutex_unlock( & queue.lock);
+  }
+  return NULL;
+}
+
+int thread_pool_start(int requested_workers, int queue_capacity) {
+  queue.capacity = queue_capacity > 0 ? queue_capacity : 1;
+  queue.head = 0;
+  queue.count = 0;
+  queue.slots = (struct pending_client * ) calloc(queue.capacity, sizeof(struct pending_client));
+  workers = (struct worker * ) calloc(requested_workers > 0 ? requested_workers : 1, sizeof(struct worker));
+  if (queue.slots == NULL || workers == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    perror("calloc");
+    free(queue.slots);
+    free(workers);
+    workers = NULL;
+    return -1;
+  }
+  pthread_mutex_init( & queue.lock, NULL);
+  pthread_cond_init( & queue.not_empty, NULL);
+  pthread_cond_init( & queue.not_full, NULL);
+  pool_running = true;
+
+  for (num_workers = 0; num_workers < (requested_workers > 0 ? requested_workers : 1); num_workers++) {
+    workers[num_workers].client_sockfd = -1;
+    if (pthread_create( & workers[num_workers].thread, NULL, worker_thread, & workers[num_workers]) != 0) {
+      perror("pthread_create");
+      thread_pool_stop();
+      return -1;
+    }
+  }
+  syslog(LOG_INFO, "Started %d pool workers with a hand-off queue of %d", num_workers, queue.capacity);
+  return 0;
+}
+
+/**
+ * @brief Queue a connection for the next free worker, blocking while the queue is full.
+ * @return 0 on success, -1 if the pool is stopping (the socket is closed and adopted freed)
+ */
+static int enqueue(int client_sockfd, struct sockaddr_storage client_addr, struct handoff_client * adopted) {
+  pthread_mutex_lock( & queue.lock);
+  if (queue.count == queue.capacity && pool_running) {
+    // Every worker is busy and the queue is full: the acceptor stalls, count it as lock wait
+    uint64_t wait_start_ns = stats_now_ns();
+    while (queue.count == queue.capacity && pool_running) {
+      pthread_cond_wait( & queue.not_full, & queue.lock);
+    }
+    stats_add(STAT_LOCK_WAIT_NS, stats_now_ns() - wait_start_ns);
+  }
+  if (!pool_running) {
+    pthread_mutex_unlock( & queue.lock);
+    close(client_sockfd);
+    free(adopted);
+    return -1;
+  }
+  struct pending_client * slot = & queue.slots[(queue.head + queue.count) % queue.capacity];
+  slot -> client_sockfd = client_sockfd;
+  slot -> client_addr = client_addr;
+  slot -> adopted = adopted;
+  queue.count++;
+  pthread_cond_signal( & queue.not_empty);
+  pthread_mutex_unlock( & queue.lock);
+  return 0;
+}
+
+int thread_pool_submit(int client_sockfd, struct sockaddr_storage client_addr) {
+  return enqueue(client_sockfd, client_addr, NULL);
+}
+
+int thread_pool_adopt(struct handoff_client * client) {
+  return enqueue(client -> client_sockfd, client -> client_addr, client);
+}
+
+size_t thread_pool_signal_all(int sig) {
+  size_t busy = 0;
+  pthread_mutex_lock( & queue.lock);
+  for (int i = 0; i < num_workers; i++) {
+    if (workers[i].client_sockfd != -1) {
+      pthread_kill(workers[i].thread, sig);
+      busy++;
+    }
+  }
+  pthread_mutex_unlock( & queue.lock);
+  return busy;
+}
+
+void thread_pool_stop(void) {
+  if (workers == NULL) {
+    return;
+  }
+  pthread_mutex_lock( & queue.lock);
+  pool_running = false;
+  pthread_cond_broadcast( & queue.not_empty);
+  pthread_cond_broadcast( & queue.not_full);
+  // Wake workers blocked in recv(); serve_connection() then closes the socket itself
+  for (int i = 0; i < num_workers; i++) {
+    if (workers[i].client_sockfd != -1) {
+      shutdown(workers[i].client_sockfd, SHUT_RDWR);
+    }
+  }
+  pthread_mutex_unlock( & queue.lock);
+
+  for (int i = 0; i < num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  while (queue.count > 0) {
+    close(queue.slots[queue.head].client_sockfd);
+    free(queue.slots[queue.head].adopted);
+    queue.head = (queue.head + 1) % queue.capacity;
+    queue.count--;
+  }
+  pthread_cond_destroy( & queue.not_empty);
+  pthread_cond_destroy( & queue.not_full);
+  pthread_mutex_destroy( & queue.lock);
+  free(queue.slots);
+  free(workers);
+  workers = NULL;
+  num_workers = 0;
+}
@@ -0,0 +1,888 @@
+/*
+Author: Visweshwaran Baskaran
+File name: uring_loop.c
+File description:
+io_uring connection model for aesdsocket. Each ring thread keeps an accept request armed on the shared
+listening socket, receives straight into the connection's line framer, writes every record to the data file
+at an offset reserved from the storage layer and replays the log with a READ -> SEND pair linked with
+IOSQE_IO_LINK, reading into a registered buffer from the registered data file. All requests queued while
+handling one batch of completions are submitted by the same io_uring_enter() call, which also waits for
+the next completions, so a record costs a fraction of the ~6 syscalls of the thread per connection path.
+With a segmented log each WRITE and READ stays within one segment file, pinned until the request completes,
+and no file is registered; compressed segments are inflated synchronously into the registered buffer, which
+is then sent with a standalone SEND.
+Records are published in reservation order: a completed write waits in the ring's pending list until every
+earlier write of the ring has completed, exactly like storage_append() does for synchronous writers.
+The ring is driven with raw syscalls so no liburing dependency is needed. With accept sharding each ring owns
+its own SO_REUSEPORT listening socket instead of sharing the main one.
+References:
+[1] Efficient IO with io_uring https://kernel.dk/io_uring.pdf
+[2] Linux manual pages https://man7.org/linux/man-pages/man2/io_uring_enter.2.html
+[3] queue.h leveraged from: https://raw.githubusercontent.com/freebsd/freebsd/stable/10/sys/sys/queue.h
+ */
+
+#include "includes/queue.h"
+#include "includes/aesdsocket.h"
+#include "includes/backend.h"
+#include "includes/uring_loop.h"
+#include "includes/line_framer.h"
+#include "includes/storage.h"
+#include "includes/stats.h"
+#include "includes/frame.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define URING_ENTRIES 256 // submission queue size of each ring
+#define URING_MAX_CONNS 512 // connections per ring, one registered buffer each
+#define URING_BUF_SIZE (16 * 1024) // registered replay buffer per connection
+#define URING_TIMEOUT_MS 500 // upper bound on how long a ring takes to notice signal_received
+
+enum uring_op {
+  OP_ACCEPT = 1,
+  OP_TIMEOUT,
+  OP_RECV,
+  OP_WRITE,
+  OP_READ,
+  OP_SEND,
+  OP_SYNC // read of the ring's sync eventfd, completes after a durable mode group commit
+};
+#define OP_MASK 0x7ULL // user_data = connection pointer | op, connections are 8 byte aligned
+
+struct ring {
+  int ring_fd;
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned * sq_mask;
+  unsigned * sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe * sqes;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned * cq_mask;
+  struct io_uring_cqe * cqes;
+  void * sq_ptr;
+  size_t sq_len;
+  void * cq_ptr;
+  size_t cq_len;
+  size_t sqes_len;
+  unsigned to_submit; // SQEs queued since the last io_uring_enter()
+};
+
+struct uring_conn {
+  int client_sockfd;
+  struct sockaddr_storage client_addr;
+  int slot; // index of this connection and of its registered buffer
+  struct line_framer framer;
+  const char * record; // record being written, points into framer
+  size_t record_len;
+  off_t write_start;
+  size_t write_done_len;
+  struct log_segment * io_segment; // segment file pinned by the WRITE or READ in flight
+  bool write_failed;
+  bool write_complete;
+  uint64_t publish_ns;
+  uint64_t write_start_ns;
+  uint64_t replay_start_ns;
+  bool sending_stats; // the registered buffer holds an AESDSTATS response instead of log data
+  off_t replay_off;
+  off_t replay_end;
+  bool tail_mode; // AESDTAIL was received: replays start at delivered instead of 0
+  off_t delivered; // log offset the previous replay ended at
+  bool awaiting_read; // the current replay chunk started with a linked READ
+  int read_res;
+  int send_res;
+  size_t chunk_valid; // bytes of the registered buffer holding replay data
+  size_t chunk_sent;
+  int inflight; // requests submitted for this connection and not completed yet
+  TAILQ_ENTRY(uring_conn) write_entries;
+};
+
+struct uring_loop {
+  pthread_t thread;
+  struct ring ring;
+  int listen_sockfd;
+  bool owns_listener; // listen_sockfd is this ring's accept shard
+  atomic_ullong accepts;
+  char * buffers;
+  bool fixed_buffers;
+  bool fixed_file;
+  struct uring_conn * conns;
+  int * free_slots;
+  int num_free;
+  TAILQ_HEAD(writelist, uring_conn) pending_writes;
+  TAILQ_HEAD(durablelist, uring_conn) durable_waits; // published records waiting for the group commit, in log order
+  int sync_efd; // written by the storage syncer after every fdatasync()
+  uint64_t sync_count;
+  struct sockaddr_storage accept_addr;
+  socklen_t accept_len;
+  struct __kernel_timespec timeout;
+  bool stopping;
+  unsigned long long enter_calls;
+  unsigned long long records;
+};
+
+static struct uring_loop * loops = NULL;
+static int num_loops = 0;
+static atomic_bool rings_running = false; // written by the main thread, polled by every ring thread
+
+static void process_next_record(struct uring_loop * loop, struct uring_conn * conn);
+
+/**
+ * @brief Create an io_uring instance and map its submission and completion rings.
+ * @return 0 on success, -1 on failure
+ */
+static int ring_setup(struct ring * ring, unsigned entries) {
+  struct io_uring_params params;
+  memset( & params, 0, sizeof(params));
+  ring -> ring_fd = syscall(__NR_io_uring_setup, entries, & params);
+  if (ring -> ring_fd < 0) {
+    return -1;
+  }
+  ring -> sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring -> cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring -> cq_len > ring -> sq_len) {
+      ring -> sq_len = ring -> cq_len;
+    }
+    ring -> cq_len = ring -> sq_len;
+  }
+  ring -> sq_ptr = mmap(NULL, ring -> sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring -> ring_fd, IORING_OFF_SQ_RING);
+  if (ring -> sq_ptr == MAP_FAILED) {
+    close(ring -> ring_fd);
+    return -1;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring -> cq_ptr = ring -> sq_ptr;
+  } else {
+    ring -> cq_ptr = mmap(NULL, ring -> cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring -> ring_fd, IORING_OFF_CQ_RING);
+    if (ring -> cq_ptr == MAP_FAILED) {
+      munmap(ring -> sq_ptr, ring -> sq_len);
+      close(ring -> ring_fd);
+      return -1;
+    }
+  }
+  ring -> sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring -> sqes = mmap(NULL, ring -> sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring -> ring_fd, IORING_OFF_SQES);
+  if (ring -> sqes == MAP_FAILED) {
+    if (ring -> cq_ptr != ring -> sq_ptr) {
+      munmap(ring -> cq_ptr, ring -> cq_len);
+    }
+    munmap(ring -> sq_ptr, ring -> sq_len);
+    close(ring -> ring_fd);
+    return -1;
+  }
+  ring -> sq_head = (unsigned * )((char * ) ring -> sq_ptr + params.sq_off.head);
+  ring -> sq_tail = (unsigned * )((char * ) ring -> sq_ptr + params.sq_off.tail);
+  ring -> sq_mask = (unsigned * )((char * ) ring -> sq_ptr + params.sq_off.ring_mask);
+  ring -> sq_array = (unsigned * )((char * ) ring -> sq_ptr + params.sq_off.array);
+  ring -> sq_entries = params.sq_entries;
+  ring -> cq_head = (unsigned * )((char * ) ring -> cq_ptr + params.cq_off.head);
+  ring -> cq_tail = (unsigned * )((char * ) ring -> cq_ptr + params.cq_off.tail);
+  ring -> cq_mask = (unsigned * )((char * ) ring -> cq_ptr + params.cq_off.ring_mask);
+  ring -> cqes = (struct io_uring_cqe * )((char * ) ring -> cq_ptr + params.cq_off.cqes);
+  ring -> to_submit = 0;
+  return 0;
+}
+
+static void ring_teardown(struct ring * ring) {
+  munmap(ring -> sqes, ring -> sqes_len);
+  if (ring -> cq_ptr != ring -> sq_ptr) {
+    munmap(ring -> cq_ptr, ring -> cq_len);
+  }
+  munmap(ring -> sq_ptr, ring -> sq_len);
+  close(ring -> ring_fd);
+}
+
+/**
+ * @brief Submit queued SQEs and optionally wait for completions.
+ * @return 0 on success, -1 on failure other than EINTR
+ */
+static int ring_enter(struct uring_loop * loop, unsigned wait_nr) {
+  struct ring * ring = & loop -> ring;
+  int ret = syscall(__NR_io_uring_enter, ring -> ring_fd, ring -> to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  loop -> enter_calls++;
+  if (ret < 0) {
+    if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+      return 0;
+    }
+    perror("io_uring_enter");
+    syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+    return -1;
+  }
+  ring -> to_submit -= (unsigned) ret < ring -> to_submit ? (unsigned) ret : ring -> to_submit;
+  return 0;
+}
+
+/**
+ * @brief Take the next free SQE, flushing the submission queue first if it is full.
+ *
+ * The SQE is published to the kernel immediately; without SQPOLL the kernel only reads it on the next
+ * io_uring_enter(), by which time the caller has filled it in.
+ */
+static struct io_uring_sqe * ring_get_sqe(struct uring_loop * loop) {
+  struct ring * ring = & loop -> ring;
+  unsigned tail = * ring -> sq_tail;
+  if (tail - __atomic_load_n(ring -> sq_head, __ATOMIC_ACQUIRE) >= ring -> sq_entries) {
+    ring_enter(loop, 0);
+    if (tail - __atomic_load_n(ring -> sq_head, __ATOMIC_ACQUIRE) >= ring -> sq_entries) {
+      return NULL;
+    }
+  }
+  unsigned index = tail & * ring -> sq_mask;
+  struct io_uring_sqe * sqe = & ring -> sqes[index];
+  memset(sqe, 0, sizeof( * sqe));
+  ring -> sq_array[index] = index;
+  __atomic_store_n(ring -> sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring -> to_submit++;
+  return sqe;
+}
+
+/**
+ * @brief Queue one request.
+ * @return the SQE for further flags, or NULL if the submission queue is exhausted
+ */
+static struct io_uring_sqe * queue_op(struct uring_loop * loop, struct uring_conn * conn, enum uring_op op,
+  int opcode, int fd, const void * addr, unsigned len, unsigned long long off) {
+  struct io_uring_sqe * sqe = ring_get_sqe(loop);
+  if (sqe == NULL) {
+    syslog(LOG_ERR, "io_uring submission queue exhausted");
+    return NULL;
+  }
+  sqe -> opcode = opcode;
+  sqe -> fd = fd;
+  sqe -> addr = (unsigned long long)(uintptr_t) addr;
+  sqe -> len = len;
+  sqe -> off = off;
+  sqe -> user_data = (unsigned long long)(uintptr_t) conn | op;
+  if (conn != NULL) {
+    conn -> inflight++;
+  }
+  return sqe;
+}
+
+static void arm_accept(struct uring_loop * loop) {
+  loop -> accept_len = sizeof(loop -> accept_addr);
+  struct io_uring_sqe * sqe = queue_op(loop, NULL, OP_ACCEPT, IORING_OP_ACCEPT, loop -> listen_sockfd, & loop -> accept_addr, 0,
+    (unsigned long long)(uintptr_t) & loop -> accept_len);
+  if (sqe != NULL) {
+    sqe -> accept_flags = SOCK_CLOEXEC;
+  }
+}
+
+static void arm_sync_wait(struct uring_loop * loop) {
+  queue_op(loop, NULL, OP_SYNC, IORING_OP_READ, loop -> sync_efd, & loop -> sync_count, sizeof(loop -> sync_count), 0);
+}
+
+static void arm_timeout(struct uring_loop * loop) {
+  loop -> timeout.tv_sec = URING_TIMEOUT_MS / 1000;
+  loop -> timeout.tv_nsec = (URING_TIMEOUT_MS % 1000) * 1000000LL;
+  queue_op(loop, NULL, OP_TIMEOUT, IORING_OP_TIMEOUT, -1, & loop -> timeout, 1, 0);
+}
+
+static char * conn_buffer(struct uring_loop * loop, struct uring_conn * conn) {
+  return loop -> buffers + (size_t) conn -> slot * URING_BUF_SIZE;
+}
+
+static void close_conn(struct uring_loop * loop, struct uring_conn * conn) {
+  log_closed_connection(conn -> client_addr);
+  close(conn -> client_sockfd);
+  line_framer_free( & conn -> framer);
+  conn -> client_sockfd = -1;
+  loop -> free_slots[loop -> num_free++] = conn -> slot;
+}
+
+static void submit_recv(struct uring_loop * loop, struct uring_conn * conn) {
+  size_t avail;
+  char * recv_space = line_framer_recv_space( & conn -> framer, & avail);
+  if (recv_space == NULL) {
+    syslog(LOG_ERR, "Receive buffer unavailable or record exceeds %d bytes, closing connection", FRAMER_MAX_RECORD);
+    close_conn(loop, conn);
+    return;
+  }
+  if (queue_op(loop, conn, OP_RECV, IORING_OP_RECV, conn -> client_sockfd, recv_space, avail, 0) == NULL) {
+    close_conn(loop, conn);
+  }
+}
+
+static void release_io_segment(struct uring_conn * conn) {
+  if (conn -> io_segment != NULL) {
+    storage_unpin(conn -> io_segment);
+    conn -> io_segment = NULL;
+  }
+}
+
+static void submit_write(struct uring_loop * loop, struct uring_conn * conn) {
+  const char * buf = conn -> record + conn -> write_done_len;
+  off_t file_offset;
+  off_t span;
+  conn -> io_segment = storage_pin(conn -> write_start + conn -> write_done_len, true, & file_offset, & span);
+  if (conn -> io_segment == NULL) {
+    conn -> write_failed = true;
+    conn -> write_complete = true;
+    return;
+  }
+  // A record crossing a segment boundary is completed by the short write path
+  unsigned len = conn -> record_len - conn -> write_done_len;
+  if ((off_t) len > span) {
+    len = span;
+  }
+  struct io_uring_sqe * sqe = queue_op(loop, conn, OP_WRITE, IORING_OP_WRITE,
+    loop -> fixed_file ? 0 : storage_segment_fd(conn -> io_segment), buf, len, file_offset);
+  if (sqe == NULL) {
+    release_io_segment(conn);
+    conn -> write_failed = true;
+    conn -> write_complete = true;
+    return;
+  }
+  if (loop -> fixed_file) {
+    sqe -> flags |= IOSQE_FIXED_FILE;
+  }
+}
+
+static void submit_send(struct uring_loop * loop, struct uring_conn * conn) {
+  struct io_uring_sqe * sqe = queue_op(loop, conn, OP_SEND, IORING_OP_SEND, conn -> client_sockfd,
+    conn_buffer(loop, conn) + conn -> chunk_sent, conn -> chunk_valid - conn -> chunk_sent, 0);
+  if (sqe != NULL) {
+    sqe -> msg_flags = MSG_NOSIGNAL;
+  } else if (conn -> inflight == 0) {
+    close_conn(loop, conn); // no completion is left to retry from
+  }
+}
+
+/**
+ * @brief Queue the next replay chunk as a READ into the registered buffer linked to a SEND of it.
+ */
+static void submit_replay_chunk(struct uring_loop * loop, struct uring_conn * conn) {
+  off_t file_offset;
+  off_t span;
+  while ((conn -> io_segment = storage_pin(conn -> replay_off, false, & file_offset, & span)) == NULL) {
+    // Dropped by retention since the replay started: continue with the oldest retained byte
+    if (storage_first() <= conn -> replay_off) {
+      syslog(LOG_ERR, "Replay offset %lld is not in the log", (long long) conn -> replay_off);
+      close_conn(loop, conn);
+      return;
+    }
+    conn -> replay_off = storage_first();
+    if (conn -> replay_off >= conn -> replay_end) {
+      process_next_record(loop, conn);
+      return;
+    }
+  }
+  size_t len = conn -> replay_end - conn -> replay_off;
+  if (len > URING_BUF_SIZE) {
+    len = URING_BUF_SIZE;
+  }
+  if ((off_t) len > span) {
+    len = span;
+  }
+  char * buf = conn_buffer(loop, conn);
+  if (storage_segment_fd(conn -> io_segment) == -1) {
+    ssize_t bytes_read = storage_read(conn -> io_segment, buf, len, file_offset);
+    release_io_segment(conn);
+    if (bytes_read <= 0) {
+      syslog(LOG_ERR, "replay read failed: %s", bytes_read == 0 ? "unexpected end of segment" : strerror(errno));
+      close_conn(loop, conn);
+      return;
+    }
+    conn -> chunk_valid = bytes_read;
+    conn -> chunk_sent = 0;
+    conn -> send_res = 0;
+    submit_send(loop, conn);
+    return;
+  }
+  struct io_uring_sqe * read_sqe = queue_op(loop, conn, OP_READ, loop -> fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ,
+    loop -> fixed_file ? 0 : storage_segment_fd(conn -> io_segment), buf, len, file_offset);
+  if (read_sqe == NULL) {
+    release_io_segment(conn);
+    close_conn(loop, conn);
+    return;
+  }
+  if (loop -> fixed_file) {
+    read_sqe -> flags |= IOSQE_FIXED_FILE;
+  }
+  if (loop -> fixed_buffers) {
+    read_sqe -> buf_index = conn -> slot;
+  }
+  read_sqe -> flags |= IOSQE_IO_LINK; // the SEND only starts once the READ has filled the buffer
+  conn -> awaiting_read = true;
+  conn -> read_res = 0;
+  conn -> send_res = 0;
+  conn -> chunk_valid = len;
+  conn -> chunk_sent = 0;
+  struct io_uring_sqe * send_sqe = queue_op(loop, conn, OP_SEND, IORING_OP_SEND, conn -> client_sockfd, buf, len, 0);
+  if (send_sqe != NULL) {
+    send_sqe -> msg_flags = MSG_NOSIGNAL;
+  }
+  // Without the SEND the READ completes alone and finish_replay_chunk() sends the chunk with submit_send()
+}
+
+/**
+ * @brief Replay the durable log to a connection, from the start or, in tail mode, from where the previous replay ended.
+ * @param full Replay from offset 0 even in tail mode (AESDCHAR_IOCSEEKTO).
+ */
+static void start_replay(struct uring_loop * loop, struct uring_conn * conn, bool full) {
+  conn -> replay_start_ns = stats_now_ns();
+  conn -> replay_off = (conn -> tail_mode && !full) ? conn -> delivered : 0;
+  if (conn -> replay_off < storage_first()) {
+    conn -> replay_off = storage_first(); // older segments were dropped by retention
+  }
+  conn -> replay_end = storage_durable();
+  conn -> delivered = conn -> replay_end;
+  if (conn -> replay_off >= conn -> replay_end) {
+    process_next_record(loop, conn);
+    return;
+  }
+  submit_replay_chunk(loop, conn);
+}
+
+/**
+ * @brief Both halves of a replay chunk (or a standalone SEND) completed: continue, resend or finish.
+ */
+static void finish_replay_chunk(struct uring_loop * loop, struct uring_conn * conn) {
+  if (conn -> awaiting_read) {
+    conn -> awaiting_read = false;
+    if (conn -> read_res <= 0) {
+      syslog(LOG_ERR, "replay read failed: %s", strerror(conn -> read_res < 0 ? -conn -> read_res : EIO));
+      close_conn(loop, conn);
+      return;
+    }
+    conn -> chunk_valid = conn -> read_res;
+  }
+  if (conn -> send_res == -ECANCELED) {
+    conn -> send_res = 0; // short READ broke the link: send what was read
+  } else if (conn -> send_res < 0) {
+    close_conn(loop, conn);
+    return;
+  }
+  conn -> chunk_sent += conn -> send_res;
+  stats_add(STAT_BYTES_OUT, conn -> send_res);
+  if (conn -> chunk_sent < conn -> chunk_valid) {
+    submit_send(loop, conn);
+    return;
+  }
+  if (conn -> sending_stats) {
+    conn -> sending_stats = false;
+    process_next_record(loop, conn);
+    return;
+  }
+  stats_add(STAT_REPLAY_COPIED_BYTES, conn -> chunk_valid);
+  conn -> replay_off += conn -> chunk_valid;
+  if (conn -> replay_off < conn -> replay_end) {
+    submit_replay_chunk(loop, conn);
+  } else {
+    stats_record_latency(HIST_REPLAY, stats_now_ns() - conn -> replay_start_ns);
+    process_next_record(loop, conn);
+  }
+}
+
+/**
+ * @brief Start the next buffered record of a connection, or receive more data if none is complete.
+ */
+static void process_next_record(struct uring_loop * loop, struct uring_conn * conn) {
+  const char * record;
+  size_t record_len;
+  if (loop -> stopping) {
+    close_conn(loop, conn);
+    return;
+  }
+  if (!line_framer_next( & conn -> framer, & record, & record_len)) {
+    submit_recv(loop, conn);
+    return;
+  }
+  loop -> records++;
+  if (record_len == STATS_COMMAND_LEN && memcmp(record, STATS_COMMAND, STATS_COMMAND_LEN) == 0) {
+    // Answered from the registered buffer like a one chunk replay
+    stats_add(STAT_STATS_COMMANDS, 1);
+    conn -> sending_stats = true;
+    conn -> chunk_valid = stats_format(conn_buffer(loop, conn), URING_BUF_SIZE);
+    conn -> chunk_sent = 0;
+    conn -> send_res = 0;
+    submit_send(loop, conn);
+    return;
+  }
+  if (record_len >= SEEKTO_COMMAND_LEN && strncmp(record, SEEKTO_COMMAND, SEEKTO_COMMAND_LEN) == 0) {
+    // Same as handle_packet(): the file backend cannot seek by write command, replay the whole log
+    syslog(LOG_ERR, "ioctl failed: %s", strerror(ENOTTY));
+    stats_add(STAT_SEEK_COMMANDS, 1);
+    start_replay(loop, conn, true);
+    return;
+  }
+  if (record_len == BINARY_COMMAND_LEN && memcmp(record, BINARY_COMMAND, BINARY_COMMAND_LEN) == 0) {
+    // Not negotiated: answered with a text replay, which a client tells apart from the ack frame
+    syslog(LOG_WARNING, "The binary protocol is not available in io_uring mode");
+    start_replay(loop, conn, false);
+    return;
+  }
+  if (record_len == TAIL_COMMAND_LEN && memcmp(record, TAIL_COMMAND, TAIL_COMMAND_LEN) == 0) {
+    stats_add(STAT_TAIL_COMMANDS, 1);
+    conn -> tail_mode = true;
+    start_replay(loop, conn, false);
+    return;
+  }
+  stats_add(STAT_RECORDS, 1);
+  conn -> write_start_ns = stats_now_ns();
+  conn -> record = record;
+  conn -> record_len = record_len;
+  conn -> write_start = storage_reserve(record_len);
+  conn -> write_done_len = 0;
+  conn -> write_failed = false;
+  conn -> write_complete = false;
+  TAILQ_INSERT_TAIL( & loop -> pending_writes, conn, write_entries);
+  submit_write(loop, conn);
+}
+
+/**
+ * @brief Publish completed writes in reservation order and start their replays.
+ */
+static void publish_writes(struct uring_loop * loop) {
+  struct uring_conn * conn;
+  while ((conn = TAILQ_FIRST( & loop -> pending_writes)) != NULL && conn -> write_complete) {
+    TAILQ_REMOVE( & loop -> pending_writes, conn, write_entries);
+    storage_publish(conn -> write_start, conn -> record, conn -> record_len);
+    stats_record_latency(HIST_WRITE, stats_now_ns() - conn -> write_start_ns);
+    if (conn -> write_failed || loop -> stopping) {
+      close_conn(loop, conn);
+    } else if (storage_is_durable()) {
+      // The replay is the acknowledgement: hold it until the syncer has covered the record
+      conn -> publish_ns = stats_now_ns();
+      TAILQ_INSERT_TAIL( & loop -> durable_waits, conn, write_entries);
+      storage_request_sync();
+    } else {
+      start_replay(loop, conn, false);
+    }
+  }
+}
+
+/**
+ * @brief Start the replays of every record the last group commit made durable.
+ */
+static void release_durable(struct uring_loop * loop) {
+  struct uring_conn * conn;
+  off_t durable_end = storage_durable();
+  while ((conn = TAILQ_FIRST( & loop -> durable_waits)) != NULL &&
+    (conn -> write_start + (off_t) conn -> record_len <= durable_end || loop -> stopping)) {
+    TAILQ_REMOVE( & loop -> durable_waits, conn, write_entries);
+    stats_record_latency(HIST_DURABLE_WAIT, stats_now_ns() - conn -> publish_ns);
+    if (loop -> stopping) {
+      close_conn(loop, conn);
+    } else {
+      start_replay(loop, conn, false);
+    }
+  }
+}
+
+static void accept_client(struct uring_loop * loop, int client_sockfd) {
+  if (loop -> stopping || loop -> num_free == 0) {
+    if (!loop -> stopping) {
+      syslog(LOG_ERR, "io_uring ring full (%d connections), refusing client", URING_MAX_CONNS);
+    }
+    close(client_sockfd);
+    return;
+  }
+  atomic_fetch_add_explicit( & loop -> accepts, 1, memory_order_relaxed);
+  struct uring_conn * conn = & loop -> conns[loop -> free_slots[--loop -> num_free]];
+  conn -> client_sockfd = client_sockfd;
+  conn -> client_addr = loop -> accept_addr;
+  conn -> inflight = 0;
+  conn -> io_segment = NULL;
+  conn -> awaiting_read = false;
+  conn -> sending_stats = false;
+  conn -> tail_mode = false;
+  conn -> delivered = 0;
+  line_framer_init( & conn -> framer);
+  // Replays go out as URING_BUF_SIZE sends, below the loopback MSS; with Nagle each one would wait for
+  // the ACK of the previous one and hit the peer's delayed ACK timer
+  int yes = 1;
+  setsockopt(client_sockfd, IPPROTO_TCP, TCP_NODELAY, & yes, sizeof(yes));
+  log_accepted_connection(conn -> client_addr);
+  submit_recv(loop, conn);
+}
+
+static void handle_completion(struct uring_loop * loop, struct io_uring_cqe * cqe) {
+  struct uring_conn * conn = (struct uring_conn * )(uintptr_t)(cqe -> user_data & ~OP_MASK);
+  enum uring_op op = (enum uring_op)(cqe -> user_data & OP_MASK);
+  int res = cqe -> res;
+
+  if (conn != NULL) {
+    conn -> inflight--;
+  }
+  switch (op) {
+  case OP_ACCEPT:
+    if (res >= 0) {
+      accept_client(loop, res);
+    } else if (res != -ECANCELED && res != -EINTR) {
+      syslog(LOG_ERR, "accept failed: %s", strerror(-res));
+    }
+    if (!loop -> stopping && res != -EBADF && res != -EINVAL) {
+      arm_accept(loop);
+    }
+    break;
+  case OP_TIMEOUT:
+    if (!loop -> stopping) {
+      arm_timeout(loop);
+    }
+    break;
+  case OP_SYNC:
+    release_durable(loop);
+    if (!loop -> stopping && res != -ECANCELED) {
+      arm_sync_wait(loop);
+    }
+    break;
+  case OP_RECV:
+    if (res == -EINTR || res == -EAGAIN) {
+      submit_recv(loop, conn);
+    } else if (res <= 0 || loop -> stopping) {
+      if (res < 0) {
+        syslog(LOG_ERR, "recv failed: %s", strerror(-res));
+      }
+      close_conn(loop, conn);
+    } else {
+      stats_add(STAT_BYTES_IN, res);
+      line_framer_commit( & conn -> framer, res);
+      process_next_record(loop, conn);
+    }
+    break;
+  case OP_WRITE:
+    release_io_segment(conn);
+    if (res < 0) {
+      syslog(LOG_ERR, "write failed: %s", strerror(-res));
+      conn -> write_failed = true;
+      conn -> write_complete = true;
+    } else {
+      conn -> write_done_len += res;
+      if (conn -> write_done_len < conn -> record_len && res > 0) {
+        submit_write(loop, conn);
+      } else {
+        conn -> write_failed = (conn -> write_done_len < conn -> record_len);
+        conn -> write_complete = true;
+      }
+    }
+    break;
+  case OP_READ:
+    release_io_segment(conn);
+    conn -> read_res = res;
+    if (conn -> inflight == 0) {
+      finish_replay_chunk(loop, conn);
+    }
+    break;
+  case OP_SEND:
+    conn -> send_res = res;
+    if (conn -> inflight == 0) {
+      if (loop -> stopping) {
+        close_conn(loop, conn);
+      } else {
+        finish_replay_chunk(loop, conn);
+      }
+    }
+    break;
+  }
+}
+
+/**
+ * @brief Reap every available completion.
+ */
+static void reap_completions(struct uring_loop * loop) {
+  struct ring * ring = & loop -> ring;
+  unsigned head = * ring -> cq_head;
+  while (head != __atomic_load_n(ring -> cq_tail, __ATOMIC_ACQUIRE)) {
+    handle_completion(loop, & ring -> cqes[head & * ring -> cq_mask]);
+    head++;
+    __atomic_store_n(ring -> cq_head, head, __ATOMIC_RELEASE);
+  }
+  publish_writes(loop);
+}
+
+/**
+ * @brief Ring thread: submit queued requests, wait for completions and handle them.
+ * @param loop_param A pointer to the struct uring_loop owned by this thread.
+ * @return NULL
+ */
+static void * uring_loop_thread(void * loop_param) {
+  struct uring_loop * loop = (struct uring_loop * ) loop_param;
+  arm_accept(loop);
+  arm_timeout(loop);
+  if (loop -> sync_efd != -1) {
+    arm_sync_wait(loop);
+  }
+  while (!signal_received && rings_running) {
+    if (ring_enter(loop, 1) != 0) {
+      break;
+    }
+    reap_completions(loop);
+  }
+
+  // Every reserved range must be published before exiting or other writers would wait on it forever
+  loop -> stopping = true;
+  while (!TAILQ_EMPTY( & loop -> pending_writes)) {
+    if (ring_enter(loop, 1) != 0) {
+      break;
+    }
+    reap_completions(loop);
+  }
+  release_durable(loop);
+  return NULL;
+}
+
+static void close_sync_efd(struct uring_loop * loop) {
+  if (loop -> sync_efd != -1) {
+    storage_remove_sync_listener(loop -> sync_efd);
+    close(loop -> sync_efd);
+    loop -> sync_efd = -1;
+  }
+}
+
+/**
+ * @brief Set up one ring: io_uring instance, connection slots and registered buffers/file.
+ * @return 0 on success, -1 on failure
+ */
+static int loop_init(struct uring_loop * loop, int listen_sockfd) {
+  memset(loop, 0, sizeof( * loop));
+  loop -> listen_sockfd = listen_sockfd;
+  TAILQ_INIT( & loop -> pending_writes);
+  TAILQ_INIT( & loop -> durable_waits);
+  loop -> sync_efd = -1;
+  if (storage_is_durable()) {
+    loop -> sync_efd = eventfd(0, EFD_CLOEXEC);
+    if (loop -> sync_efd == SYSCALL_ERROR || storage_add_sync_listener(loop -> sync_efd) != 0) {
+      syslog(LOG_ERR, "sync eventfd setup failed: %s", strerror(errno));
+      if (loop -> sync_efd != SYSCALL_ERROR) {
+        close(loop -> sync_efd);
+      }
+      return -1;
+    }
+  }
+  if (ring_setup( & loop -> ring, URING_ENTRIES) != 0) {
+    close_sync_efd(loop);
+    return -1;
+  }
+  loop -> conns = (struct uring_conn * ) calloc(URING_MAX_CONNS, sizeof(struct uring_conn));
+  loop -> free_slots = (int * ) calloc(URING_MAX_CONNS, sizeof(int));
+  loop -> buffers = (char * ) malloc((size_t) URING_MAX_CONNS * URING_BUF_SIZE);
+  if (loop -> conns == NULL || loop -> free_slots == NULL || loop -> buffers == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    free(loop -> conns);
+    free(loop -> free_slots);
+    free(loop -> buffers);
+    ring_teardown( & loop -> ring);
+    close_sync_efd(loop);
+    return -1;
+  }
+  struct iovec * iovecs = (struct iovec * ) calloc(URING_MAX_CONNS, sizeof(struct iovec));
+  for (int i = 0; i < URING_MAX_CONNS; i++) {
+    loop -> conns[i].slot = i;
+    loop -> conns[i].client_sockfd = -1;
+    loop -> free_slots[i] = URING_MAX_CONNS - 1 - i;
+    if (iovecs != NULL) {
+      iovecs[i].iov_base = loop -> buffers + (size_t) i * URING_BUF_SIZE;
+      iovecs[i].iov_len = URING_BUF_SIZE;
+    }
+  }
+  loop -> num_free = URING_MAX_CONNS;
+
+  // Registration only saves per-request page pinning and fd lookups; plain READ/WRITE still work without it
+  loop -> fixed_buffers = iovecs != NULL &&
+    syscall(__NR_io_uring_register, loop -> ring.ring_fd, IORING_REGISTER_BUFFERS, iovecs, URING_MAX_CONNS) == 0;
+  free(iovecs);
+  // A segmented log has no single long-lived file to register
+  int file_fd = storage_file_fd();
+  loop -> fixed_file = file_fd != -1 &&
+    syscall(__NR_io_uring_register, loop -> ring.ring_fd, IORING_REGISTER_FILES, & file_fd, 1) == 0;
+  if (!loop -> fixed_buffers || (!loop -> fixed_file && file_fd != -1)) {
+    syslog(LOG_WARNING, "io_uring registration failed (buffers %d, file %d), using unregistered I/O", loop -> fixed_buffers, loop -> fixed_file);
+  }
+  return 0;
+}
+
+static void loop_destroy(struct uring_loop * loop) {
+  for (int i = 0; i < URING_MAX_CONNS; i++) {
+    if (loop -> conns[i].client_sockfd != -1) {
+      close(loop -> conns[i].client_sockfd);
+      line_framer_free( & loop -> conns[i].framer);
+    }
+  }
+  ring_teardown( & loop -> ring); // cancels anything still in flight before the buffers are freed
+  for (int i = 0; i < URING_MAX_CONNS; i++) {
+    release_io_segment( & loop -> conns[i]);
+  }
+  close_sync_efd(loop);
+  if (loop -> owns_listener) {
+    close(loop -> listen_sockfd);
+  }
+  free(loop -> buffers);
+  free(loop -> conns);
+  free(loop -> free_slots);
+}
+
+int uring_loop_start(int requested_rings, int listen_sockfd, const int * shard_fds) {
+  if (!config.backend -> storage_log) {
+    syslog(LOG_ERR, "io_uring mode needs the file backend");
+    return -1;
+  }
+  num_loops = 0;
+  int rings = requested_rings > 0 ? requested_rings : 1;
+  loops = (struct uring_loop * ) calloc(rings, sizeof(struct uring_loop));
+  if (loops == NULL) {
+    syslog(LOG_ERR, "Malloc failed: %s", strerror(errno));
+    return -1;
+  }
+  rings_running = true;
+  for (int i = 0; i < rings; i++) {
+    if (loop_init( & loops[i], shard_fds != NULL ? shard_fds[i] : listen_sockfd) != 0) {
+      syslog(LOG_ERR, "io_uring setup failed: %s", strerror(errno));
+      uring_loop_stop();
+      return -1;
+    }
+    if (pthread_create( & loops[i].thread, NULL, uring_loop_thread, & loops[i]) != 0) {
+      perror("pthread_create");
+      loop_destroy( & loops[i]);
+      uring_loop_stop();
+      return -1;
+    }
+    num_loops++;
+  }
+  // Shard sockets are only taken over once every ring is up, so a failed start leaves them to the epoll fallback
+  for (int i = 0; i < num_loops; i++) {
+    loops[i].owns_listener = (shard_fds != NULL);
+  }
+  syslog(LOG_INFO, "Started %d io_uring rings", num_loops);
+  return 0;
+}
+
+void uring_loop_stop(void) {
+  if (loops == NULL) {
+    return;
+  }
+  unsigned long long records = 0;
+  unsigned long long enter_calls = 0;
+  rings_running = false;
+  for (int i = 0; i < num_loops; i++) {
+    pthread_join(loops[i].thread, NULL);
+    records += loops[i].records;
+    enter_calls += loops[i].enter_calls;
+    if (loops[i].owns_listener) {
+      syslog(LOG_INFO, "Accept shard %d: %llu connections", i, (unsigned long long) atomic_load( & loops[i].accepts));
+    }
+    loop_destroy( & loops[i]);
+  }
+  if (num_loops > 0) {
+    syslog(LOG_INFO, "io_uring: %llu records, %llu io_uring_enter calls (%.2f per record)", records, enter_calls,
+      records ? (double) enter_calls / records : 0.0);
+  }
+  free(loops);
+  loops = NULL;
+  num_loops = 0;
+}
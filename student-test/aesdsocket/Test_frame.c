@@ -0,0 +1,98 @@
+#include "unity.h"
+#include <stdint.h>
+#include <string.h>
+#include "../../server/includes/frame.h"
+#include "../../server/includes/line_framer.h"
+
+void test_frame_varint_round_trip()
+{
+    const uint64_t values[] = { 0, 1, 127, 128, 300, 16383, 16384, UINT32_MAX, (uint64_t) UINT32_MAX + 1, UINT64_MAX };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        uint8_t buf[FRAME_VARINT_MAX];
+        size_t len = frame_put_varint(buf, values[i]);
+        TEST_ASSERT_TRUE_MESSAGE(len >= 1 && len <= FRAME_VARINT_MAX, "A varint is 1 to FRAME_VARINT_MAX bytes");
+        uint64_t decoded = 0;
+        TEST_ASSERT_EQUAL_INT((int) len, frame_get_varint(buf, len, &decoded));
+        TEST_ASSERT_EQUAL_UINT64(values[i], decoded);
+    }
+    uint8_t buf[FRAME_VARINT_MAX];
+    TEST_ASSERT_EQUAL_INT_MESSAGE(FRAME_VARINT_MAX, (int) frame_put_varint(buf, UINT64_MAX),
+        "UINT64_MAX takes every varint byte");
+}
+
+void test_frame_varint_truncated()
+{
+    const uint8_t buf[] = { 0xac, 0x82, 0x80, 0x01 };
+    uint64_t value = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, frame_get_varint(buf, 0, &value), "No bytes is a truncated varint");
+    for (size_t len = 1; len < sizeof(buf); len++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, frame_get_varint(buf, len, &value),
+            "A varint cut before its last byte needs more bytes");
+    }
+    TEST_ASSERT_EQUAL_INT(4, frame_get_varint(buf, sizeof(buf), &value));
+    TEST_ASSERT_EQUAL_UINT64(0x20012c, value);
+}
+
+void test_frame_varint_overlong()
+{
+    uint8_t buf[FRAME_VARINT_MAX + 2];
+    memset(buf, 0x80, sizeof(buf));
+    buf[FRAME_VARINT_MAX + 1] = 0x00;
+    uint64_t value = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, frame_get_varint(buf, sizeof(buf), &value),
+        "A varint longer than FRAME_VARINT_MAX bytes is malformed");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, frame_get_varint(buf, FRAME_VARINT_MAX, &value),
+        "FRAME_VARINT_MAX continuation bytes are malformed, not truncated");
+}
+
+void test_frame_varint_oversized()
+{
+    uint8_t buf[FRAME_VARINT_MAX];
+    memset(buf, 0xff, sizeof(buf));
+    buf[FRAME_VARINT_MAX - 1] = 0x01;
+    uint64_t value = 0;
+    TEST_ASSERT_EQUAL_INT(FRAME_VARINT_MAX, frame_get_varint(buf, sizeof(buf), &value));
+    TEST_ASSERT_EQUAL_UINT64(UINT64_MAX, value);
+    buf[FRAME_VARINT_MAX - 1] = 0x02;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, frame_get_varint(buf, sizeof(buf), &value),
+        "A varint with bits past the 64th is malformed");
+    buf[FRAME_VARINT_MAX - 1] = 0x7f;
+    TEST_ASSERT_EQUAL_INT(-1, frame_get_varint(buf, sizeof(buf), &value));
+}
+
+void test_frame_decode()
+{
+    char buf[FRAME_HEADER_MAX + 5];
+    size_t header_len = frame_encode_header((uint8_t *) buf, FRAME_DATA, 5);
+    memcpy(buf + header_len, "hello", 5);
+    uint8_t type = 0;
+    const char *payload = NULL;
+    size_t len = 0;
+    size_t consumed = 0;
+    for (size_t avail = 0; avail < header_len + 5; avail++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, frame_decode(buf, avail, &type, &payload, &len, &consumed),
+            "A partial frame needs more bytes");
+    }
+    TEST_ASSERT_EQUAL_INT(1, frame_decode(buf, header_len + 5, &type, &payload, &len, &consumed));
+    TEST_ASSERT_EQUAL_UINT8(FRAME_DATA, type);
+    TEST_ASSERT_EQUAL_INT(5, (int) len);
+    TEST_ASSERT_EQUAL_MEMORY("hello", payload, 5);
+    TEST_ASSERT_EQUAL_INT((int) (header_len + 5), (int) consumed);
+}
+
+void test_frame_decode_max_record()
+{
+    char buf[FRAME_HEADER_MAX];
+    uint8_t type = 0;
+    const char *payload = NULL;
+    size_t len = 0;
+    size_t consumed = 0;
+    size_t header_len = frame_encode_header((uint8_t *) buf, FRAME_DATA, FRAMER_MAX_RECORD - FRAME_HEADER_MAX);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, frame_decode(buf, header_len, &type, &payload, &len, &consumed),
+        "The largest frame the framer can buffer waits for its payload");
+    header_len = frame_encode_header((uint8_t *) buf, FRAME_DATA, FRAMER_MAX_RECORD - FRAME_HEADER_MAX + 1);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, frame_decode(buf, header_len, &type, &payload, &len, &consumed),
+        "A frame the framer could never buffer whole is rejected from its header");
+    header_len = frame_encode_header((uint8_t *) buf, FRAME_DATA, UINT64_MAX);
+    TEST_ASSERT_EQUAL_INT(-1, frame_decode(buf, header_len, &type, &payload, &len, &consumed));
+}
@@ -0,0 +1,142 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../server/includes/frame.h"
+#include "../../server/includes/line_framer.h"
+
+/**
+* Copy len bytes into the framer as one recv() would.
+*/
+static void receive(struct line_framer *framer, const char *data, size_t len)
+{
+    while (len > 0) {
+        size_t avail = 0;
+        char *space = line_framer_recv_space(framer, &avail);
+        TEST_ASSERT_NOT_NULL(space);
+        size_t n = len < avail ? len : avail;
+        memcpy(space, data, n);
+        line_framer_commit(framer, n);
+        data += n;
+        len -= n;
+    }
+}
+
+void test_line_framer_records_split_across_reads()
+{
+    struct line_framer framer;
+    line_framer_init(&framer);
+    const char *record = NULL;
+    size_t len = 0;
+    receive(&framer, "hel", 3);
+    TEST_ASSERT_FALSE(line_framer_next(&framer, &record, &len));
+    TEST_ASSERT_EQUAL_INT(3, (int) line_framer_pending(&framer));
+    receive(&framer, "lo\nwor", 6);
+    TEST_ASSERT_TRUE(line_framer_next(&framer, &record, &len));
+    TEST_ASSERT_EQUAL_INT(6, (int) len);
+    TEST_ASSERT_EQUAL_MEMORY("hello\n", record, 6);
+    TEST_ASSERT_FALSE(line_framer_next(&framer, &record, &len));
+    receive(&framer, "ld\n\nx", 5);
+    TEST_ASSERT_TRUE(line_framer_next(&framer, &record, &len));
+    TEST_ASSERT_EQUAL_INT(6, (int) len);
+    TEST_ASSERT_EQUAL_MEMORY("world\n", record, 6);
+    TEST_ASSERT_TRUE_MESSAGE(line_framer_next(&framer, &record, &len), "An empty line is a record");
+    TEST_ASSERT_EQUAL_INT(1, (int) len);
+    TEST_ASSERT_FALSE(line_framer_next(&framer, &record, &len));
+    TEST_ASSERT_EQUAL_INT(1, (int) line_framer_pending(&framer));
+    line_framer_free(&framer);
+}
+
+void test_line_framer_record_larger_than_buffer()
+{
+    struct line_framer framer;
+    line_framer_init(&framer);
+    static char big[3 * FRAMER_INITIAL_SIZE + 1];
+    memset(big, 'a', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\n';
+    receive(&framer, "x\n", 2);
+    for (size_t sent = 0; sent < sizeof(big); sent += 1000) {
+        size_t n = sizeof(big) - sent < 1000 ? sizeof(big) - sent : 1000;
+        receive(&framer, big + sent, n);
+    }
+    const char *record = NULL;
+    size_t len = 0;
+    TEST_ASSERT_TRUE(line_framer_next(&framer, &record, &len));
+    TEST_ASSERT_EQUAL_INT(2, (int) len);
+    TEST_ASSERT_TRUE(line_framer_next(&framer, &record, &len));
+    TEST_ASSERT_EQUAL_INT((int) sizeof(big), (int) len);
+    TEST_ASSERT_EQUAL_MEMORY(big, record, sizeof(big));
+    TEST_ASSERT_EQUAL_INT(0, (int) line_framer_pending(&framer));
+    line_framer_free(&framer);
+}
+
+void test_line_framer_max_record()
+{
+    struct line_framer framer;
+    line_framer_init(&framer);
+    size_t received = 0;
+    size_t avail = 0;
+    char *space;
+    while ((space = line_framer_recv_space(&framer, &avail)) != NULL) {
+        TEST_ASSERT_TRUE_MESSAGE(received < FRAMER_MAX_RECORD, "The framer grows past FRAMER_MAX_RECORD");
+        memset(space, 'a', avail);
+        line_framer_commit(&framer, avail);
+        received += avail;
+    }
+    TEST_ASSERT_TRUE_MESSAGE(received >= FRAMER_MAX_RECORD, "The framer gave up before FRAMER_MAX_RECORD");
+    const char *record = NULL;
+    size_t len = 0;
+    TEST_ASSERT_FALSE(line_framer_next(&framer, &record, &len));
+    line_framer_free(&framer);
+}
+
+void test_line_framer_frames_split_across_reads()
+{
+    struct line_framer framer;
+    line_framer_init(&framer);
+    char wire[2 * FRAME_HEADER_MAX + 300];
+    char payload[300];
+    memset(payload, 0xff, sizeof(payload));
+    size_t wire_len = frame_encode_header((uint8_t *) wire, FRAME_DATA, sizeof(payload));
+    memcpy(wire + wire_len, payload, sizeof(payload));
+    wire_len += sizeof(payload);
+    wire_len += frame_encode_header((uint8_t *) wire + wire_len, FRAME_STATS, 0);
+    uint8_t type = 0;
+    const char *frame = NULL;
+    size_t len = 0;
+    // One byte per read: the two byte length header and the payload are both split
+    for (size_t i = 0; i < wire_len - 1; i++) {
+        receive(&framer, wire + i, 1);
+        if (i + 1 < sizeof(payload) + 3) {
+            TEST_ASSERT_EQUAL_INT(0, line_framer_peek_frame(&framer, &type));
+            TEST_ASSERT_EQUAL_INT(0, line_framer_next_frame(&framer, &type, &frame, &len));
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(1, line_framer_peek_frame(&framer, &type));
+    TEST_ASSERT_EQUAL_UINT8(FRAME_DATA, type);
+    TEST_ASSERT_EQUAL_INT(1, line_framer_next_frame(&framer, &type, &frame, &len));
+    TEST_ASSERT_EQUAL_INT((int) sizeof(payload), (int) len);
+    TEST_ASSERT_EQUAL_MEMORY(payload, frame, sizeof(payload));
+    TEST_ASSERT_EQUAL_INT(0, line_framer_next_frame(&framer, &type, &frame, &len));
+    receive(&framer, wire + wire_len - 1, 1);
+    TEST_ASSERT_EQUAL_INT(1, line_framer_next_frame(&framer, &type, &frame, &len));
+    TEST_ASSERT_EQUAL_UINT8(FRAME_STATS, type);
+    TEST_ASSERT_EQUAL_INT(0, (int) len);
+    TEST_ASSERT_EQUAL_INT(0, (int) line_framer_pending(&framer));
+    line_framer_free(&framer);
+}
+
+void test_line_framer_malformed_frame()
+{
+    struct line_framer framer;
+    line_framer_init(&framer);
+    char wire[FRAME_VARINT_MAX + 1];
+    memset(wire, 0x80, sizeof(wire));
+    receive(&framer, wire, sizeof(wire));
+    uint8_t type = 0;
+    const char *frame = NULL;
+    size_t len = 0;
+    TEST_ASSERT_EQUAL_INT(-1, line_framer_peek_frame(&framer, &type));
+    TEST_ASSERT_EQUAL_INT(-1, line_framer_next_frame(&framer, &type, &frame, &len));
+    line_framer_free(&framer);
+}
@@ -0,0 +1,86 @@
+#include "unity.h"
+#include <stdint.h>
+#include <string.h>
+#include "../../server/includes/aesdsocket.h"
+
+/**
+* Parse the NUL terminated command, returning parse_seekto()'s result.
+*/
+static int parse(const char *command, uint32_t *write_cmd, uint32_t *write_cmd_offset)
+{
+    return parse_seekto(command, strlen(command), write_cmd, write_cmd_offset);
+}
+
+void test_parse_seekto_valid()
+{
+    uint32_t write_cmd = 0;
+    uint32_t write_cmd_offset = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, parse("AESDCHAR_IOCSEEKTO:3,14", &write_cmd, &write_cmd_offset),
+        "A well formed command should parse");
+    TEST_ASSERT_EQUAL_UINT32(3, write_cmd);
+    TEST_ASSERT_EQUAL_UINT32(14, write_cmd_offset);
+}
+
+void test_parse_seekto_trailing_newline()
+{
+    uint32_t write_cmd = 0;
+    uint32_t write_cmd_offset = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, parse("AESDCHAR_IOCSEEKTO:7,0\n", &write_cmd, &write_cmd_offset),
+        "One trailing newline terminates the command");
+    TEST_ASSERT_EQUAL_UINT32(7, write_cmd);
+    TEST_ASSERT_EQUAL_UINT32(0, write_cmd_offset);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, parse("AESDCHAR_IOCSEEKTO:7,0\n\n", &write_cmd, &write_cmd_offset),
+        "Only one trailing newline is allowed");
+}
+
+void test_parse_seekto_missing_comma()
+{
+    uint32_t write_cmd = 0;
+    uint32_t write_cmd_offset = 0;
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:12", &write_cmd, &write_cmd_offset));
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:1 2", &write_cmd, &write_cmd_offset));
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:1;2\n", &write_cmd, &write_cmd_offset));
+}
+
+void test_parse_seekto_garbage_after_numbers()
+{
+    uint32_t write_cmd = 0;
+    uint32_t write_cmd_offset = 0;
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:1,2x", &write_cmd, &write_cmd_offset));
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:1,2 \n", &write_cmd, &write_cmd_offset));
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:1,2,3", &write_cmd, &write_cmd_offset));
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:1,2\nx", &write_cmd, &write_cmd_offset));
+}
+
+void test_parse_seekto_empty_field()
+{
+    uint32_t write_cmd = 0;
+    uint32_t write_cmd_offset = 0;
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:", &write_cmd, &write_cmd_offset));
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:\n", &write_cmd, &write_cmd_offset));
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:,5", &write_cmd, &write_cmd_offset));
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:5,", &write_cmd, &write_cmd_offset));
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:5,\n", &write_cmd, &write_cmd_offset));
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:-1,5", &write_cmd, &write_cmd_offset));
+}
+
+void test_parse_seekto_u32_range()
+{
+    uint32_t write_cmd = 0;
+    uint32_t write_cmd_offset = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, parse("AESDCHAR_IOCSEEKTO:4294967295,4294967295", &write_cmd, &write_cmd_offset),
+        "UINT32_MAX fits in both fields");
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, write_cmd);
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, write_cmd_offset);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, parse("AESDCHAR_IOCSEEKTO:4294967296,0", &write_cmd, &write_cmd_offset),
+        "UINT32_MAX+1 must not wrap to 0");
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:0,4294967296", &write_cmd, &write_cmd_offset));
+    TEST_ASSERT_EQUAL_INT(-1, parse("AESDCHAR_IOCSEEKTO:99999999999999999999,0", &write_cmd, &write_cmd_offset));
+}
+
+void test_parse_seekto_short_command()
+{
+    uint32_t write_cmd = 0;
+    uint32_t write_cmd_offset = 0;
+    TEST_ASSERT_EQUAL_INT(-1, parse_seekto("AESDCHAR_IOC", 12, &write_cmd, &write_cmd_offset));
+}